@@ -86,6 +86,50 @@
  */
 + (BOOL)checkSentApnsModeForFreshInstall;
 
+/** @name Upload statistics */
+
+/**
+ Number of log lines in local database not uploaded yet, including the ones in flight. It's a query of database, not call it too often.
+ */
+@property (nonatomic, readonly) NSInteger backlogDepth;
+
+/**
+ Number of log lines to select for next upload. It starts from 100, doubles when a full batch is uploaded fast, and halves when upload fails or is slow.
+ */
+@property (nonatomic, readonly) NSInteger uploadBatchSize;
+
+/**
+ Number of log batches successfully uploaded since App launch.
+ */
+@property (nonatomic, readonly) NSInteger uploadBatchesSent;
+
+/**
+ JSON bytes (before compression) of last successfully uploaded batch.
+ */
+@property (nonatomic, readonly) NSUInteger lastUploadBatchBytes;
+
+/**
+ Average JSON bytes (before compression) per successfully uploaded batch since App launch.
+ */
+@property (nonatomic, readonly) NSUInteger averageUploadBatchBytes;
+
+/** @name Retention */
+
+/**
+ Bytes used by logcache.db, not including free pages waiting for vacuum. When it's over cap (NSUserDefaults "LOG_DB_MAX_BYTES", default 8MB), or not uploaded rows are over cap (NSUserDefaults "LOG_DB_MAX_ROWS", default 20000), oldest pending logs are evicted by priority: regular location (19) and duplicated heartbeats first, then others. App session (8103, 8104, 8105), push result (8203) and tags (8997, 8998, 8999) are never evicted.
+ */
+@property (nonatomic, readonly) unsigned long long databaseSize;
+
+/**
+ Number of log lines evicted by retention cap since App launch.
+ */
+@property (nonatomic, readonly) NSInteger evictedLogCount;
+
+/**
+ Number of superseded log lines dropped before upload since App launch, for example older heartbeats, consecutive regular locations, unchanged time offset, and tag add followed by delete of same key.
+ */
+@property (nonatomic, readonly) NSInteger coalescedLogCount;
+
 @end
 
 #import "SHApp.h"
@@ -23,15 +23,44 @@
 #endif
 #import "SHInstall.h" //for register install
 #import "SHUtils.h" //for streetHawkIsEnabled
+#import "SHRequestJournal.h" //for clear journal of fresh install
 
 #define tableName @"table_log" //not change table name, if need upgrade db schema, change to another file.
 #define LOG_UPLOAD_INTERVAL 50  //local has this number then upload
-#define LOAD_LOG_NUMBER     100 //when upload select how many
+#define LOAD_LOG_NUMBER     100 //when upload select how many at the beginning, later it's adapted by upload speed.
+#define LOAD_LOG_MIN        20 //adaptive batch size not shrink below this.
+#define LOAD_LOG_MAX        800 //adaptive batch size not grow above this.
+#define LOG_UPLOAD_FAST     2 //seconds, a full batch uploaded within this time grows next batch.
+#define LOG_UPLOAD_SLOW     10 //seconds, a batch uploaded longer than this, or fail, shrinks next batch.
+#define LOG_UPLOAD_CONCURRENT   3 //batches in flight at the same time, not more than SHRequest queue's max concurrent number.
+#define LOG_REQUEST_TIMEOUT 60 //seconds, SHRequest's timeout in foreground, background one is shorter.
+#define LOG_LEASE_QUEUE_WAIT    120 //seconds, allowance for a batch waiting in request queue before its first send. Lease of a batch lasts upload retry policy's worst case plus this.
+
+#define LOG_VACUUM_DELAY    10 //seconds after launch to convert database of previous version to incremental auto vacuum, full VACUUM of a big backlog must not block launch.
+
+#define LOG_STATUS_PENDING  0 //not uploaded
+#define LOG_STATUS_SENT     1 //uploaded, only kept in simulator for debug
+#define LOG_STATUS_LEASED   2 //selected by an in-flight upload, `lease` is the batch id
+#define LOG_BATCH_LATENCY   0.05 //seconds a log line may wait in memory, so that logs happen together are written in one transaction.
+#define LOG_BATCH_MAX       64 //pending log lines reach this number are written immediately without waiting LOG_BATCH_LATENCY.
+
+#define metaTableName @"table_meta" //key/value for logger's own state, written in same transaction as log rows.
 
 #define FGBG_SESSION    @"FGBG_SESSION" //record current session id
 
 #define MAX_LOGID       @"MAX_LOGID" //local SQLite table's log id increase, this field records latest inserted max logid.
 
+#define PREVIOUS_VISIBLE_STATUS     @"Previous_Visible_Status" //last App visible/invisible code, to check they come in pair.
+#define PREVIOUS_VISIBLE_TIME       @"Previous_Visible_Time" //time of last App to visible, to calculate session duration.
+
+#define LOG_DB_MAX_ROWS     @"LOG_DB_MAX_ROWS" //optional NSUserDefaults number to cap not uploaded rows in logcache.db, default LOG_DB_DEFAULT_ROWS.
+#define LOG_DB_MAX_BYTES    @"LOG_DB_MAX_BYTES" //optional NSUserDefaults number to cap logcache.db file size, default LOG_DB_DEFAULT_BYTES.
+#define LOG_DB_DEFAULT_ROWS     20000
+#define LOG_DB_DEFAULT_BYTES    (8 * 1024 * 1024)
+#define LOG_DB_EVICT_TARGET     0.9 //when over cap, evict to this ratio of cap, so not evict again for every new log.
+
+#define LOG_DB_SYNCHRONOUS  @"LOG_DB_SYNCHRONOUS" //optional NSUserDefaults number to tune logcache.db `PRAGMA synchronous`: 0 = OFF, 1 = NORMAL (default), 2 = FULL. With WAL journal NORMAL is durable against App crash, only lose last transactions in power loss.
+
 enum
 {
     LOG_COL_LOGID,
@@ -46,33 +75,320 @@ enum
     LOG_COL_MLOC,
     LOG_COL_MSGID,
     LOG_COL_PUSHRESULT,
+    LOG_COL_LEASE,
+    LOG_COL_LEASE_EXPIRY,
 };
 
 #import <sqlite3.h>
 
+/**
+ How a pending log line is merged or dropped when a later one supersedes it. Used by `coalescePendingLogs:`.
+ */
+enum SHLogCoalesceRule
+{
+    SHLogCoalesceRule_KeepLatest, //only the latest one is useful, older ones are dropped.
+    SHLogCoalesceRule_KeepLastOfRun, //a run of consecutive same code keeps the last one, any other code breaks the run.
+    SHLogCoalesceRule_DropRepeatedValue, //dropped if comment is same as previous one of same code, only changes are sent.
+    SHLogCoalesceRule_TagSet, //add tag: earlier add or increment of same key is dropped.
+    SHLogCoalesceRule_TagIncrement, //increment tag: kept, but dropped by later add or delete of same key.
+    SHLogCoalesceRule_TagDelete, //delete tag: kept, earlier add or increment of same key is dropped.
+};
+typedef enum SHLogCoalesceRule SHLogCoalesceRule;
+
+//Codes not listed here are never coalesced.
+static const struct
+{
+    int code;
+    SHLogCoalesceRule rule;
+} shLogCoalesceRules[] =
+{
+    {LOG_CODE_HEARTBEAT,        SHLogCoalesceRule_KeepLatest},
+    {LOG_CODE_LOCATION_MORE,    SHLogCoalesceRule_KeepLastOfRun},
+    {LOG_CODE_TIMEOFFSET,       SHLogCoalesceRule_DropRepeatedValue},
+    {LOG_CODE_TAG_ADD,          SHLogCoalesceRule_TagSet},
+    {LOG_CODE_TAG_INCREMENT,    SHLogCoalesceRule_TagIncrement},
+    {LOG_CODE_TAG_DELETE,       SHLogCoalesceRule_TagDelete},
+};
+
+/**
+ One log line waiting for group commit. It captures all values at the time of calling `logComment:...`.
+ */
+@interface SHLogEntry : NSObject
+
+@property (nonatomic) NSInteger session;
+@property (nonatomic, strong) NSString *created;
+@property (nonatomic) NSInteger code;
+@property (nonatomic, strong) NSString *comment;
+@property (nonatomic) double lat;
+@property (nonatomic) double lng;
+@property (nonatomic) BOOL isManualLoc;
+@property (nonatomic) NSInteger assocId;
+@property (nonatomic) NSInteger result;
+@property (nonatomic, copy) SHCallbackHandler handler;
+@property (nonatomic, strong) NSDictionary *metaUpdates; //meta key/value changed together with this log line, nil if nothing to change.
+
+@end
+
+@implementation SHLogEntry
+
+@end
+
+/**
+ Log lines selected from database for one upload. The "records" JSON is encoded directly while walking the SQLite cursor, not by building dictionaries and serializing them.
+ */
+@interface SHLogBatch : NSObject
+
+@property (nonatomic, strong) NSMutableData *recordsJson; //UTF-8 bytes of "records" JSON array.
+@property (nonatomic, strong) NSMutableArray *logIds; //log id of each record, used to clear them after upload.
+@property (nonatomic) BOOL hasHeartbeat; //contains code 8051.
+@property (nonatomic) BOOL hasLocation; //contains code 19 or 20.
+@property (nonatomic) BOOL isFull; //selected as many records as requested, means local database probably has more.
+@property (nonatomic) NSInteger leaseId; //rows of this batch are leased by this id until upload finish.
+
+@end
+
+@implementation SHLogBatch
+
+@end
+
+#pragma mark - JSON encoder
+
+//Append bytes into JSON buffer as they are.
+static void shJsonAppendRaw(NSMutableData *buffer, const char *bytes, size_t length)
+{
+    [buffer appendBytes:bytes length:length];
+}
+
+//Append c-string into JSON buffer as it is, used for punctuation and keys which not need escape.
+static void shJsonAppendLiteral(NSMutableData *buffer, const char *literal)
+{
+    [buffer appendBytes:literal length:strlen(literal)];
+}
+
+//Append UTF-8 c-string as JSON string value with quote and escape. NULL is treated as empty string, same as `shCstringToNSString`.
+static void shJsonAppendString(NSMutableData *buffer, const char *str)
+{
+    static const char *hexChars = "0123456789abcdef";
+    [buffer appendBytes:"\"" length:1];
+    if (str != NULL)
+    {
+        const char *runStart = str; //bytes not need escape are appended in runs.
+        const char *p = str;
+        for (; *p != '\0'; p++)
+        {
+            unsigned char c = (unsigned char)*p;
+            if (c != '"' && c != '\\' && c >= 0x20)
+            {
+                continue;
+            }
+            [buffer appendBytes:runStart length:p - runStart];
+            switch (c)
+            {
+                case '"': shJsonAppendLiteral(buffer, "\\\""); break;
+                case '\\': shJsonAppendLiteral(buffer, "\\\\"); break;
+                case '\n': shJsonAppendLiteral(buffer, "\\n"); break;
+                case '\r': shJsonAppendLiteral(buffer, "\\r"); break;
+                case '\t': shJsonAppendLiteral(buffer, "\\t"); break;
+                default:
+                {
+                    char escaped[6] = {'\\', 'u', '0', '0', hexChars[c >> 4], hexChars[c & 0xF]};
+                    [buffer appendBytes:escaped length:6];
+                    break;
+                }
+            }
+            runStart = p + 1;
+        }
+        [buffer appendBytes:runStart length:p - runStart];
+    }
+    [buffer appendBytes:"\"" length:1];
+}
+
+//Append NSString as JSON string value, nil is JSON null.
+static void shJsonAppendNSString(NSMutableData *buffer, NSString *str)
+{
+    if (str == nil || ![str isKindOfClass:[NSString class]])
+    {
+        shJsonAppendLiteral(buffer, "null");
+    }
+    else
+    {
+        shJsonAppendString(buffer, [str UTF8String]);
+    }
+}
+
+static void shJsonAppendInt(NSMutableData *buffer, long long value)
+{
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%lld", value);
+    [buffer appendBytes:number length:length];
+}
+
+static void shJsonAppendDouble(NSMutableData *buffer, double value)
+{
+    if (!isfinite(value)) //JSON not support nan or inf.
+    {
+        shJsonAppendLiteral(buffer, "null");
+        return;
+    }
+    char number[32];
+    int length = snprintf(number, sizeof(number), "%.15g", value);
+    [buffer appendBytes:number length:length];
+}
+
+//Append `,"key":` for next member of current JSON object. The first member of a record is always "log_id", so all others start with comma.
+static void shJsonAppendKey(NSMutableData *buffer, const char *key)
+{
+    shJsonAppendLiteral(buffer, ",\"");
+    shJsonAppendLiteral(buffer, key);
+    shJsonAppendLiteral(buffer, "\":");
+}
+
+//Find the outer "{" and "}" of a serialized JSON object, ignoring white space around. Return NO if not look like an object.
+static BOOL shJsonObjectBounds(const char *json, const char **begin, const char **end)
+{
+    if (json == NULL)
+    {
+        return NO;
+    }
+    const char *head = json;
+    while (*head == ' ' || *head == '\t' || *head == '\r' || *head == '\n')
+    {
+        head++;
+    }
+    const char *tail = head + strlen(head);
+    while (tail > head && (tail[-1] == ' ' || tail[-1] == '\t' || tail[-1] == '\r' || tail[-1] == '\n'))
+    {
+        tail--;
+    }
+    if (tail - head < 2 || *head != '{' || tail[-1] != '}')
+    {
+        return NO;
+    }
+    *begin = head;
+    *end = tail - 1;
+    return YES;
+}
+
+//Whether `begin`~`end` (inclusive) is a valid JSON object which can be spliced without change. Must parse, because one malformed comment, for example tag string only looks like an object, makes whole batch invalid and server rejects it for ever. ": null" needs normalization same as `shParseObjectToDict`.
+static BOOL shJsonObjectIsVerbatim(const char *begin, const char *end)
+{
+    NSData *objectData = [NSData dataWithBytesNoCopy:(void *)begin length:end - begin + 1 freeWhenDone:NO];
+    const char *nullValue = strcasestr(begin, ": null");
+    if (nullValue != NULL && nullValue < end)
+    {
+        return NO;
+    }
+    NSObject *parsed = [NSJSONSerialization JSONObjectWithData:objectData options:0 error:nil];
+    return [parsed isKindOfClass:[NSDictionary class]];
+}
+
+//Splice an already serialized JSON object from database. If `asMembers` = YES the object's members are merged into current record, otherwise the whole object is appended as a value. Comment not a valid JSON object, or need normalization, is parsed and serialized again in tolerant way as before. Return NO if it still cannot be used.
+static BOOL shJsonSpliceObject(NSMutableData *buffer, const char *comment, BOOL asMembers)
+{
+    const char *begin = NULL;
+    const char *end = NULL;
+    NSString *normalized = nil; //keep alive when fallback.
+    if (!shJsonObjectBounds(comment, &begin, &end) || !shJsonObjectIsVerbatim(begin, end))
+    {
+        normalized = shSerializeObjToJson(shParseObjectToDict(shCstringToNSString(comment)));
+        if (!shJsonObjectBounds([normalized UTF8String], &begin, &end))
+        {
+            return NO;
+        }
+    }
+    if (asMembers)
+    {
+        const char *membersBegin = begin + 1;
+        while (membersBegin < end && (*membersBegin == ' ' || *membersBegin == '\t' || *membersBegin == '\r' || *membersBegin == '\n'))
+        {
+            membersBegin++;
+        }
+        if (membersBegin < end) //empty object has nothing to merge
+        {
+            shJsonAppendLiteral(buffer, ",");
+            shJsonAppendRaw(buffer, membersBegin, end - membersBegin);
+        }
+    }
+    else
+    {
+        shJsonAppendRaw(buffer, begin, end - begin + 1);
+    }
+    return YES;
+}
+
 @interface SHLogger()
 {
     sqlite3 *database;
+    sqlite3_stmt *insert_stmt; //prepared once when open database, reset and re-bind for each log.
+    sqlite3_stmt *meta_write_stmt; //prepared once when open database, write one key/value into meta table.
 }
 
 @property (nonatomic) dispatch_queue_t logger_queue;  //queue used for db operation and upload request
-@property (nonatomic) dispatch_semaphore_t upload_semaphore;  //a semaphore to control selecting and uploading, make sure it happen in sequence, so that avoid selecting duplicated records which the previous uploading is not finished and database not deleted.
+@property (nonatomic) dispatch_semaphore_t upload_semaphore;  //limit in-flight batches to LOG_UPLOAD_CONCURRENT. Batches not overlap because selected rows are leased.
+@property (nonatomic) NSInteger lastLeaseId;  //increase for each batch. Leases not survive App restart, so not persist it.
 @property (nonatomic) int numLogsWritten;  //current local record number
 @property (nonatomic) NSInteger fgbgSession;  //When App start or go to FG, session+1; when App go to BG session ends.
+@property (nonatomic) NSInteger previousVisibleStatus;  //memory copy of meta PREVIOUS_VISIBLE_STATUS.
+@property (nonatomic) NSTimeInterval previousVisibleTime;  //memory copy of meta PREVIOUS_VISIBLE_TIME, 0 means not set.
+@property (nonatomic, strong) NSMutableArray *pendingLogs;  //log lines not written to database yet, FIFO of `SHLogEntry`.
+@property (nonatomic) dispatch_semaphore_t pending_semaphore;  //protect `pendingLogs` and `isFlushScheduled`, as logs come from any thread.
+@property (nonatomic) BOOL isFlushScheduled;  //a delayed flush is already dispatched to `logger_queue`.
+@property (nonatomic) NSInteger uploadBatchSize;  //number of records to select for next upload, adapted by `adaptUploadBatchSize...`.
+@property (nonatomic) NSInteger uploadBatchesSent;
+@property (nonatomic) NSUInteger uploadBytesSent;  //total JSON bytes of sent batches, to calculate average.
+@property (nonatomic) NSUInteger lastUploadBatchBytes;
+@property (nonatomic) NSInteger storedLogCount;  //rows not uploaded yet in database, kept in memory to check `maxStoredRows` without query.
+@property (nonatomic) NSInteger maxStoredRows;
+@property (nonatomic) unsigned long long maxDatabaseBytes;
+@property (nonatomic) NSInteger evictedLogCount;
+@property (nonatomic) NSInteger coalescedLogCount;
+@property (nonatomic) BOOL needVacuumConversion;  //database created by previous version is not incremental auto vacuum yet, converted by `convertToIncrementalVacuum` after launch.
 
 //Log the information into local sqlite database. Normal events are uploaded after enough number and. Special events (location) are logged and uploaded immediately. This function has the flexibility, however for convenience [StreetHawk sendLogForCode:withComment:] is recommended.
 - (void)logComment:(NSString *)comment atTime:(NSDate *)created forCode:(NSInteger)code forAssocId:(NSInteger)assocId withResult:(NSInteger)result withManualLocation:(BOOL)isManualLoc withManualLat:(double)manualLat withManualLng:(double)manualLng withHandler:(SHCallbackHandler)handler;
+//Add log line into pending list, and schedule a flush to write to database: immediately for force upload code or when list is full, otherwise after LOG_BATCH_LATENCY.
+- (void)enqueueLogEntry:(SHLogEntry *)entry;
+//Write all pending log lines into database in one transaction, then follow the upload rule. Must run in `logger_queue`.
+- (void)flushPendingLogs;
+//Some codes are important and upload to server immediately regardless of local number.
++ (BOOL)isForceUploadCode:(NSInteger)code;
 //Uploads local sqlite's log records to the server. This is automatically called if system determine needs to upload, or user can manually call it to trigger an upload.
 - (void)uploadLogsToServer:(NSInteger)numRecords withHandler:(SHCallbackHandler)handler;
+//If database is over row or byte cap, delete pending logs by priority: first regular location (19) and duplicated heartbeats, then others except App session, push result and tags which server needs for segment and campaign. Must call inside @synchronized(self).
+- (void)enforceRetention;
+//Delete at most `limit` oldest pending rows matching `condition`, return deleted number.
+- (NSInteger)evictPendingLogs:(NSInteger)limit withCondition:(NSString *)condition;
+//Before selecting a batch, drop superseded pending logs in the first `window` pending rows according to `shLogCoalesceRules`.
+- (void)coalescePendingLogs:(NSInteger)window;
+//Lease and post one batch, caller already holds one `upload_semaphore` slot.
+- (void)uploadLeasedBatch:(NSInteger)numRecords withHandler:(SHCallbackHandler)handler;
+//If a `upload_semaphore` slot is free, upload next batch in parallel. Otherwise do nothing, as the in-flight batch drains again when it finishes.
+- (void)drainBacklog;
+//Grow batch size if a full batch is uploaded fast, shrink it if upload fail or slow.
+- (void)adaptUploadBatchSizeForSuccess:(BOOL)isSuccess withDuration:(NSTimeInterval)duration isFullBatch:(BOOL)isFull;
 
 //Open SQLite file, create it on demand.
 - (void)openSqliteDatabase;
-//Loads a given number of log records from new to old
-- (NSMutableArray *)loadLogRecords:(NSInteger)numRecords;
+//Switch database to incremental auto vacuum by one full VACUUM. Run in `logger_queue` after launch as it rewrites the whole file.
+- (void)convertToIncrementalVacuum;
+//Execute sql which not need binding or reading result, such as PRAGMA. Return YES if success.
+- (BOOL)executeSql:(NSString *)sql;
+//Prepare a statement which is kept and reused during logger life cycle. Caller is responsible to finalize it.
+- (sqlite3_stmt *)prepareCachedStatement:(NSString *)sql;
+//Write one meta value by `meta_write_stmt`. Caller should wrap it inside the transaction of log rows.
+- (void)writeMetaValue:(double)value forKey:(NSString *)key;
+//Read one meta value from database. Return NO if not exist, for example meta table not created yet by old version.
++ (BOOL)readMetaValue:(double *)value forKey:(NSString *)key inDatabase:(sqlite3 *)db;
+//Move meta values from NSUserDefaults (used by previous version) into meta table. Only happen once because keys are removed from NSUserDefaults after move.
+- (void)migrateMetaFromUserDefaults;
+//Loads a given number of pending log records from old to new, encoded as upload JSON. The records are leased so other batch not select them again.
+- (SHLogBatch *)loadLogRecords:(NSInteger)numRecords;
+//Return leased records to pending so next upload sends them again.
+- (void)releaseLease:(NSInteger)leaseId;
 //Makes the actual POST request to the server to record the logs.
-- (void)postLogRecords:(NSArray *)logRecords withHandler:(SHCallbackHandler)handler;
-//Clear records not send again.
-- (void)clearLogRecords:(NSArray *)logRecords;
+- (void)postLogRecords:(SHLogBatch *)batch withHandler:(SHCallbackHandler)handler;
+//Clear records not send again. Only rows still leased by `leaseId` are cleared, rows whose lease expired belong to another batch now.
+- (void)clearLogRecords:(NSArray *)logIds withLease:(NSInteger)leaseId;
 
 //As for some reason local App needs to be treated as a fresh new install. This function clear necessary local NSUserDefaults and SQLite so that it starts from beginning. It must perform when App launch and nothing else is done, cannot perform during App running.
 + (void)clearLocalToMakeFreshInstall;
@@ -101,23 +417,59 @@ enum
 {
     if (self = [super init])
     {
-        NSObject *sessionValue = [[NSUserDefaults standardUserDefaults] objectForKey:FGBG_SESSION]; //read history session id
-        if (sessionValue != nil && [sessionValue isKindOfClass:[NSNumber class]])
+        self.logger_queue = dispatch_queue_create("com.streethawk.StreetHawk.logger", NULL); //NULL attribute same as DISPATCH_QUEUE_SERIAL, means this queue is FIFO.
+        self.upload_semaphore = dispatch_semaphore_create(LOG_UPLOAD_CONCURRENT);
+        self.lastLeaseId = 0;
+        self.pendingLogs = [NSMutableArray array];
+        self.pending_semaphore = dispatch_semaphore_create(1);
+        self.isFlushScheduled = NO;
+        self.uploadBatchSize = LOAD_LOG_NUMBER;
+        self.uploadBatchesSent = 0;
+        self.uploadBytesSent = 0;
+        self.lastUploadBatchBytes = 0;
+        self.evictedLogCount = 0;
+        self.coalescedLogCount = 0;
+        self.maxStoredRows = LOG_DB_DEFAULT_ROWS;
+        NSObject *maxRowsVal = [[NSUserDefaults standardUserDefaults] objectForKey:LOG_DB_MAX_ROWS];
+        if (maxRowsVal != nil && [maxRowsVal isKindOfClass:[NSNumber class]] && [(NSNumber *)maxRowsVal integerValue] > 0)
         {
-            self.fgbgSession = [(NSNumber *)sessionValue integerValue];
+            self.maxStoredRows = [(NSNumber *)maxRowsVal integerValue];
         }
-        else
+        self.maxDatabaseBytes = LOG_DB_DEFAULT_BYTES;
+        NSObject *maxBytesVal = [[NSUserDefaults standardUserDefaults] objectForKey:LOG_DB_MAX_BYTES];
+        if (maxBytesVal != nil && [maxBytesVal isKindOfClass:[NSNumber class]] && [(NSNumber *)maxBytesVal longLongValue] > 0)
         {
-            self.fgbgSession = 0;
+            self.maxDatabaseBytes = [(NSNumber *)maxBytesVal unsignedLongLongValue];
         }
-        self.logger_queue = dispatch_queue_create("com.streethawk.StreetHawk.logger", NULL); //NULL attribute same as DISPATCH_QUEUE_SERIAL, means this queue is FIFO.
-        self.upload_semaphore = dispatch_semaphore_create(1);  //happen in sequence
         database = NULL;
+        insert_stmt = NULL;
+        meta_write_stmt = NULL;
         [self openSqliteDatabase];
+        if (self.needVacuumConversion)
+        {
+            dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(LOG_VACUUM_DELAY * NSEC_PER_SEC)), self.logger_queue, ^(void) {
+                [self convertToIncrementalVacuum];
+            });
+        }
+        //read history state from meta table
+        double metaValue = 0;
+        self.fgbgSession = [SHLogger readMetaValue:&metaValue forKey:FGBG_SESSION inDatabase:database] ? (NSInteger)metaValue : 0;
+        self.previousVisibleStatus = [SHLogger readMetaValue:&metaValue forKey:PREVIOUS_VISIBLE_STATUS inDatabase:database] ? (NSInteger)metaValue : 0;
+        self.previousVisibleTime = [SHLogger readMetaValue:&metaValue forKey:PREVIOUS_VISIBLE_TIME inDatabase:database] ? metaValue : 0;
     }
     return self;
 }
 
+- (void)dealloc
+{
+    sqlite3_finalize(insert_stmt); //harmless for NULL
+    insert_stmt = NULL;
+    sqlite3_finalize(meta_write_stmt);
+    meta_write_stmt = NULL;
+    sqlite3_close(database);
+    database = NULL;
+}
+
 #pragma mark - log and upload functions
 
 - (void)logComment:(NSString *)comment atTime:(NSDate *)created forCode:(NSInteger)code forAssocId:(NSInteger)assocId withResult:(NSInteger)result withManualLocation:(BOOL)isManualLoc withManualLat:(double)manualLat withManualLng:(double)manualLng withHandler:(SHCallbackHandler)handler
@@ -140,38 +492,35 @@ enum
         return;
     }
     
+    //meta values changed by this log line, they are written to database in same transaction as the log row.
+    NSMutableDictionary *metaUpdates = nil;
     if (code == LOG_CODE_APP_VISIBLE) //From BG to FG (either launch or resume from BG), is a new session.
     {
         self.fgbgSession++;
-        [[NSUserDefaults standardUserDefaults] setInteger:self.fgbgSession forKey:FGBG_SESSION];
-        [[NSUserDefaults standardUserDefaults] synchronize];
+        metaUpdates = [NSMutableDictionary dictionary];
+        metaUpdates[FGBG_SESSION] = @(self.fgbgSession);
     }
     if (code == LOG_CODE_APP_VISIBLE || code == LOG_CODE_APP_INVISIBLE)
     {
-        //check previous must be reverse side: if now is "to visible" previous must be "to invisible" or none; if now is "to invisible" previous must be "to visible". Crash is an exception but this assert not happen in release so not affect customer.
-        NSInteger previousVisible = 0;
-        NSObject *previousVisibleObj = [[NSUserDefaults standardUserDefaults] objectForKey:@"Previous_Visible_Status"];
-        if (previousVisibleObj != nil && [previousVisibleObj isKindOfClass:[NSNumber class]])
+        if (metaUpdates == nil)
         {
-            previousVisible = [(NSNumber *)previousVisibleObj integerValue];
+            metaUpdates = [NSMutableDictionary dictionary];
         }
+        //check previous must be reverse side: if now is "to visible" previous must be "to invisible" or none; if now is "to invisible" previous must be "to visible". Crash is an exception but this assert not happen in release so not affect customer.
+        NSInteger previousVisible = self.previousVisibleStatus;
         if (code == LOG_CODE_APP_VISIBLE)
         {
-            [[NSUserDefaults standardUserDefaults] setObject:@([[NSDate date] timeIntervalSinceReferenceDate]) forKey:@"Previous_Visible_Time"];
+            self.previousVisibleTime = [[NSDate date] timeIntervalSinceReferenceDate];
+            metaUpdates[PREVIOUS_VISIBLE_TIME] = @(self.previousVisibleTime);
             //NSAssert(previousVisible == 0 || previousVisible == LOG_CODE_SYSTEM_INVISIBLE, @"App to visible but previous is not none or invisible."); //Not do this as it cause crash when debugging.
         }
         if (code == LOG_CODE_APP_INVISIBLE)
         {
             NSAssert(previousVisible == LOG_CODE_APP_VISIBLE, @"App to invisible but previous is not visible.");
             NSDate *visibleTime = nil;
-            NSObject *visibleTimeObj = [[NSUserDefaults standardUserDefaults] objectForKey:@"Previous_Visible_Time"];
-            if (visibleTimeObj != nil && [visibleTimeObj isKindOfClass:[NSNumber class]])
+            if (self.previousVisibleTime != 0)
             {
-                double visibleTimeVal = [(NSNumber *)visibleTimeObj doubleValue];
-                if (visibleTimeVal != 0)
-                {
-                    visibleTime = [NSDate dateWithTimeIntervalSinceReferenceDate:visibleTimeVal];
-                }
+                visibleTime = [NSDate dateWithTimeIntervalSinceReferenceDate:self.previousVisibleTime];
             }
             NSAssert(visibleTime != nil, @"Not have visible time for this invisible.");
             if (visibleTime != nil)
@@ -181,100 +530,273 @@ enum
                 dictAppSession[@"invisible"] = shFormatStreetHawkDate([NSDate date]);
                 dictAppSession[@"duration"] = @([[NSDate date] timeIntervalSinceDate:visibleTime]);
                 [StreetHawk sendLogForCode:LOG_CODE_APP_COMPLETE withComment:shSerializeObjToJson(dictAppSession)];
-                [[NSUserDefaults standardUserDefaults] setObject:@(0) forKey:@"Previous_Visible_Time"];
+                self.previousVisibleTime = 0;
+                metaUpdates[PREVIOUS_VISIBLE_TIME] = @(0);
             }
         }
-        [[NSUserDefaults standardUserDefaults] setObject:@(code) forKey:@"Previous_Visible_Status"]; //all pass, record this time as previous.
-        [[NSUserDefaults standardUserDefaults] synchronize];
+        self.previousVisibleStatus = code; //all pass, record this time as previous.
+        metaUpdates[PREVIOUS_VISIBLE_STATUS] = @(code);
     }
-    handler = [handler copy];
-    dispatch_async(self.logger_queue, ^(void) {
-        //first save to database
-        NSString *columns = @"'status', 'sessionid', 'created', 'code', 'comment', 'lat', 'lng', 'mloc', 'msgid', 'pushresult'";
-        NSString *sql_safe_comment = [comment stringByReplacingOccurrencesOfString:@"'" withString:@"''"];
+    //capture the log line at calling time and put into pending list, it's written to database by group commit on `logger_queue`.
+    SHLogEntry *entry = [[SHLogEntry alloc] init];
 #ifdef SH_FEATURE_LATLNG
-        SHLocationManager *locMan = StreetHawk.locationManager;
-        double lat = isManualLoc ? manualLat : locMan.currentGeoLocation.latitude;
-        double lng = isManualLoc ? manualLng : locMan.currentGeoLocation.longitude;
+    SHLocationManager *locMan = StreetHawk.locationManager;
+    entry.lat = isManualLoc ? manualLat : locMan.currentGeoLocation.latitude;
+    entry.lng = isManualLoc ? manualLng : locMan.currentGeoLocation.longitude;
 #else
-        double lat = 0;
-        double lng = 0;
+    entry.lat = 0;
+    entry.lng = 0;
 #endif
-        BOOL isAppBG = ([UIApplication sharedApplication].applicationState == UIApplicationStateBackground);
-        //session_id must be set for: install_session, install_view, install_enter_exit_view, install_fg_bg; for other log lines it can be null.
-        BOOL requireSession = (code == LOG_CODE_APP_LAUNCH) || (code == LOG_CODE_APP_VISIBLE) || (code == LOG_CODE_APP_INVISIBLE) || (code == LOG_CODE_APP_COMPLETE) || (code == LOG_CODE_VIEW_ENTER) || (code == LOG_CODE_VIEW_EXIT) || (code == LOG_CODE_VIEW_COMPLETE);
-        NSInteger session = (isAppBG && !requireSession) ? 0/*App in BG and not forcely require session id, use 0, later change to NULL*/ : (self.fgbgSession > 0 ? self.fgbgSession : 1/*Phonegap first launch "app did finish launch" delay 2 second, make fgbgSession=0, but enter view called and log null for session_id.*/);
-        NSString *values = [NSString stringWithFormat: @"0, %ld, '%@', %ld, '%@', %f, %f, %d, %ld, '%ld'", (long)session, shFormatStreetHawkDate(created), (long)code, sql_safe_comment, lat, lng, isManualLoc?1:0, (long)assocId, (long)result];
-        NSString *sql_str = [NSString stringWithFormat:@"INSERT OR REPLACE INTO '%@' (%@) VALUES (%@)", tableName, columns, values];
-        @synchronized(self)
-        {
-            sqlite3_stmt *insert_sql = NULL;
-            int prepare_result = sqlite3_prepare_v2(database, [sql_str UTF8String], -1, &insert_sql, NULL);
-            if (prepare_result != SQLITE_OK)
-            {
-                SHLog(@"Could not prepare sql [[[ %@ ]]], Error: %s", sql_str, sqlite3_errmsg(database));
-                assert(NO);
-            }
-            int step_result = sqlite3_step(insert_sql);
+    BOOL isAppBG = ([UIApplication sharedApplication].applicationState == UIApplicationStateBackground);
+    //session_id must be set for: install_session, install_view, install_enter_exit_view, install_fg_bg; for other log lines it can be null.
+    BOOL requireSession = (code == LOG_CODE_APP_LAUNCH) || (code == LOG_CODE_APP_VISIBLE) || (code == LOG_CODE_APP_INVISIBLE) || (code == LOG_CODE_APP_COMPLETE) || (code == LOG_CODE_VIEW_ENTER) || (code == LOG_CODE_VIEW_EXIT) || (code == LOG_CODE_VIEW_COMPLETE);
+    entry.session = (isAppBG && !requireSession) ? 0/*App in BG and not forcely require session id, use 0, later change to NULL*/ : (self.fgbgSession > 0 ? self.fgbgSession : 1/*Phonegap first launch "app did finish launch" delay 2 second, make fgbgSession=0, but enter view called and log null for session_id.*/);
+    entry.created = shFormatStreetHawkDate(created);
+    entry.code = code;
+    entry.comment = comment;
+    entry.isManualLoc = isManualLoc;
+    entry.assocId = assocId;
+    entry.result = result;
+    entry.handler = handler;
+    entry.metaUpdates = metaUpdates;
+    [self enqueueLogEntry:entry];
+}
+
+- (void)enqueueLogEntry:(SHLogEntry *)entry
+{
+    BOOL isForce = [SHLogger isForceUploadCode:entry.code];
+    BOOL flushNow = NO;
+    BOOL flushLater = NO;
+    dispatch_semaphore_wait(self.pending_semaphore, DISPATCH_TIME_FOREVER);
+    [self.pendingLogs addObject:entry];
+    if (isForce || self.pendingLogs.count >= LOG_BATCH_MAX) //force upload code must not wait, and not let pending list grow too big.
+    {
+        flushNow = YES;
+    }
+    else if (!self.isFlushScheduled)
+    {
+        self.isFlushScheduled = YES;
+        flushLater = YES;
+    }
+    dispatch_semaphore_signal(self.pending_semaphore);
+    if (flushNow)
+    {
+        dispatch_async(self.logger_queue, ^(void) {
+            [self flushPendingLogs];
+        });
+    }
+    else if (flushLater)
+    {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(LOG_BATCH_LATENCY * NSEC_PER_SEC)), self.logger_queue, ^(void) {
+            [self flushPendingLogs];
+        });
+    }
+}
+
+- (void)flushPendingLogs
+{
+    NSArray *batch = nil;
+    dispatch_semaphore_wait(self.pending_semaphore, DISPATCH_TIME_FOREVER);
+    batch = self.pendingLogs;
+    self.pendingLogs = [NSMutableArray array];
+    self.isFlushScheduled = NO; //a scheduled flush arrives later finds empty list, it's harmless.
+    dispatch_semaphore_signal(self.pending_semaphore);
+    if (batch.count == 0)
+    {
+        return;
+    }
+    //first save to database, all pending logs in one transaction so only commit once for the batch.
+    @synchronized(self)
+    {
+        BOOL inTransaction = [self executeSql:@"BEGIN IMMEDIATE"];
+        int logid = 0;
+        for (SHLogEntry *entry in batch)
+        {
+            //bind by index, match to the order of columns when prepare `insert_stmt`. No need to escape comment as it's not part of sql string.
+            sqlite3_bind_int64(insert_stmt, 1, entry.session);
+            sqlite3_bind_text(insert_stmt, 2, [entry.created UTF8String], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(insert_stmt, 3, entry.code);
+            sqlite3_bind_text(insert_stmt, 4, [NONULL(entry.comment) UTF8String], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_double(insert_stmt, 5, entry.lat);
+            sqlite3_bind_double(insert_stmt, 6, entry.lng);
+            sqlite3_bind_int(insert_stmt, 7, entry.isManualLoc ? 1 : 0);
+            sqlite3_bind_int64(insert_stmt, 8, entry.assocId);
+            sqlite3_bind_int64(insert_stmt, 9, entry.result);
+            int step_result = sqlite3_step(insert_stmt);
             NSAssert(step_result == SQLITE_DONE, @"Could not perform row insertion: %s", sqlite3_errmsg(database));
             step_result = 0; //disable "Unused variable" due to NSAssert ignored in pods.
-            sqlite3_reset(insert_sql);
-            sqlite3_finalize(insert_sql);
-            insert_sql = NULL;
-            int logid = (int)sqlite3_last_insert_rowid(database);
-            [[NSUserDefaults standardUserDefaults] setObject:@(logid) forKey:MAX_LOGID];
-            [[NSUserDefaults standardUserDefaults] synchronize];
-            SHLog(@"LOG (%d @ %@) <%d> %@.", logid, shFormatStreetHawkDate(created), code, comment);
-        }
-        BOOL isForce = (code == LOG_CODE_LOCATION_GEO || code == LOG_CODE_LOCATION_IBEACON || code == LOG_CODE_LOCATION_DENIED)  //immediately send for geo and ibeacon location, but not for code 19.
-        || (code == LOG_CODE_APP_VISIBLE || code == LOG_CODE_APP_INVISIBLE)  //immediately send for session change
-        || (code == LOG_CODE_TAG_INCREMENT || code == LOG_CODE_TAG_DELETE || code == LOG_CODE_TAG_ADD)  //immediately send for add/remove/increment user tag
-        || (code == LOG_CODE_TIMEOFFSET)  //immediately send for time utc offset change
-        || (code == LOG_CODE_HEARTBEAT)  //immediately send for heart beat
-        || (code == LOG_CODE_PUSH_RESULT); //immediately send for pushresult
-        if (isForce || ((self.numLogsWritten != 0) && (self.numLogsWritten % LOG_UPLOAD_INTERVAL == 0)))
-        {
-            //continue to upload to server, finish will trigger handler
-            [self uploadLogsToServer:LOAD_LOG_NUMBER withHandler:handler];
+            sqlite3_reset(insert_stmt);
+            sqlite3_clear_bindings(insert_stmt);
+            logid = (int)sqlite3_last_insert_rowid(database);
+            SHLog(@"LOG (%d @ %@) <%d> %@.", logid, entry.created, entry.code, entry.comment);
+            [entry.metaUpdates enumerateKeysAndObjectsUsingBlock:^(NSString *key, NSNumber *value, BOOL *stop)
+            {
+                [self writeMetaValue:value.doubleValue forKey:key];
+            }];
+        }
+        [self writeMetaValue:logid forKey:MAX_LOGID]; //same transaction as log rows, so it always matches sqlite_sequence.
+        if (inTransaction && ![self executeSql:@"COMMIT"])
+        {
+            [self executeSql:@"ROLLBACK"];
+            NSAssert(NO, @"Fail to commit %lu log lines.", (unsigned long)batch.count);
+        }
+        else
+        {
+            self.storedLogCount += batch.count;
+        }
+        [self enforceRetention];
+    }
+    //then follow upload rule as each log is written one by one, upload at most once for the whole batch.
+    BOOL needUpload = NO;
+    for (SHLogEntry *entry in batch)
+    {
+        if ([SHLogger isForceUploadCode:entry.code] || ((self.numLogsWritten != 0) && (self.numLogsWritten % LOG_UPLOAD_INTERVAL == 0)))
+        {
+            needUpload = YES;
             self.numLogsWritten = 0;
         }
         else
         {
-            //no need upload to server this time, finish here
             self.numLogsWritten ++;
-            if (handler)
+        }
+    }
+    SHCallbackHandler batchHandler = ^(NSObject *result, NSError *error)
+    {
+        for (SHLogEntry *entry in batch)
+        {
+            if (entry.handler)
             {
-                handler(nil, nil);
+                entry.handler(result, error);
             }
         }
-    });
+    };
+    if (needUpload)
+    {
+        //continue to upload to server, finish will trigger handler
+        [self uploadLogsToServer:self.uploadBatchSize withHandler:batchHandler];
+    }
+    else
+    {
+        //no need upload to server this time, finish here
+        batchHandler(nil, nil);
+    }
+}
+
++ (BOOL)isForceUploadCode:(NSInteger)code
+{
+    return (code == LOG_CODE_LOCATION_GEO || code == LOG_CODE_LOCATION_IBEACON || code == LOG_CODE_LOCATION_DENIED)  //immediately send for geo and ibeacon location, but not for code 19.
+    || (code == LOG_CODE_APP_VISIBLE || code == LOG_CODE_APP_INVISIBLE)  //immediately send for session change
+    || (code == LOG_CODE_TAG_INCREMENT || code == LOG_CODE_TAG_DELETE || code == LOG_CODE_TAG_ADD)  //immediately send for add/remove/increment user tag
+    || (code == LOG_CODE_TIMEOFFSET)  //immediately send for time utc offset change
+    || (code == LOG_CODE_HEARTBEAT)  //immediately send for heart beat
+    || (code == LOG_CODE_PUSH_RESULT); //immediately send for pushresult
 }
 
 - (void)uploadLogsToServer:(NSInteger)numRecords withHandler:(SHCallbackHandler)handler
 {
-    //The database logs are selected and post to server, after post successfully they are removed from database; However if another selecting happen before previous one finish, duplicated records are selected and sent to server. Server expects unique records. Make a semaphore here to let it happen in sequence.
+    //The database logs are selected and post to server, after post successfully they are removed from database. Selected rows are leased so another batch selecting during the post not get duplicated records, server expects unique records. The semaphore only limits how many batches in flight.
     NSAssert(![NSThread isMainThread], @"uploadLogsToServer wait in main thread.");
     if (![NSThread isMainThread])
     {
         dispatch_semaphore_wait(self.upload_semaphore, DISPATCH_TIME_FOREVER);
-        NSArray *logRecords = [self loadLogRecords:numRecords];
-        if (logRecords.count == 0)
+        [self uploadLeasedBatch:numRecords withHandler:handler];
+    }
+}
+
+- (void)uploadLeasedBatch:(NSInteger)numRecords withHandler:(SHCallbackHandler)handler
+{
+    [self coalescePendingLogs:numRecords * 2/*look a bit further so dropped rows are filled by later ones*/];
+    SHLogBatch *batch = [self loadLogRecords:numRecords];
+    if (batch.logIds.count == 0)
+    {
+        dispatch_semaphore_signal(self.upload_semaphore);
+        if (handler)
         {
-            dispatch_semaphore_signal(self.upload_semaphore);
-            if (handler)
-            {
-                handler(nil, nil);
-            }
+            handler(nil, nil);
         }
-        else
+    }
+    else
+    {
+        if (batch.isFull)
+        {
+            [self drainBacklog]; //local has more, for example after long offline, send next batch in parallel.
+        }
+        [self postLogRecords:batch withHandler:handler];
+    }
+}
+
+- (void)drainBacklog
+{
+    dispatch_async(self.logger_queue, ^
+    {
+        if (dispatch_semaphore_wait(self.upload_semaphore, DISPATCH_TIME_NOW) == 0)
         {
-            [self postLogRecords:logRecords withHandler:handler];
+            [self uploadLeasedBatch:self.uploadBatchSize withHandler:nil];
         }
+    });
+}
+
+- (void)adaptUploadBatchSizeForSuccess:(BOOL)isSuccess withDuration:(NSTimeInterval)duration isFullBatch:(BOOL)isFull
+{
+    NSInteger batchSize = self.uploadBatchSize;
+    if (!isSuccess || duration > LOG_UPLOAD_SLOW)
+    {
+        batchSize = MAX(LOAD_LOG_MIN, batchSize / 2);
+    }
+    else if (isFull && duration < LOG_UPLOAD_FAST) //only grow when batch size is the limit, a half batch uploaded fast tells nothing.
+    {
+        batchSize = MIN(LOAD_LOG_MAX, batchSize * 2);
+    }
+    if (batchSize != self.uploadBatchSize)
+    {
+        SHLog(@"Log upload batch size %ld -> %ld (%@ in %.2fs).", (long)self.uploadBatchSize, (long)batchSize, isSuccess ? @"success" : @"fail", duration);
+        self.uploadBatchSize = batchSize;
     }
 }
 
 #pragma mark - public functions
 
+- (NSInteger)backlogDepth
+{
+    NSInteger count = 0;
+    NSString *count_sql_str = [NSString stringWithFormat:@"SELECT COUNT(*) FROM '%@' WHERE status = %d OR status = %d", tableName, LOG_STATUS_PENDING, LOG_STATUS_LEASED];
+    @synchronized(self)
+    {
+        sqlite3_stmt *count_sql = NULL;
+        if (sqlite3_prepare_v2(database, [count_sql_str UTF8String], -1, &count_sql, NULL) == SQLITE_OK && sqlite3_step(count_sql) == SQLITE_ROW)
+        {
+            count = sqlite3_column_int(count_sql, 0);
+        }
+        sqlite3_finalize(count_sql);
+    }
+    return count;
+}
+
+- (NSUInteger)averageUploadBatchBytes
+{
+    return (self.uploadBatchesSent > 0) ? self.uploadBytesSent / self.uploadBatchesSent : 0;
+}
+
+- (unsigned long long)databaseSize
+{
+    //used pages only, free pages are waiting for incremental vacuum. WAL file is not counted as it's reset by checkpoint.
+    long long pages[3] = {0, 0, 0}; //page_count, freelist_count, page_size
+    NSArray *pragmas = @[@"PRAGMA page_count", @"PRAGMA freelist_count", @"PRAGMA page_size"];
+    @synchronized(self)
+    {
+        for (int i = 0; i < 3; i ++)
+        {
+            sqlite3_stmt *pragma_stmt = NULL;
+            if (sqlite3_prepare_v2(database, [pragmas[i] UTF8String], -1, &pragma_stmt, NULL) == SQLITE_OK && sqlite3_step(pragma_stmt) == SQLITE_ROW)
+            {
+                pages[i] = sqlite3_column_int64(pragma_stmt, 0);
+            }
+            sqlite3_finalize(pragma_stmt);
+        }
+    }
+    return (unsigned long long)MAX(0, pages[0] - pages[1]) * pages[2];
+}
+
 + (NSString *)databasePath
 {
     static NSString *dbPath = nil;
@@ -314,25 +836,33 @@ enum
     BOOL needClear = YES;
     if ([[NSFileManager defaultManager] fileExistsAtPath:[SHLogger databasePath]])
     {
-        int maxLogidUserDefaults = -1;
+        int maxLogidRecorded = -1;
         int maxlogidDb = -1;
-        NSObject *maxLogidVal = [[NSUserDefaults standardUserDefaults] objectForKey:MAX_LOGID];
-        if (maxLogidVal != nil && [maxLogidVal isKindOfClass:[NSNumber class]])
+        sqlite3 *databaseCheck;
+        int open_result = sqlite3_open_v2([[SHLogger databasePath] UTF8String], &databaseCheck, SQLITE_OPEN_READWRITE, NULL);
+        if (open_result != SQLITE_OK)
         {
-            maxLogidUserDefaults = [(NSNumber *)maxLogidVal intValue];
+            sqlite3_close(databaseCheck);
+            databaseCheck = nil;
+            NSLog(@"Could not open database: %@, Error: %d", [SHLogger databasePath], open_result);
+            assert(NO);
+        }
+        double metaMaxLogid = 0;
+        if (databaseCheck != nil && [SHLogger readMetaValue:&metaMaxLogid forKey:MAX_LOGID inDatabase:databaseCheck])
+        {
+            maxLogidRecorded = (int)metaMaxLogid;
         }
-        NSAssert(maxLogidUserDefaults != -1, @"NSUserDefaults should have logid record.");
-        if (maxLogidUserDefaults != -1)
+        else //database created by previous version, meta table not migrated yet.
         {
-            sqlite3 *databaseCheck;
-            int open_result = sqlite3_open_v2([[SHLogger databasePath] UTF8String], &databaseCheck, SQLITE_OPEN_READWRITE, NULL);
-            if (open_result != SQLITE_OK)
+            NSObject *maxLogidVal = [[NSUserDefaults standardUserDefaults] objectForKey:MAX_LOGID];
+            if (maxLogidVal != nil && [maxLogidVal isKindOfClass:[NSNumber class]])
             {
-                sqlite3_close(databaseCheck);
-                databaseCheck = nil;
-                NSLog(@"Could not open database: %@, Error: %d", [SHLogger databasePath], open_result);
-                assert(NO);
+                maxLogidRecorded = [(NSNumber *)maxLogidVal intValue];
             }
+        }
+        NSAssert(maxLogidRecorded != -1, @"Meta table or NSUserDefaults should have logid record.");
+        if (databaseCheck != nil && maxLogidRecorded != -1)
+        {
             NSString *select_sql_str = [NSString stringWithFormat:@"SELECT seq from 'sqlite_sequence' WHERE name = '%@'", tableName];
             sqlite3_stmt *select_sql = NULL;
             int select_result = sqlite3_prepare_v2(databaseCheck, [select_sql_str UTF8String], -1, &select_sql, NULL);
@@ -358,16 +888,18 @@ enum
             NSAssert(maxlogidDb != -1, @"Local SQLite should have max logid.");
             if (maxlogidDb != -1)
             {
-                if (maxLogidUserDefaults <= maxlogidDb) //use <= not ==, because maxLogidUserDefaults fail to permanently save when crash, causing it's less than maxlogidDb. Local SQLite logid larger than server is OK, it will not cause duplicate conflict. https://bitbucket.org/shawk/streethawk/issue/518/check-max-logid-in-sqlite-and. maxLogidUserDefaults will be recover when next log saved.
+                if (maxLogidRecorded <= maxlogidDb) //use <= not ==, because previous version saves max logid in NSUserDefaults which may fail to permanently save when crash, causing it's less than maxlogidDb. Local SQLite logid larger than server is OK, it will not cause duplicate conflict. https://bitbucket.org/shawk/streethawk/issue/518/check-max-logid-in-sqlite-and.
                 {
-                    needClear = NO; //local SQLite match last record in NSUserDefaults, expected, no need to refresh install.
+                    needClear = NO; //local SQLite match last recorded, expected, no need to refresh install.
                 }
             }
         }
+        sqlite3_close(databaseCheck); //harmless for nil
+        databaseCheck = nil;
         if (needClear)
         {
-            NSLog(@"Refresh as new install: SQLite max logid = %d but NSUserDefault max logid = %d.", maxlogidDb, maxLogidUserDefaults);
-            NSAssert(NO, @"Refresh as new install: SQLite max logid = %d but NSUserDefault max logid = %d.", maxlogidDb, maxLogidUserDefaults); //this is rarely should happen
+            NSLog(@"Refresh as new install: SQLite max logid = %d but recorded max logid = %d.", maxlogidDb, maxLogidRecorded);
+            NSAssert(NO, @"Refresh as new install: SQLite max logid = %d but recorded max logid = %d.", maxlogidDb, maxLogidRecorded); //this is rarely should happen
         }
     }
     else
@@ -402,6 +934,22 @@ enum
 
 #pragma mark - private functions
 
+- (void)convertToIncrementalVacuum
+{
+    @synchronized(self)
+    {
+        if (database == NULL)
+        {
+            return;
+        }
+        [self executeSql:@"PRAGMA auto_vacuum=INCREMENTAL"];
+        if ([self executeSql:@"VACUUM"]) //fail if another statement is active, tried again next launch.
+        {
+            self.needVacuumConversion = NO;
+        }
+    }
+}
+
 - (void)openSqliteDatabase
 {
     NSString *databasePath = [SHLogger databasePath];
@@ -413,6 +961,32 @@ enum
         SHLog(@"Could not create database: %@, Error: %d", databasePath, createResult);
         assert(NO);
     }
+    //Incremental auto vacuum lets file shrink after evicting or uploading a big backlog. Database created by previous version needs one full VACUUM to switch mode, it's delayed after launch. New database takes the mode before any table is created.
+    sqlite3_stmt *vacuum_stmt = NULL;
+    int autoVacuum = 0;
+    if (sqlite3_prepare_v2(database, "PRAGMA auto_vacuum", -1, &vacuum_stmt, NULL) == SQLITE_OK && sqlite3_step(vacuum_stmt) == SQLITE_ROW)
+    {
+        autoVacuum = sqlite3_column_int(vacuum_stmt, 0);
+    }
+    sqlite3_finalize(vacuum_stmt);
+    vacuum_stmt = NULL;
+    self.needVacuumConversion = NO;
+    if (autoVacuum != 2/*INCREMENTAL*/)
+    {
+        [self executeSql:@"PRAGMA auto_vacuum=INCREMENTAL"]; //takes effect immediately for empty new database, otherwise after VACUUM.
+        self.needVacuumConversion = YES;
+    }
+    //Use WAL journal: a log insert only appends to -wal file instead of rewriting rollback journal, and reading for upload not block inserting.
+    BOOL walEnabled = [self executeSql:@"PRAGMA journal_mode=WAL"];
+    NSAssert(walEnabled, @"Fail to enable WAL journal for %@.", databasePath);
+    walEnabled = YES; //disable "Unused variable" due to NSAssert ignored in pods.
+    int synchronousLevel = 1; //NORMAL
+    NSObject *synchronousVal = [[NSUserDefaults standardUserDefaults] objectForKey:LOG_DB_SYNCHRONOUS];
+    if (synchronousVal != nil && [synchronousVal isKindOfClass:[NSNumber class]] && [(NSNumber *)synchronousVal intValue] >= 0 && [(NSNumber *)synchronousVal intValue] <= 2)
+    {
+        synchronousLevel = [(NSNumber *)synchronousVal intValue];
+    }
+    [self executeSql:[NSString stringWithFormat:@"PRAGMA synchronous=%d", synchronousLevel]];
     //create the sql table for storing these log calls so they can be sent to the server later.
     NSMutableString *create_sql = [NSMutableString stringWithFormat:@"CREATE TABLE IF NOT EXISTS '%@' (", tableName];
     [create_sql appendString:@"'logid' INTEGER PRIMARY KEY AUTOINCREMENT, "];
@@ -426,7 +1000,9 @@ enum
     [create_sql appendString:@"'lng' FLOAT, "];
     [create_sql appendString:@"'mloc' INTEGER, "];
     [create_sql appendString:@"'msgid' INTEGER, "];
-    [create_sql appendString:@"'pushresult' INTEGER)"];
+    [create_sql appendString:@"'pushresult' INTEGER, "];
+    [create_sql appendString:@"'lease' INTEGER DEFAULT 0, "]; //batch id when status = 2
+    [create_sql appendString:@"'lease_expiry' REAL DEFAULT 0)"]; //time when the lease returns to pending
     sqlite3_stmt *create_stmt = NULL;
     int create_result = sqlite3_prepare_v2(database, [create_sql UTF8String], -1, &create_stmt, NULL);
     if (create_result != SQLITE_OK)
@@ -443,16 +1019,168 @@ enum
     sqlite3_reset(create_stmt);
     sqlite3_finalize(create_stmt);
     create_stmt = NULL;
+    //database created by previous version not have lease columns, append them so `SELECT *` column index still match.
+    BOOL hasLeaseColumn = NO;
+    sqlite3_stmt *info_stmt = NULL;
+    if (sqlite3_prepare_v2(database, [[NSString stringWithFormat:@"PRAGMA table_info('%@')", tableName] UTF8String], -1, &info_stmt, NULL) == SQLITE_OK)
+    {
+        while (sqlite3_step(info_stmt) == SQLITE_ROW)
+        {
+            if (strcmp((const char *)sqlite3_column_text(info_stmt, 1)/*name*/, "lease") == 0)
+            {
+                hasLeaseColumn = YES;
+                break;
+            }
+        }
+    }
+    sqlite3_finalize(info_stmt);
+    info_stmt = NULL;
+    if (!hasLeaseColumn)
+    {
+        [self executeSql:[NSString stringWithFormat:@"ALTER TABLE '%@' ADD COLUMN 'lease' INTEGER DEFAULT 0", tableName]];
+        [self executeSql:[NSString stringWithFormat:@"ALTER TABLE '%@' ADD COLUMN 'lease_expiry' REAL DEFAULT 0", tableName]];
+    }
+    //leases belong to requests of last App run which are gone now, return them to pending.
+    [self executeSql:[NSString stringWithFormat:@"UPDATE '%@' SET status = %d, lease = 0 WHERE status = %d", tableName, LOG_STATUS_PENDING, LOG_STATUS_LEASED]];
+    //upload selects by status ordered by logid, index it so select not scan whole table when backlog is big.
+    [self executeSql:[NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS 'index_status_logid' ON '%@' ('status', 'logid')", tableName]];
+    sqlite3_stmt *count_stmt = NULL;
+    if (sqlite3_prepare_v2(database, [[NSString stringWithFormat:@"SELECT COUNT(*) FROM '%@' WHERE status <> %d", tableName, LOG_STATUS_SENT] UTF8String], -1, &count_stmt, NULL) == SQLITE_OK && sqlite3_step(count_stmt) == SQLITE_ROW)
+    {
+        self.storedLogCount = sqlite3_column_int(count_stmt, 0);
+    }
+    sqlite3_finalize(count_stmt);
+    count_stmt = NULL;
+    //create meta table for logger's own state, such as max logid and session, it's written in same transaction as log rows.
+    BOOL metaCreated = [self executeSql:[NSString stringWithFormat:@"CREATE TABLE IF NOT EXISTS '%@' ('key' TEXT PRIMARY KEY, 'value' REAL)", metaTableName]];
+    NSAssert(metaCreated, @"Error in creating table (%@): %s", metaTableName, sqlite3_errmsg(database));
+    metaCreated = YES; //disable "Unused variable" due to NSAssert ignored in pods.
+    //insert statement is prepared once and re-bind for each log, avoid parse sql string for every log.
+    insert_stmt = [self prepareCachedStatement:[NSString stringWithFormat:@"INSERT OR REPLACE INTO '%@' ('status', 'sessionid', 'created', 'code', 'comment', 'lat', 'lng', 'mloc', 'msgid', 'pushresult') VALUES (0, ?, ?, ?, ?, ?, ?, ?, ?, ?)", tableName]];
+    meta_write_stmt = [self prepareCachedStatement:[NSString stringWithFormat:@"INSERT OR REPLACE INTO '%@' ('key', 'value') VALUES (?, ?)", metaTableName]];
+    [self migrateMetaFromUserDefaults];
+}
+
+- (void)writeMetaValue:(double)value forKey:(NSString *)key
+{
+    sqlite3_bind_text(meta_write_stmt, 1, [key UTF8String], -1, SQLITE_TRANSIENT);
+    sqlite3_bind_double(meta_write_stmt, 2, value);
+    int step_result = sqlite3_step(meta_write_stmt);
+    NSAssert(step_result == SQLITE_DONE, @"Could not write meta %@: %s", key, sqlite3_errmsg(database));
+    step_result = 0; //disable "Unused variable" due to NSAssert ignored in pods.
+    sqlite3_reset(meta_write_stmt);
+    sqlite3_clear_bindings(meta_write_stmt);
+}
+
++ (BOOL)readMetaValue:(double *)value forKey:(NSString *)key inDatabase:(sqlite3 *)db
+{
+    BOOL found = NO;
+    NSString *select_sql_str = [NSString stringWithFormat:@"SELECT value FROM '%@' WHERE key = ?", metaTableName];
+    sqlite3_stmt *select_sql = NULL;
+    if (sqlite3_prepare_v2(db, [select_sql_str UTF8String], -1, &select_sql, NULL) == SQLITE_OK) //fail if meta table not exist, it's expected for old database.
+    {
+        sqlite3_bind_text(select_sql, 1, [key UTF8String], -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(select_sql) == SQLITE_ROW)
+        {
+            *value = sqlite3_column_double(select_sql, 0);
+            found = YES;
+        }
+    }
+    sqlite3_finalize(select_sql); //harmless for NULL
+    return found;
+}
+
+- (void)migrateMetaFromUserDefaults
+{
+    NSArray *migrateKeys = @[MAX_LOGID, FGBG_SESSION, PREVIOUS_VISIBLE_STATUS, PREVIOUS_VISIBLE_TIME];
+    BOOL needMigrate = NO;
+    for (NSString *key in migrateKeys)
+    {
+        if ([[NSUserDefaults standardUserDefaults] objectForKey:key] != nil)
+        {
+            needMigrate = YES;
+            break;
+        }
+    }
+    if (!needMigrate)
+    {
+        return;
+    }
+    @synchronized(self)
+    {
+        [self executeSql:@"BEGIN IMMEDIATE"];
+        for (NSString *key in migrateKeys)
+        {
+            NSObject *val = [[NSUserDefaults standardUserDefaults] objectForKey:key];
+            double existValue = 0;
+            if (val != nil && [val isKindOfClass:[NSNumber class]] && ![SHLogger readMetaValue:&existValue forKey:key inDatabase:database]) //meta table wins if both have it.
+            {
+                [self writeMetaValue:[(NSNumber *)val doubleValue] forKey:key];
+            }
+        }
+        if ([self executeSql:@"COMMIT"])
+        {
+            for (NSString *key in migrateKeys)
+            {
+                [[NSUserDefaults standardUserDefaults] removeObjectForKey:key];
+            }
+            [[NSUserDefaults standardUserDefaults] synchronize];
+        }
+        else
+        {
+            [self executeSql:@"ROLLBACK"]; //keep NSUserDefaults, try again next launch.
+        }
+    }
+}
+
+- (BOOL)executeSql:(NSString *)sql
+{
+    char *errmsg = NULL;
+    int exec_result = sqlite3_exec(database, [sql UTF8String], NULL, NULL, &errmsg);
+    if (exec_result != SQLITE_OK)
+    {
+        SHLog(@"Could not execute sql [[[ %@ ]]], Error: %s", sql, errmsg);
+    }
+    sqlite3_free(errmsg); //harmless for NULL
+    return (exec_result == SQLITE_OK);
 }
 
-- (NSMutableArray *)loadLogRecords:(NSInteger)numRecords
+- (sqlite3_stmt *)prepareCachedStatement:(NSString *)sql
+{
+    sqlite3_stmt *stmt = NULL;
+    int prepare_result = sqlite3_prepare_v2(database, [sql UTF8String], -1, &stmt, NULL);
+    if (prepare_result != SQLITE_OK)
+    {
+        SHLog(@"Could not prepare sql [[[ %@ ]]], Error: %s", sql, sqlite3_errmsg(database));
+        assert(NO);
+    }
+    return stmt;
+}
+
+- (SHLogBatch *)loadLogRecords:(NSInteger)numRecords
 {
     //Select from database to get the upload records
     numRecords = (numRecords <= 0) ? LOAD_LOG_NUMBER : numRecords;
-    NSMutableArray *logRecords = [NSMutableArray arrayWithCapacity:numRecords];
-    NSString *select_sql_str = [NSString stringWithFormat:@"SELECT * from '%@' WHERE status = 0  ORDER BY logid LIMIT %ld", tableName, (long)numRecords];
+    SHLogBatch *batch = [[SHLogBatch alloc] init];
+    batch.recordsJson = [NSMutableData dataWithCapacity:numRecords * 128/*rough size of one record*/];
+    batch.logIds = [NSMutableArray arrayWithCapacity:MIN(numRecords, LOAD_LOG_NUMBER)];
+    NSMutableData *json = batch.recordsJson;
+    NSDateFormatter *localDateFormatter = nil; //created once for this batch when first needed.
+    NSUInteger encodedCount = 0; //records written into JSON, different from logIds.count if some record is dropped.
+    shJsonAppendLiteral(json, "[");
+    NSString *select_sql_str = [NSString stringWithFormat:@"SELECT * from '%@' WHERE status = %d  ORDER BY logid LIMIT %ld", tableName, LOG_STATUS_PENDING, (long)numRecords];
+    NSMutableString *lease_sql_str = nil; //filled after select
     @synchronized(self)
     {
+        //select and lease in one transaction, so parallel batches never share a row.
+        [self executeSql:@"BEGIN IMMEDIATE"];
+        NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+        //leases not finished in time, for example request hang, return to pending.
+        [self executeSql:[NSString stringWithFormat:@"UPDATE '%@' SET status = %d, lease = 0 WHERE status = %d AND lease_expiry < %f", tableName, LOG_STATUS_PENDING, LOG_STATUS_LEASED, now]];
+        self.lastLeaseId++;
+        batch.leaseId = self.lastLeaseId;
+        NSTimeInterval leaseTimeout = [[SHRetryPolicy defaultPolicy] maxDurationWithTimeout:LOG_REQUEST_TIMEOUT] + LOG_LEASE_QUEUE_WAIT; //must outlive all retries of `postLogRecords:`, otherwise rows are leased to another batch and uploaded twice.
+        lease_sql_str = [NSMutableString stringWithFormat:@"UPDATE '%@' SET status = %d, lease = %ld, lease_expiry = %f WHERE logid IN (", tableName, LOG_STATUS_LEASED, (long)batch.leaseId, now + leaseTimeout];
         sqlite3_stmt *select_sql = NULL;
         int select_result = sqlite3_prepare_v2(database, [select_sql_str UTF8String], -1, &select_sql, NULL);
         if (select_result != SQLITE_OK)
@@ -463,7 +1191,6 @@ enum
         int select_step_result = sqlite3_step(select_sql);
         while (select_step_result == SQLITE_ROW)
         {
-            NSMutableDictionary *logRecord = [NSMutableDictionary dictionary];
             int logid = sqlite3_column_int(select_sql, LOG_COL_LOGID);
             int sessionid = sqlite3_column_int(select_sql, LOG_COL_SESSIONID);
             const char *created = (const char *)sqlite3_column_text(select_sql, LOG_COL_CREATED);
@@ -474,15 +1201,29 @@ enum
             int mloc = sqlite3_column_int(select_sql, LOG_COL_MLOC);
             int assocId = sqlite3_column_int(select_sql, LOG_COL_MSGID);
             int result = sqlite3_column_int(select_sql, LOG_COL_PUSHRESULT);
+            NSUInteger recordStart = json.length; //rollback to here if this record cannot be encoded.
+            BOOL recordValid = YES;
             //mandatory parameters for each logline
-            logRecord[@"log_id"] = @(logid);
-            logRecord[@"session_id"] = (sessionid==0) ? [NSNull null] : @(sessionid);
-            logRecord[@"created_on_client"] = shCstringToNSString(created);
-            logRecord[@"code"] = @(code);
+            shJsonAppendLiteral(json, (encodedCount == 0) ? "{\"log_id\":" : ",{\"log_id\":");
+            shJsonAppendInt(json, logid);
+            shJsonAppendKey(json, "session_id");
+            if (sessionid == 0)
+            {
+                shJsonAppendLiteral(json, "null");
+            }
+            else
+            {
+                shJsonAppendInt(json, sessionid);
+            }
+            shJsonAppendKey(json, "created_on_client");
+            shJsonAppendString(json, created);
+            shJsonAppendKey(json, "code");
+            shJsonAppendInt(json, code);
             //Code: -1. Error
             if (code == LOG_CODE_ERROR)
             {
-                logRecord[@"string"] = shCstringToNSString(comment);
+                shJsonAppendKey(json, "string");
+                shJsonAppendString(json, comment);
             }
             //Codes: 19, 20. Locations
             else if (code == LOG_CODE_LOCATION_MORE || code == LOG_CODE_LOCATION_GEO)
@@ -490,60 +1231,77 @@ enum
                 NSAssert(mloc == 0 && lat != 0 && lng != 0, @"Only support geo location now.");
                 if (mloc == 1/*manual location allow 0*/ || lat != 0/*automatical location not allow 0 as it means not detected*/)
                 {
-                    logRecord[@"latitude"] = @(lat);
+                    shJsonAppendKey(json, "latitude");
+                    shJsonAppendDouble(json, lat);
                 }
                 if (mloc == 1 || lng != 0)
                 {
-                    logRecord[@"longitude"] = @(lng);
+                    shJsonAppendKey(json, "longitude");
+                    shJsonAppendDouble(json, lng);
                 }
                 NSDate *recordDate = shParseDate(shCstringToNSString(created), 0);
                 NSAssert(recordDate != nil, @"Fail to parse record date.");
-                NSDateFormatter *localDateFormatter = shGetDateFormatter(nil, [NSTimeZone localTimeZone], nil);
-                logRecord[@"created_local_time"] = [localDateFormatter stringFromDate:recordDate];
+                if (localDateFormatter == nil)
+                {
+                    localDateFormatter = shGetDateFormatter(nil, [NSTimeZone localTimeZone], nil);
+                }
+                shJsonAppendKey(json, "created_local_time");
+                shJsonAppendNSString(json, [localDateFormatter stringFromDate:recordDate]);
+                batch.hasLocation = YES;
             }
             //Code: 21. Beacon Update
             else if (code == LOG_CODE_LOCATION_IBEACON)
             {
-                NSDictionary *dictComment = shParseObjectToDict(shCstringToNSString(comment));
-                NSAssert(dictComment != nil, @"Fail to parse code 21 iBeacon json.");
-                logRecord[@"json"] = dictComment;
+                shJsonAppendKey(json, "json");
+                recordValid = shJsonSpliceObject(json, comment, NO); //comment is serialized dictionary, use it verbatim once validated.
+                NSAssert(recordValid, @"Fail to parse code 21 iBeacon json.");
             }
             //Code: 8050. UTC Offset
             else if (code == LOG_CODE_TIMEOFFSET)
             {
-                logRecord[@"numeric"] = shCstringToNSString(comment);
+                shJsonAppendKey(json, "numeric");
+                shJsonAppendString(json, comment);
             }
             //Code: 8051. Heartbeat
             else if (code == LOG_CODE_HEARTBEAT)
             {
                 //No further data required.
+                batch.hasHeartbeat = YES;
             }
             //Code: 8052. Client Upgrade
             else if (code == LOG_CODE_CLIENTUPGRADE)
             {
-                logRecord[@"string"] = shCstringToNSString(comment);
+                shJsonAppendKey(json, "string");
+                shJsonAppendString(json, comment);
             }
             //code: 8101. App First Run (deprecated, old SDK may send, new SDK should not send)
             //code: 8102. App Initialized (not in use, client side can send, server will not use it)
             else if (code == LOG_CODE_APP_LAUNCH)
             {
-                logRecord[@"string"] = shCstringToNSString(comment);
+                shJsonAppendKey(json, "string");
+                shJsonAppendString(json, comment);
             }
             //Codes: 8103, 8104. App FG and BG
             else if (code == LOG_CODE_APP_VISIBLE || code == LOG_CODE_APP_INVISIBLE)
             {
                 if (lat != 0/*automatical location not allow 0 as it means not detected*/)
                 {
-                    logRecord[@"latitude"] = @(lat);
+                    shJsonAppendKey(json, "latitude");
+                    shJsonAppendDouble(json, lat);
                 }
                 if (lng != 0)
                 {
-                    logRecord[@"longitude"] = @(lng);
+                    shJsonAppendKey(json, "longitude");
+                    shJsonAppendDouble(json, lng);
                 }
                 NSDate *recordDate = shParseDate(shCstringToNSString(created), 0);
                 NSAssert(recordDate != nil, @"Fail to parse record date.");
-                NSDateFormatter *localDateFormatter = shGetDateFormatter(nil, [NSTimeZone localTimeZone], nil);
-                logRecord[@"created_local_time"] = [localDateFormatter stringFromDate:recordDate];
+                if (localDateFormatter == nil)
+                {
+                    localDateFormatter = shGetDateFormatter(nil, [NSTimeZone localTimeZone], nil);
+                }
+                shJsonAppendKey(json, "created_local_time");
+                shJsonAppendNSString(json, [localDateFormatter stringFromDate:recordDate]);
             }
             //Code: 8105. Sessions
             else if (code == LOG_CODE_APP_COMPLETE)
@@ -552,15 +1310,19 @@ enum
                 NSAssert(dict != nil, @"Fail to parse App session complete dictionary.");
                 if (dict != nil)
                 {
-                    logRecord[@"start"] = dict[@"visible"];
-                    logRecord[@"end"] = dict[@"invisible"];
-                    logRecord[@"length"] = @((int)([dict[@"duration"] doubleValue] + 0.5));
+                    shJsonAppendKey(json, "start");
+                    shJsonAppendNSString(json, dict[@"visible"]);
+                    shJsonAppendKey(json, "end");
+                    shJsonAppendNSString(json, dict[@"invisible"]);
+                    shJsonAppendKey(json, "length");
+                    shJsonAppendInt(json, (int)([dict[@"duration"] doubleValue] + 0.5));
                 }
             }
             //Codes: 8108, 8109. Enter and Exit View/Activity
             else if (code == LOG_CODE_VIEW_ENTER || code == LOG_CODE_VIEW_EXIT)
             {
-                logRecord[@"string"] = shCstringToNSString(comment);
+                shJsonAppendKey(json, "string");
+                shJsonAppendString(json, comment);
             }
             //Code: 8110. Complete View/Activity
             else if (code == LOG_CODE_VIEW_COMPLETE)
@@ -569,11 +1331,16 @@ enum
                 NSAssert(dictActivity != nil, @"Fail to parse view complete dict from db.");
                 if (dictActivity != nil)
                 {
-                    logRecord[@"string"] = dictActivity[@"page"];
-                    logRecord[@"start"] = dictActivity[@"enter"];
-                    logRecord[@"end"] = dictActivity[@"exit"];
-                    logRecord[@"length"] = @((int)([dictActivity[@"duration"] doubleValue] + 0.5));
-                    logRecord[@"bg"] = [dictActivity[@"bg"] boolValue] ? @"true" : @"false";
+                    shJsonAppendKey(json, "string");
+                    shJsonAppendNSString(json, dictActivity[@"page"]);
+                    shJsonAppendKey(json, "start");
+                    shJsonAppendNSString(json, dictActivity[@"enter"]);
+                    shJsonAppendKey(json, "end");
+                    shJsonAppendNSString(json, dictActivity[@"exit"]);
+                    shJsonAppendKey(json, "length");
+                    shJsonAppendInt(json, (int)([dictActivity[@"duration"] doubleValue] + 0.5));
+                    shJsonAppendKey(json, "bg");
+                    shJsonAppendLiteral(json, [dictActivity[@"bg"] boolValue] ? "\"true\"" : "\"false\"");
                 }
             }
             //Code: 8112. Location Service Disabled
@@ -585,50 +1352,63 @@ enum
             else if (code == LOG_CODE_FEED_ACK)
             {
                 NSAssert(assocId != 0, @"Send feed ack without assocId.");
-                logRecord[@"feed_id"] = @(assocId);
+                shJsonAppendKey(json, "feed_id");
+                shJsonAppendInt(json, assocId);
             }
             //Code: 8201. Feed Result
             else if (code == LOG_CODE_FEED_RESULT)
             {
                 NSAssert(assocId != 0, @"Send feed result without assocId.");
-                logRecord[@"feed_id"] = @(assocId);
+                shJsonAppendKey(json, "feed_id");
+                shJsonAppendInt(json, assocId);
                 NSAssert(result == LOG_RESULT_ACCEPT || result == LOG_RESULT_CANCEL || result == LOG_RESULT_LATER, @"Send feed result with improper result.");
-                logRecord[@"result"] = @(result);
+                shJsonAppendKey(json, "result");
+                shJsonAppendInt(json, result);
             }
             //Code: 8202. Push ACK
             else if (code == LOG_CODE_PUSH_ACK)
             {
                 NSAssert(assocId != 0, @"Send push ack without assocId.");
-                logRecord[@"message_id"] = @(assocId);
+                shJsonAppendKey(json, "message_id");
+                shJsonAppendInt(json, assocId);
             }
             //Code: 8203. Push Result
             else if (code == LOG_CODE_PUSH_RESULT)
             {
                 NSAssert(assocId != 0, @"Send push result without assocId.");
-                logRecord[@"message_id"] = @(assocId);
+                shJsonAppendKey(json, "message_id");
+                shJsonAppendInt(json, assocId);
                 NSAssert(result == LOG_RESULT_ACCEPT || result == LOG_RESULT_CANCEL || result == LOG_RESULT_LATER, @"Send push result with improper result.");
-                logRecord[@"result"] = @(result);
-                NSInteger pushCode = [shCstringToNSString(comment) integerValue];
+                shJsonAppendKey(json, "result");
+                shJsonAppendInt(json, result);
+                long long pushCode = (comment != NULL) ? atoll(comment) : 0;
                 NSAssert(pushCode != 0, @"Send push result without code.");
-                logRecord[@"numeric"] = @(pushCode);
+                shJsonAppendKey(json, "numeric");
+                shJsonAppendInt(json, pushCode);
             }
             //Code: 8997. Increment Tag
             //Code: 8998. Delete Tag
             //Code: 8999. Add Tag
             else if (code == LOG_CODE_TAG_INCREMENT || code == LOG_CODE_TAG_DELETE || code == LOG_CODE_TAG_ADD)
             {
-                NSDictionary *dictTag = shParseObjectToDict(shCstringToNSString(comment));
-                NSAssert(dictTag != nil, @"Fail to parse tag dictionary.");
-                for (NSString *key in dictTag.allKeys)
-                {
-                    logRecord[key] = dictTag[key];
-                }
+                recordValid = shJsonSpliceObject(json, comment, YES); //tag dictionary's members are merged into record verbatim once validated.
+                NSAssert(recordValid, @"Fail to parse tag dictionary.");
             }
             else
             {
                 NSAssert(NO, @"Unsupported code %d.", code);
             }
-            [logRecords addObject:logRecord];
+            if (recordValid)
+            {
+                shJsonAppendLiteral(json, "}");
+                encodedCount++;
+            }
+            else
+            {
+                json.length = recordStart; //drop partial record, it's still cleared after upload so not block the queue.
+            }
+            [batch.logIds addObject:@(logid)];
+            [lease_sql_str appendFormat:@"%d, ", logid];
             select_step_result = sqlite3_step(select_sql);
         }
         if (select_step_result != SQLITE_DONE)
@@ -639,11 +1419,22 @@ enum
         sqlite3_reset(select_sql);
         sqlite3_finalize(select_sql);
         select_sql = NULL;
+        if (batch.logIds.count > 0)
+        {
+            [lease_sql_str appendString:@"-1)"];
+            [self executeSql:lease_sql_str];
+        }
+        if (![self executeSql:@"COMMIT"])
+        {
+            [self executeSql:@"ROLLBACK"];
+        }
     }
-    return logRecords;
+    shJsonAppendLiteral(json, "]");
+    batch.isFull = (batch.logIds.count >= numRecords);
+    return batch;
 }
 
-- (void)postLogRecords:(NSArray *)logRecords withHandler:(SHCallbackHandler)handler
+- (void)postLogRecords:(SHLogBatch *)batch withHandler:(SHCallbackHandler)handler
 {
     // before we post anything to the server, make sure the installation ID is set
     if (StreetHawk.currentInstall == nil)
@@ -653,10 +1444,11 @@ enum
          {
              if (StreetHawk.currentInstall)
              {
-                 [self postLogRecords:logRecords withHandler:handler];  //after register successfully, do it again
+                 [self postLogRecords:batch withHandler:handler];  //after register successfully, do it again
              }
              else
              {
+                 [self releaseLease:batch.leaseId];
                  dispatch_semaphore_signal(self.upload_semaphore);  //give up and it will upload next time
                  if (handler)
                  {
@@ -667,55 +1459,47 @@ enum
     }
     else  //install exist, do upload to server and delete local db
     {
-        NSString *postBody = shSerializeObjToJson(logRecords);
+        NSString *postBody = [[NSString alloc] initWithData:batch.recordsJson encoding:NSUTF8StringEncoding]; //also validate it's UTF-8.
         if (postBody == nil || postBody.length == 0)
         {
-            [self clearLogRecords:logRecords];  //these logs cannot be serial to json, delete them to avoid next time fail again. this is rare, but logically may happen.
+            [self clearLogRecords:batch.logIds withLease:batch.leaseId];  //these logs cannot be serial to json, delete them to avoid next time fail again. this is rare, but logically may happen.
             dispatch_semaphore_signal(self.upload_semaphore);
             if (handler)
                 handler(nil, nil);
             return;
         }
-        SHRequest *request = [SHRequest requestWithPath:@"installs/log/" withVersion:SHHostVersion_V2 withParams:nil withMethod:@"POST" withHeaders:nil withBodyOrStream:@[@"records", postBody]];
+        SHRequest *request = [SHRequest requestWithPath:@"installs/log/" withVersion:SHHostVersion_V2 withParams:nil withCompressedJson:batch.recordsJson orFormField:@"records"];
+        request.retryPolicy = [SHRetryPolicy defaultPolicy]; //leased rows stay leased while retrying, instead of waiting for next log to trigger upload.
         handler = [handler copy];
+        NSTimeInterval postStart = [NSDate timeIntervalSinceReferenceDate];
         request.requestHandler = ^(SHRequest *logRequest)
         {
+            NSTimeInterval postDuration = [NSDate timeIntervalSinceReferenceDate] - postStart;
             //Since 2014-02-10, server save log in asynchronous way, so it does not return any error.
             //Update on 2015-02-27: dev returns error message for debugging, api return immediately.
             if (logRequest.error != nil/* && error != [SHRequest requestCancelledError]*//*A running request still post data to server even it's canncelled, so still need to delete the logs from database to avoid sending duplicated logs.*/)
             {
                 if (![logRequest.error.domain isEqualToString:@"NSURLErrorDomain"] && StreetHawk.isDebugMode && shAppMode() != SHAppMode_AppStore && shAppMode() != SHAppMode_Enterprise)
                 {
-                    //NSAssert(NO, @"Log meets error (%@) for records: %@.", logRequest.error, logRecords); //comment this as dev returns error and crash App, make it cannot continue.
+                    //NSAssert(NO, @"Log meets error (%@) for records: %@.", logRequest.error, postBody); //comment this as dev returns error and crash App, make it cannot continue.
                 }
                 if (logRequest.error.code == 404)
                 {
                     StreetHawk.currentInstall = nil;
                     [StreetHawk registerOrUpdateInstallWithHandler:nil];
                 }
+                [self releaseLease:batch.leaseId];
+                @synchronized(self)
+                {
+                    [self adaptUploadBatchSizeForSuccess:NO withDuration:postDuration isFullBatch:batch.isFull];
+                }
                 dispatch_semaphore_signal(self.upload_semaphore);
             }
             else
             {
                 //record last successfully post logs time.
-                BOOL postHeartbeat = NO;
-                BOOL postLocation = NO;
-                for (NSDictionary *logRecord in logRecords)
-                {
-                    int code = [logRecord[@"code"] intValue];
-                    if (code == LOG_CODE_HEARTBEAT)
-                    {
-                        postHeartbeat = YES;
-                    }
-                    if (code == LOG_CODE_LOCATION_MORE || code == LOG_CODE_LOCATION_GEO)
-                    {
-                        postLocation = YES;
-                    }
-                    if (postHeartbeat && postLocation)
-                    {
-                        break;
-                    }
-                }
+                BOOL postHeartbeat = batch.hasHeartbeat;
+                BOOL postLocation = batch.hasLocation;
                 if (postHeartbeat)
                 {
                     [[NSUserDefaults standardUserDefaults] setObject:[NSNumber numberWithDouble:[[NSDate date] timeIntervalSinceReferenceDate]] forKey:REGULAR_HEARTBEAT_LOGTIME];
@@ -728,8 +1512,20 @@ enum
                 {
                     [[NSUserDefaults standardUserDefaults] synchronize];
                 }
-                [self clearLogRecords:logRecords];
+                [self clearLogRecords:batch.logIds withLease:batch.leaseId];
+                @synchronized(self) //batches finish in parallel
+                {
+                    self.uploadBatchesSent++;
+                    self.lastUploadBatchBytes = batch.recordsJson.length;
+                    self.uploadBytesSent += batch.recordsJson.length;
+                    [self adaptUploadBatchSizeForSuccess:YES withDuration:postDuration isFullBatch:batch.isFull];
+                }
                 dispatch_semaphore_signal(self.upload_semaphore);
+                if (batch.isFull)
+                {
+                    //local still has backlog, keep draining back-to-back instead of waiting next LOG_UPLOAD_INTERVAL logs.
+                    [self drainBacklog];
+                }
             }
             //finish
             if (handler)
@@ -739,17 +1535,131 @@ enum
     }    
 }
 
-- (void)clearLogRecords:(NSArray *)logRecords
+- (void)coalescePendingLogs:(NSInteger)window
+{
+    NSMutableString *drop_sql_str = [NSMutableString stringWithFormat:@"DELETE FROM '%@' WHERE status = %d AND logid IN (", tableName, LOG_STATUS_PENDING];
+    NSInteger dropCount = 0;
+    int latestIds[sizeof(shLogCoalesceRules) / sizeof(shLogCoalesceRules[0])]; //per rule: last seen logid for KeepLatest, or previous row of run for KeepLastOfRun.
+    memset(latestIds, 0, sizeof(latestIds));
+    NSMutableDictionary *dictLastValues = [NSMutableDictionary dictionary]; //code -> last comment, for DropRepeatedValue.
+    NSMutableDictionary *dictTagRows = [NSMutableDictionary dictionary]; //tag key -> array of add/increment logids still pending.
+    NSString *select_sql_str = [NSString stringWithFormat:@"SELECT logid, code, comment FROM '%@' WHERE status = %d ORDER BY logid LIMIT %ld", tableName, LOG_STATUS_PENDING, (long)window];
+    @synchronized(self)
+    {
+        sqlite3_stmt *select_sql = NULL;
+        if (sqlite3_prepare_v2(database, [select_sql_str UTF8String], -1, &select_sql, NULL) != SQLITE_OK)
+        {
+            SHLog(@"Could not prepare sql [[[ %@ ]]], Error: %s", select_sql_str, sqlite3_errmsg(database));
+            return;
+        }
+        while (sqlite3_step(select_sql) == SQLITE_ROW)
+        {
+            int logid = sqlite3_column_int(select_sql, 0);
+            int code = sqlite3_column_int(select_sql, 1);
+            const char *comment = (const char *)sqlite3_column_text(select_sql, 2);
+            for (int i = 0; i < sizeof(shLogCoalesceRules) / sizeof(shLogCoalesceRules[0]); i ++)
+            {
+                int dropId = 0;
+                if (shLogCoalesceRules[i].code != code)
+                {
+                    if (shLogCoalesceRules[i].rule == SHLogCoalesceRule_KeepLastOfRun)
+                    {
+                        latestIds[i] = 0; //other code breaks the run
+                    }
+                    continue;
+                }
+                switch (shLogCoalesceRules[i].rule)
+                {
+                    case SHLogCoalesceRule_KeepLatest:
+                    case SHLogCoalesceRule_KeepLastOfRun:
+                    {
+                        dropId = latestIds[i];
+                        latestIds[i] = logid;
+                        break;
+                    }
+                    case SHLogCoalesceRule_DropRepeatedValue:
+                    {
+                        NSString *value = shCstringToNSString(comment);
+                        if ([dictLastValues[@(code)] isEqualToString:value])
+                        {
+                            dropId = logid;
+                        }
+                        dictLastValues[@(code)] = value;
+                        break;
+                    }
+                    case SHLogCoalesceRule_TagSet:
+                    case SHLogCoalesceRule_TagIncrement:
+                    case SHLogCoalesceRule_TagDelete:
+                    {
+                        NSObject *key = shParseObjectToDict(shCstringToNSString(comment))[@"key"];
+                        if (key == nil || ![key isKindOfClass:[NSString class]])
+                        {
+                            break;
+                        }
+                        NSMutableArray *arrayRows = dictTagRows[key];
+                        if (arrayRows == nil)
+                        {
+                            arrayRows = [NSMutableArray array];
+                            dictTagRows[(NSString *)key] = arrayRows;
+                        }
+                        if (shLogCoalesceRules[i].rule != SHLogCoalesceRule_TagIncrement) //add or delete overrides previous value of this key.
+                        {
+                            for (NSNumber *rowId in arrayRows)
+                            {
+                                [drop_sql_str appendFormat:@"%d, ", rowId.intValue];
+                                dropCount++;
+                            }
+                            [arrayRows removeAllObjects];
+                        }
+                        if (shLogCoalesceRules[i].rule != SHLogCoalesceRule_TagDelete) //delete itself is kept, and nothing before it can be dropped again.
+                        {
+                            [arrayRows addObject:@(logid)];
+                        }
+                        break;
+                    }
+                }
+                if (dropId != 0)
+                {
+                    [drop_sql_str appendFormat:@"%d, ", dropId];
+                    dropCount++;
+                }
+            }
+        }
+        sqlite3_finalize(select_sql);
+        select_sql = NULL;
+        if (dropCount > 0)
+        {
+            [drop_sql_str appendString:@"-1)"];
+            if ([self executeSql:drop_sql_str])
+            {
+                NSInteger dropped = sqlite3_changes(database);
+                self.storedLogCount = MAX(0, self.storedLogCount - dropped);
+                self.coalescedLogCount += dropped;
+                SHLog(@"Coalesce %ld superseded logs before upload.", (long)dropped);
+            }
+        }
+    }
+}
+
+- (void)releaseLease:(NSInteger)leaseId
+{
+    @synchronized(self)
+    {
+        [self executeSql:[NSString stringWithFormat:@"UPDATE '%@' SET status = %d, lease = 0 WHERE status = %d AND lease = %ld", tableName, LOG_STATUS_PENDING, LOG_STATUS_LEASED, (long)leaseId]];
+    }
+}
+
+- (void)clearLogRecords:(NSArray *)logIds withLease:(NSInteger)leaseId
 {
     //cannot dispatch_async otherwise this thread ends and not execute, cause semaphore not signal.
 #if TARGET_IPHONE_SIMULATOR
-    NSMutableString *delete_sql_str = [NSMutableString stringWithFormat:@"UPDATE '%@' set status = 1 WHERE status <> 1 AND logid in (", tableName];
+    NSMutableString *delete_sql_str = [NSMutableString stringWithFormat:@"UPDATE '%@' set status = %d, lease = 0 WHERE status = %d AND lease = %ld AND logid in (", tableName, LOG_STATUS_SENT, LOG_STATUS_LEASED, (long)leaseId];
 #else
-    NSMutableString *delete_sql_str = [NSMutableString stringWithFormat:@"DELETE FROM '%@' where logid in (", tableName];
+    NSMutableString *delete_sql_str = [NSMutableString stringWithFormat:@"DELETE FROM '%@' where status = %d AND lease = %ld AND logid in (", tableName, LOG_STATUS_LEASED, (long)leaseId];
 #endif
-    for (NSDictionary *logRecord in logRecords)
+    for (NSNumber *logId in logIds)
     {
-        [delete_sql_str appendFormat:@"%d, ", [logRecord[@"log_id"] intValue]];
+        [delete_sql_str appendFormat:@"%d, ", [logId intValue]];
     }
     [delete_sql_str appendString:@"-1)"];
     @synchronized(self)
@@ -764,26 +1674,78 @@ enum
         int step_result = sqlite3_step(delete_sql);
         NSAssert(step_result == SQLITE_DONE, @"Error in updating/deleting uploaded rows.");
         step_result = 0; //disable "Unused variable" due to NSAssert ignored in pods.
+        self.storedLogCount = MAX(0, self.storedLogCount - sqlite3_changes(database));
         sqlite3_reset(delete_sql);
         sqlite3_finalize(delete_sql);
         delete_sql = NULL;
+        [self executeSql:@"PRAGMA incremental_vacuum"]; //give free pages back to file system, otherwise file never shrinks after a big backlog.
     }
 }
 
+- (void)enforceRetention
+{
+    unsigned long long databaseBytes = self.databaseSize;
+    if (self.storedLogCount <= self.maxStoredRows && databaseBytes <= self.maxDatabaseBytes)
+    {
+        return;
+    }
+    //number of rows to evict, for bytes estimate by average row size.
+    NSInteger needEvict = self.storedLogCount - (NSInteger)(self.maxStoredRows * LOG_DB_EVICT_TARGET);
+    if (databaseBytes > self.maxDatabaseBytes && self.storedLogCount > 0)
+    {
+        unsigned long long rowBytes = MAX(1, databaseBytes / self.storedLogCount);
+        needEvict = MAX(needEvict, (NSInteger)((databaseBytes - (unsigned long long)(self.maxDatabaseBytes * LOG_DB_EVICT_TARGET)) / rowBytes));
+    }
+    if (needEvict <= 0)
+    {
+        return;
+    }
+    //lowest priority: regular location and heartbeats except the latest one.
+    NSInteger evicted = [self evictPendingLogs:needEvict withCondition:[NSString stringWithFormat:@"code = %d OR (code = %d AND logid < (SELECT MAX(logid) FROM '%@' WHERE code = %d))", LOG_CODE_LOCATION_MORE, LOG_CODE_HEARTBEAT, tableName, LOG_CODE_HEARTBEAT]];
+    //then any log except App session, push result and tags, they are never evicted.
+    if (evicted < needEvict)
+    {
+        evicted += [self evictPendingLogs:needEvict - evicted withCondition:[NSString stringWithFormat:@"code NOT IN (%d, %d, %d, %d, %d, %d, %d)", LOG_CODE_APP_VISIBLE, LOG_CODE_APP_INVISIBLE, LOG_CODE_APP_COMPLETE, LOG_CODE_PUSH_RESULT, LOG_CODE_TAG_INCREMENT, LOG_CODE_TAG_DELETE, LOG_CODE_TAG_ADD]];
+    }
+    SHLog(@"Log database over cap (%ld rows, %llu bytes), evicted %ld of %ld.", (long)self.storedLogCount + evicted, databaseBytes, (long)evicted, (long)needEvict);
+    if (evicted > 0)
+    {
+        [self executeSql:@"PRAGMA incremental_vacuum"];
+    }
+}
+
+- (NSInteger)evictPendingLogs:(NSInteger)limit withCondition:(NSString *)condition
+{
+    //only pending rows, leased rows are in flight and will be deleted after upload.
+    NSString *evict_sql_str = [NSString stringWithFormat:@"DELETE FROM '%@' WHERE logid IN (SELECT logid FROM '%@' WHERE status = %d AND (%@) ORDER BY logid LIMIT %ld)", tableName, tableName, LOG_STATUS_PENDING, condition, (long)limit];
+    if (![self executeSql:evict_sql_str])
+    {
+        return 0;
+    }
+    NSInteger evicted = sqlite3_changes(database);
+    self.storedLogCount = MAX(0, self.storedLogCount - evicted);
+    self.evictedLogCount += evicted;
+    return evicted;
+}
+
 + (void)clearLocalToMakeFreshInstall
 {
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"INSTALL_SUID_KEY"]; //clear local install id, next will register a new one. This is most important, otherwise logs cannot submit due to conflict logid.
     [[NSUserDefaults standardUserDefaults] setObject:@(NO) forKey:@"APPSTATUS_REREGISTER"];  //clear reregister flag
     [[NSUserDefaults standardUserDefaults] setObject:@(0) forKey:@"NumTimesAppUsed"]; //report "App first run" instead of "App started and engine initialized".
-    [[NSUserDefaults standardUserDefaults] setObject:@(0) forKey:MAX_LOGID]; //local SQLite will be delete and rebuild, sent record reset to 0.
+    [[NSUserDefaults standardUserDefaults] removeObjectForKey:MAX_LOGID]; //now kept in SQLite meta table which is deleted and rebuilt, remove the one left by previous version so it's not migrated again.
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"SETTING_UTC_OFFSET"]; //make new install submit utc offset for first time.
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"ENTER_PAGE_HISTORY"];  //new install not have enter/exit history
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"ENTERBAK_PAGE_HISTORY"];
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"EXIT_PAGE_HISTORY"];
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"APPSTATUS_IBEACON_FETCH_TIME"]; //although App may still monitor these iBeacon regions, fetch them again for new intall.
     [[NSUserDefaults standardUserDefaults] setObject:[NSArray array] forKey:@"APPSTATUS_IBEACON_FETCH_LIST"]; //server side iBeacon UUID format changed in 1.6.0, must clear and re-register.
+    for (NSString *iBeaconFile in @[@"ibeacons.dat", @"ibeacons.journal"]) //iBeacon list and distance files replacing APPSTATUS_IBEACON_FETCH_LIST, same reason.
+    {
+        [[NSFileManager defaultManager] removeItemAtPath:[[NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES)[0] stringByAppendingPathComponent:@"StreetHawk"] stringByAppendingPathComponent:iBeaconFile] error:nil];
+    }
     [[NSUserDefaults standardUserDefaults] setObject:@"" forKey:@"LOCATION_DENIED_SENT"]; //new install should send location denied log once.
-    [[NSUserDefaults standardUserDefaults] setObject:@(0) forKey:FGBG_SESSION]; //new install session start from 1.
+    [[NSUserDefaults standardUserDefaults] removeObjectForKey:FGBG_SESSION]; //new install session start from 1, same as MAX_LOGID it's in meta table now.
     [[NSUserDefaults standardUserDefaults] synchronize];
     //These not need to update
     //Remote notification: APNS_DISABLE_TIMESTAMP, APNS_SENT_DISABLE_TIMESTAMP, APNS_DEVICE_TOKEN. Because old data is correct when register new install, and old data is passed in install/register to server. Note: if revoked=timestamp, this will make revoked earlier than created, it's correct as revoked means first time when notification is disabled.
@@ -801,6 +1763,24 @@ enum
         NSAssert(success, @"Fail to delete SQLite file: %@.", error.localizedDescription);
         success = YES; //disable "Unused variable" due to NSAssert ignored in pods.
     }
+    //WAL journal keeps uncheckpointed pages in side files, they must go together with database file, otherwise they are applied to the re-built database.
+    for (NSString *suffix in @[@"-wal", @"-shm"])
+    {
+        NSString *sidePath = [[SHLogger databasePath] stringByAppendingString:suffix];
+        if ([[NSFileManager defaultManager] fileExistsAtPath:sidePath])
+        {
+            [[NSFileManager defaultManager] removeItemAtPath:sidePath error:nil];
+        }
+    }
+    //Durable requests carry old install id, not replay them for new install.
+    for (NSString *suffix in @[@"", @"-wal", @"-shm"])
+    {
+        NSString *journalPath = [[SHRequestJournal databasePath] stringByAppendingString:suffix];
+        if ([[NSFileManager defaultManager] fileExistsAtPath:journalPath])
+        {
+            [[NSFileManager defaultManager] removeItemAtPath:journalPath error:nil];
+        }
+    }
 }
 
 @end
@@ -28,6 +28,90 @@ enum SHHostVersion
 };
 typedef enum SHHostVersion SHHostVersion;
 
+/**
+ Scheduling class of a request.
+ */
+enum SHRequestPriority
+{
+    /**
+     User may wait for the result, for example feed fetch. Default when App is not in background.
+     */
+    SHRequestPriority_Interactive,
+    /**
+     Must finish inside background time budget, for example heartbeat or push result in background fetch. Default when App is in background. It has a deadline, and fails with timeout without sending if the deadline passes while waiting in queue.
+     */
+    SHRequestPriority_BackgroundDeadline,
+    /**
+     Big and not urgent, for example crash report. Runs in its own queue one at a time, and not start while any request of other classes is waiting or running.
+     */
+    SHRequestPriority_Bulk,
+};
+typedef enum SHRequestPriority SHRequestPriority;
+
+/**
+ Retry policy attached to a request by `retryPolicy`. When an attempt fails with a retryable status or network error, the request is sent again after exponential backoff with jitter, and the handler is only called for the final attempt.
+ */
+@interface SHRetryPolicy : NSObject
+
+/**
+ A policy with 3 attempts, base delay 1 second, max delay 30 seconds, jitter 0.5, retry on network error, 5XX, 408 and 429.
+ */
++ (SHRetryPolicy *)defaultPolicy;
+
+/**
+ Max number of sends including the first one. 1 means not retry.
+ */
+@property (nonatomic) NSInteger maxAttempts;
+
+/**
+ Delay before the first retry in seconds, doubled for each following retry.
+ */
+@property (nonatomic) NSTimeInterval baseDelay;
+
+/**
+ Max delay before a retry in seconds. If server's "Retry-After" asks to wait longer than this, not retry.
+ */
+@property (nonatomic) NSTimeInterval maxDelay;
+
+/**
+ Fraction 0~1 of the backoff delay randomly taken off, so clients failed together not retry together.
+ */
+@property (nonatomic) double jitter;
+
+/**
+ Retry when request fails without response, such as timeout or connection lost.
+ */
+@property (nonatomic) BOOL retryOnNetworkError;
+
+/**
+ Retry on 5XX (except 501) and 408.
+ */
+@property (nonatomic) BOOL retryOnServerError;
+
+/**
+ Retry on 429 (Too Many Requests), "Retry-After" of 429 and 503 is honoured.
+ */
+@property (nonatomic) BOOL retryOnTooManyRequests;
+
+/**
+ Whether an attempt finished with `statusCode` (0 if no response) and `error` should be retried.
+ */
+- (BOOL)shouldRetryForStatusCode:(NSInteger)statusCode withError:(NSError *)error;
+
+/**
+ Delay before sending attempt `attempt` + 1. `retryAfter` is seconds asked by server, 0 if not asked.
+ @return Delay in seconds, negative means not retry.
+ */
+- (NSTimeInterval)delayAfterAttempt:(NSInteger)attempt withRetryAfter:(NSTimeInterval)retryAfter;
+
+/**
+ Longest time from first send to last attempt finish: every attempt times out and every retry waits `maxDelay`, as "Retry-After" longer than it is not retried. Queue waiting not included.
+ @param timeout Timeout of one attempt in seconds.
+ */
+- (NSTimeInterval)maxDurationWithTimeout:(NSTimeInterval)timeout;
+
+@end
+
 @class SHRequest;
 
 /**
@@ -39,7 +123,7 @@ typedef void (^SHRequestHandler)(SHRequest *request);
 #define SMART_PUSH_PAYLOAD  @"SMART_PUSH_PAYLOAD"
 
 /**
- All http requests used to communicate with server uses this class. It's a wrapper of NSURLConnection and easier to use by block callback.
+ All http requests used to communicate with server uses this class. It's a wrapper of shared NSURLSession per host (NSURLConnection on iOS 6) and easier to use by block callback.
  */
 @interface SHRequest : NSOperation
 
@@ -52,11 +136,22 @@ typedef void (^SHRequestHandler)(SHRequest *request);
  @param params A key/value pair, which will format to paramters in URL, for example (@"family", @"tops") will become "?family=tops".
  @param method GET or POST. If pass nil it's GET by default.
  @param headers The header fields sent in request. Pass nil if no header need to set.
- @param body_or_stream Set to post body. It's usually array, dictionary or data.
+ @param body_or_stream Set to post body. It's usually array, dictionary or data. For big body pass NSInputStream with "Content-Length" in `headers`, it cannot be retried.
  @return An auto-released request.
  */
 + (SHRequest *)requestWithPath:(NSString *)path withVersion:(SHHostVersion)hostVersion withParams:(NSArray *)params withMethod:(NSString *)method withHeaders:(NSDictionary *)headers withBodyOrStream:(id)body_or_stream;
 
+/**
+ Helper method to create a POST request whose body is JSON, for big uploads such as logs. If the endpoint accepts compressed body, the JSON is sent raw with "Content-Type: application/json" and "Content-Encoding: gzip". If the endpoint responds 415 (Unsupported Media Type), the same request is re-sent as form `formField=<json>` automatically and the endpoint is remembered to use form for a while. `requestHandler` is only called once for the final result.
+ @param path The internal path after root url, for example: "installs/log/".
+ @param hostVersion The version of current host.
+ @param params A key/value pair, which will format to paramters in URL.
+ @param jsonData UTF-8 JSON data to post.
+ @param formField The form field name used when fallback to form encoding, for example "records".
+ @return An auto-released request.
+ */
++ (SHRequest *)requestWithPath:(NSString *)path withVersion:(SHHostVersion)hostVersion withParams:(NSArray *)params withCompressedJson:(NSData *)jsonData orFormField:(NSString *)formField;
+
 /**
  Helper method to create a simple request object.
  @param path The internal path after root url, for example: "products/product_id/description/".
@@ -81,11 +176,84 @@ typedef void (^SHRequestHandler)(SHRequest *request);
  */
 + (SHRequest *)requestWithPath:(NSString *)path;
 
+/**
+ Helper method to create a request object from a complete URL request, for example replaying a journaled request. The request is sent as it is, without adding host, install id or headers.
+ @param urlRequest The URL request to send.
+ @return An auto-released request.
+ */
++ (SHRequest *)requestWithURLRequest:(NSURLRequest *)urlRequest;
+
 /**
  The request handler for caller to deal with returned value.
  */
 @property (nonatomic, copy) SHRequestHandler requestHandler;
 
+/**
+ If set, each element of the array in "value" of the response {"code": 0, "value": [...]} is parsed and passed to this block as soon as it's downloaded, before the whole response finishes, for example feed items. It's called in network thread, in element order, and before `requestHandler`. `resultValue` still contains the whole array when finish. Requests joining an in-flight identical request do not get it.
+ */
+@property (nonatomic, copy) void (^arrayItemHandler)(NSObject *item);
+
+/**
+ Use `SHResponseCache` for this GET request, default NO. If a previous response of same URL has "ETag" or "Last-Modified", the request is sent with "If-None-Match" or "If-Modified-Since", and when server responds 304 the cached body and its parsed result are used as a 200 response. Set it before `startAsynchronously`. Responses containing smart "push" are not cached as they must not be handled again.
+ */
+@property (nonatomic) BOOL useResponseCache;
+
+/**
+ Path of the file whose stream is the body, for example crash report. A body stream cannot be rewound, set it so a fresh stream is opened when the connection needs to send body again (stale keep-alive connection, authentication or redirect) and for each retry attempt. The file must stay until `requestHandler` is called.
+ */
+@property (nonatomic, strong) NSString *bodyStreamFilePath;
+
+/** @name Durable */
+
+/**
+ Write this request into `SHRequestJournal` before sending, default NO. If it fails by network error, 5XX, 408 or 429 (after `retryPolicy` if set), or App is killed before it finishes, the journal sends it again when network recovers or App becomes active, even in next launch. `requestHandler` is only called for this sending, not for replay. Set it before `startAsynchronously`, only for POST requests whose body is not a stream.
+ */
+@property (nonatomic) BOOL isDurable;
+
+/**
+ Key to deduplicate journaled requests when `isDurable` = YES. A new request removes pending ones of same key, for example a setting only needs the latest value. Default nil means SHA1 of method, URL and body, so only identical requests are collapsed.
+ */
+@property (nonatomic, strong) NSString *journalKey;
+
+/** @name Scheduling */
+
+/**
+ Scheduling class, default decided by App state when request is created. Set it before `startAsynchronously`. Changing from `SHRequestPriority_BackgroundDeadline` to other class clears `deadline`.
+ */
+@property (nonatomic) SHRequestPriority priority;
+
+/**
+ Time (since reference date) this request must finish by, 0 means no deadline. For `SHRequestPriority_BackgroundDeadline` it's creation time plus the background timeout computed when creating request, the remaining time is used as timeout when it starts.
+ */
+@property (nonatomic) NSTimeInterval deadline;
+
+/**
+ Queue-wait and execution-time histograms per scheduling class since App launch, for diagnostics. Format: {"buckets": [upper bounds in seconds], "interactive"/"background_deadline"/"bulk": {"count": n, "missed_deadline": n, "queue_wait": [counts], "execution": [counts]}}. The last count of each histogram is for time above the last bound.
+ */
++ (NSDictionary *)schedulerStatistics;
+
+/**
+ Single-flight statistics since App launch. Concurrent identical GET/HEAD requests (same method, URL and body hash) started by `startAsynchronously` are collapsed into one network call, and the result is fanned out to every request's `requestHandler`. Format: {"saved_calls": number of requests not sent, "saved_bytes": response bytes not downloaded again, "in_flight": number of requests being shared now}.
+ */
++ (NSDictionary *)singleFlightStatistics;
+
+/** @name Retry */
+
+/**
+ Retry policy for `startAsynchronously`, nil by default means not retry. `startSynchronously` does not retry.
+ */
+@property (nonatomic, strong) SHRetryPolicy *retryPolicy;
+
+/**
+ Number of times this request has been sent.
+ */
+@property (nonatomic, readonly) NSInteger attempts;
+
+/**
+ Whether requests to `host` are allowed by its circuit breaker. After 5 failures in a row (network error, 5XX or 429) a host is unhealthy for 30 seconds, requests to it fail immediately with NSURLErrorCannotConnectToHost without sending. Then one probe request is allowed, if it fails the host is unhealthy again with doubled time up to 5 minutes, if it succeeds the host is healthy.
+ */
++ (BOOL)isHostHealthy:(NSString *)host;
+
 /** @name Start/Cancel functions */
 
 /**
@@ -118,7 +286,7 @@ typedef void (^SHRequestHandler)(SHRequest *request);
 @property (nonatomic, readonly) NSInteger responseStatusCode;
 
 /**
- The data of received response data. It's appended when connection didReceiveData.
+ The data of received response data. It's complete when `requestHandler` is called. Capacity is reserved from "Content-Length"; if length is unknown chunks are kept and joined once when finish.
  */
 @property (nonatomic, readonly, weak) NSData *responseData;
 
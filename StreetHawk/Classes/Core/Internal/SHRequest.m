@@ -22,6 +22,32 @@
 //Change this in build time to turn on/off request log, helpful for debug.
 #define LOG_REQUESTS    NO
 
+#define REQUEST_GZIP_REJECTED   @"REQUEST_GZIP_REJECTED" //dictionary {path: time} for endpoints respond 415 to gzip body.
+#define REQUEST_GZIP_RETRY      (24 * 60 * 60) //seconds to try gzip body again for an endpoint rejected it before, server may be upgraded.
+
+#define REQUEST_PRIORITY_COUNT  3 //number of `SHRequestPriority` classes
+#define REQUEST_HISTOGRAM_COUNT 10 //number of histogram buckets, the last one has no upper bound
+static const NSTimeInterval shRequestHistogramBounds[REQUEST_HISTOGRAM_COUNT - 1] = {0.05, 0.1, 0.25, 0.5, 1, 2, 5, 10, 30};
+
+//Scheduler statistics, protected by `schedulerSemaphore()`.
+static NSInteger shRequestCount[REQUEST_PRIORITY_COUNT];
+static NSInteger shRequestMissedDeadline[REQUEST_PRIORITY_COUNT];
+static NSInteger shRequestQueueWait[REQUEST_PRIORITY_COUNT][REQUEST_HISTOGRAM_COUNT];
+static NSInteger shRequestExecution[REQUEST_PRIORITY_COUNT][REQUEST_HISTOGRAM_COUNT];
+static NSInteger shRequestNonBulkPending = 0; //interactive and background-deadline requests in queue or running, bulk queue is suspended while it's > 0.
+
+//Single-flight table and statistics, protected by `schedulerSemaphore()`.
+static NSMutableDictionary *shRequestInFlight = nil; //single-flight key -> leader SHRequest whose network call is in flight.
+static NSInteger shRequestSavedCalls = 0; //requests served by another in-flight identical request.
+static unsigned long long shRequestSavedBytes = 0; //response bytes not downloaded again due to single-flight.
+
+#define REQUEST_BREAKER_THRESHOLD       5 //failures in a row to make a host unhealthy
+#define REQUEST_BREAKER_COOLDOWN        30 //seconds a host is unhealthy for the first time
+#define REQUEST_BREAKER_COOLDOWN_MAX    (5 * 60) //max seconds a host is unhealthy, cooldown doubles when probe fails
+#define REQUEST_BUFFER_HINT_MAX         (16 * 1024 * 1024) //max capacity reserved from "Content-Length", avoid wrong header causing huge allocation.
+
+static NSMutableDictionary *shRequestHostHealth = nil; //host -> SHHostHealth, only hosts with recent failures. Protected by `schedulerSemaphore()`.
+
 #import "SHRequest.h"
 //header from StreetHawk
 #import "SHTypes.h" //for SHErrorDomain
@@ -29,13 +55,88 @@
 #import "SHInstall.h" //for `StreetHawk.currentInstall.suid`
 #import "SHAppStatus.h" //for alive host
 #import "SHUtils.h" //for shAppendParamsArrayToString
+#import "SHResponseCache.h" //for conditional GET
+#import "SHRequestJournal.h" //for durable request
+#import <CommonCrypto/CommonDigest.h> //for body hash of single-flight key
 #ifdef SH_FEATURE_NOTIFICATION
 #import "SHApp+Notification.h" //for notificationHandler
 #import "SHNotificationHandler.h" //for call handle function
 #endif
 
 
-@interface SHRequest()
+/**
+ Transport under SHRequest since iOS 7: one long-lived NSURLSession per host, shared by all requests, so TCP/TLS connections are kept alive and reused, and HTTP/2 streams are multiplexed when server supports it. It's the delegate of all sessions and routes task callbacks to the owning SHRequest, which handles them same as NSURLConnection callbacks. On iOS 6 NSURLSession is not available and SHRequest still uses NSURLConnection.
+ */
+@interface SHSessionTransport : NSObject <NSURLSessionDataDelegate>
+{
+    dispatch_semaphore_t transportSemaphore;
+}
+
+@property (nonatomic, strong) NSMutableDictionary *dictSessions; //host -> NSURLSession
+@property (nonatomic, strong) NSMapTable *mapTaskRequests; //NSURLSessionTask -> SHRequest, by pointer as task is not copyable.
+
+//Singleton, nil if NSURLSession not available.
++ (SHSessionTransport *)sharedInstance;
+//Create a data task for request on the shared session of its host. The task is not resumed.
+- (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)urlRequest forOwner:(SHRequest *)owner;
+//Owner of a task, nil if task already completed.
+- (SHRequest *)ownerOfTask:(NSURLSessionTask *)task remove:(BOOL)remove;
+
+@end
+
+/**
+ Circuit breaker state of a host.
+ */
+@interface SHHostHealth : NSObject
+
+@property (nonatomic) NSInteger consecutiveFailures; //failed attempts in a row
+@property (nonatomic) NSTimeInterval openUntil; //requests fail without sending until this time, 0 if breaker is closed.
+@property (nonatomic) NSTimeInterval cooldown; //seconds of last open period
+@property (nonatomic) NSTimeInterval probeTime; //time the probe after open period is sent, 0 if no probe in flight.
+
+@end
+
+/**
+ Precomputed parts of requests for one host version, rebuilt when alive host or install id changes. Building a request only appends path and params to `baseUrl`.
+ */
+@interface SHRequestTemplate : NSObject
+
+@property (nonatomic, strong) NSString *baseUrl; //result of `aliveHostForVersion:` it's built from, same instance until host changes.
+@property (nonatomic, strong) NSString *installId; //install id it's built from
+@property (nonatomic, strong) NSString *installIdParam; //encoded "installid=<suid>" to append, nil if host is not StreetHawk or no install id.
+@property (nonatomic, strong) NSDictionary *headers; //fixed StreetHawk request header
+
+@end
+
+/**
+ Incremental tokenizer for the array of a key in top JSON object, such as "value" in {"code": 0, "value": [...]}. It's fed with the growing response buffer and parses each element once its bytes are complete, without waiting for the whole response. It tracks strings, escapes and nesting depth only, no copy except the element itself.
+ */
+@interface SHJsonArrayTokenizer : NSObject
+{
+    NSUInteger scanOffset; //next byte to scan
+    NSInteger depth; //nesting depth of objects and arrays
+    BOOL isInString;
+    BOOL isEscaped;
+    NSUInteger stringStart; //offset of last opening quote
+    NSRange lastKeyRange; //bytes of last string in top object, as key of the following value
+    NSInteger arrayDepth; //depth inside target array, 0 if not entered
+    NSUInteger itemStart; //offset of current element, NSNotFound if between elements
+    BOOL isDone; //target array is closed
+}
+
+@property (nonatomic, strong) NSData *key;
+@property (nonatomic, copy) void (^itemHandler)(NSObject *item);
+
+//Create tokenizer for array of `key` in top object.
+- (id)initWithKey:(NSString *)key itemHandler:(void (^)(NSObject *item))itemHandler;
+//Scan bytes of `data` appended since last call. `data` must be the same buffer growing.
+- (void)consumeData:(NSData *)data;
+//Parse bytes from `itemStart` to `end` as an element and call handler.
+- (void)emitItemFrom:(const char *)bytes toEnd:(NSUInteger)end;
+
+@end
+
+@interface SHRequest() <NSURLConnectionDataDelegate>
 {
     dispatch_semaphore_t flagsSemaphore;
 }
@@ -43,6 +144,26 @@
 //request and connection used to send HTTP communication.
 @property (nonatomic, strong) NSURLRequest *request;
 @property (nonatomic, strong) NSURLConnection *connection;
+//Used instead of `connection` when `SHSessionTransport` is available.
+@property (nonatomic, strong) NSURLSessionDataTask *task;
+//If not nil, `request` is a gzip body and this builds the form encoding request to re-send when server responds 415.
+@property (nonatomic, copy) NSURLRequest *(^fallbackRequestBuilder)(void);
+//Path used as key of `REQUEST_GZIP_REJECTED`.
+@property (nonatomic, strong) NSString *compressPath;
+
+//Identical requests started while this one is in flight, they get result of this one instead of sending. Only used by leader.
+@property (nonatomic, strong) NSMutableArray *followers;
+//Key in `shRequestInFlight` if this request is the leader, nil if not coalesced.
+@property (nonatomic, strong) NSString *singleFlightKey;
+
+//header file declares it as readonly.
+@property (nonatomic) NSInteger attempts;
+
+//Row id in `SHRequestJournal` if `isDurable`, 0 if not journaled.
+@property (nonatomic) long long journalId;
+
+//this request is counted in `shRequestNonBulkPending`, decrease when finish.
+@property (nonatomic) BOOL isCountedNonBulk;
 
 //internal used flag to know this connection's invokeHandlerAndRelease has been called. If it's already been invoked, no need to invoke again, as notify will notice all listeners.
 @property (nonatomic) BOOL handlerInvoked;
@@ -65,20 +186,82 @@
 @property (nonatomic, strong) NSError *innerError;
 @property (nonatomic) int resultCode;
 @property (nonatomic, strong) NSObject *innerResultValue;
+//Chunks received when "Content-Length" is unknown, joined into `innerResponseData` once when finish. nil if receiving into `innerResponseData` directly.
+@property (nonatomic, strong) NSMutableArray *responseChunks;
+//Parses elements of "value" array while downloading when `arrayItemHandler` is set.
+@property (nonatomic, strong) SHJsonArrayTokenizer *arrayTokenizer;
+//Cached response whose validators are sent with this request, nil if not validating.
+@property (nonatomic, strong) SHCachedResponse *cachedResponse;
+//Server responds 304 and result comes from `cachedResponse`.
+@property (nonatomic) BOOL isResponseFromCache;
+//Parsed JSON of response, set by parse or from `cachedResponse` for 304. Stored into response cache with body.
+@property (nonatomic, strong) NSDictionary *parsedResponseDict;
+//String of `innerResponseData` made when `responseString` is first asked, cleared when data is replaced.
+@property (nonatomic, strong) NSString *cachedResponseString;
 
 //Initiates a StreetHawk with a url request and request handler.
 + (NSURLRequest *)urlRequestWithPath:(NSString *)path withVersion:(SHHostVersion)hostVersion withParams:(NSArray *)params withMethod:(NSString *)method withHeaders:(NSDictionary *)headers withBodyOrStream:(id)body_or_stream;
 - (SHRequest *)initWithRequest:(NSURLRequest *)request;
-//The Default queue for request to be handled. If `startAsynchronouslyInQueue:` set `queue`=nil, or call `startAsynchronously`, this queue is used. It's concurrent with max number 3.
+//The Default queue for request to be handled. If `startAsynchronouslyInQueue:` set `queue`=nil, or call `startAsynchronously`, this queue is used. It's concurrent with max number 3 for NSURLConnection, 8 for shared session as connections are reused.
 + (NSOperationQueue *)defaultOperationQueue;
-//Fixed StreetHawk request header.
+//Queue for `SHRequestPriority_Bulk`, concurrent number 1, suspended while other classes pending.
++ (NSOperationQueue *)bulkOperationQueue;
+//Semaphore protects scheduler statistics, counter and single-flight table.
++ (dispatch_semaphore_t)schedulerSemaphore;
+//Key of method+URL+body hash for idempotent request, nil if this request must not be coalesced.
+- (NSString *)buildSingleFlightKey;
+//If an identical request is in flight, attach to it as follower and return YES; otherwise become leader and return NO.
+- (BOOL)joinSingleFlight;
+//Leader finished, copy result to followers and call their handlers. If leader is cancelled followers start by themselves.
+- (void)fanOutToFollowers;
+//Record queue-wait and execution time when finish, and release bulk queue if no other class pending.
+- (void)recordScheduling;
+//Fixed StreetHawk request header. Same instance is returned until install id changes.
 + (NSDictionary *)requestHeader;
+//Template of `hostVersion`, rebuilt if host or install id changes.
++ (SHRequestTemplate *)templateForVersion:(SHHostVersion)hostVersion;
+//Whether the endpoint of `path` should be tried with gzip body. It's NO if it responded 415 in last `REQUEST_GZIP_RETRY` seconds.
++ (BOOL)isGzipAcceptedForPath:(NSString *)path;
+//Remember the endpoint of `path` not accept gzip body.
++ (void)markGzipRejectedForPath:(NSString *)path;
+//If current response is 415 for gzip body, switch to fallback form request. Return YES if fallback is taken and caller should send `request` again.
+- (BOOL)switchToFallbackRequest;
+//Send current `request` by shared session if available, otherwise by NSURLConnection in current run loop.
+- (void)sendRequest;
+//Stream of `bodyStreamFilePath` not read yet, nil if not set or file is gone.
+- (NSInputStream *)freshBodyStream;
+//Join `responseChunks` into `innerResponseData` by one allocation.
+- (void)joinResponseChunks;
+//If `useResponseCache` and URL is cached, add "If-None-Match"/"If-Modified-Since" to `request`.
+- (void)addCacheValidators;
+//For 304 of a validating request, use cached body and parsed result as 200 response. Return YES if cache is used.
+- (BOOL)restoreCachedResponse;
+//After parse, store a new 200 response with validators into cache, or remove stale entry.
+- (void)storeResponseToCache;
+//Error for request not sent because its host is unhealthy.
++ (NSError *)hostUnhealthyError;
+//Whether a request to `host` can be sent now, if the host's open period passed this request becomes the probe.
++ (BOOL)allowRequestToHost:(NSString *)host;
+//Update circuit breaker of `host` by result of an attempt.
++ (void)recordAttemptToHost:(NSString *)host isHealthy:(BOOL)isHealthy;
+//Whether an attempt result tells anything about host health. Device offline or cancelled says nothing of the host and returns NO; otherwise returns YES and sets `pIsHealthy`, only timeout, cannot connect/find host, 5xx and 429 are unhealthy.
++ (BOOL)isHostHealthKnownForStatusCode:(NSInteger)statusCode withError:(NSError *)error isHealthy:(BOOL *)pIsHealthy;
+//Attempt of `host` ends without telling its health, let next request probe instead of waiting for probe cooldown.
++ (void)releaseProbeToHost:(NSString *)host;
+//Seconds asked by "Retry-After" header of 429 or 503 response, 0 if not asked.
++ (NSTimeInterval)retryAfterOfResponse:(NSURLResponse *)response;
+//Record current attempt to circuit breaker, and if `retryPolicy` allows, reset result and schedule sending again. Return YES if retry is scheduled and handler should not be called now.
+- (BOOL)retryIfNeeded;
+//Send again after backoff delay, unless cancelled or host becomes unhealthy.
+- (void)sendRetry;
+//URL of the request after redirect.
+- (NSURL *)currentURL;
 //Make isRequestExecuting=NO, isRequestFinished=YES, and set KOV values.
 - (void)markAsFinished;
 //Mark status to be finished, call requestHandler and release self.
 - (void)invokeHandlerAndRelease;
 //Create the resultCode, resultValue and error objects. It happens in `connectionDidFinishLoading:`, at this moment the responseData is fully downloaded. Use self.jsonToObjectConverter(self.responseData, &err) can get NSDictionary of {"code"=0, "value"=...}.
--(void)parseResponseForConnection:(NSURLConnection *)theConnection withContentType:(NSString *)contentType;
+-(void)parseResponseForURL:(NSURL *)currentURL withContentType:(NSString *)contentType;
 
 @end
 
@@ -92,12 +275,67 @@
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^{
         sharedQueue = [[NSOperationQueue alloc] init];
-        sharedQueue.maxConcurrentOperationCount = 3;
+        sharedQueue.maxConcurrentOperationCount = ([SHSessionTransport sharedInstance] != nil) ? 8 : 3; //each NSURLConnection opens its own connection, keep it small.
         sharedQueue.name = @"SHRequestQueue";
     });
     return sharedQueue;
 }
 
++ (NSOperationQueue *)bulkOperationQueue
+{
+    static NSOperationQueue *bulkQueue = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        bulkQueue = [[NSOperationQueue alloc] init];
+        bulkQueue.maxConcurrentOperationCount = 1;
+        bulkQueue.name = @"SHRequestBulkQueue";
+    });
+    return bulkQueue;
+}
+
++ (dispatch_semaphore_t)schedulerSemaphore
+{
+    static dispatch_semaphore_t semaphore = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        semaphore = dispatch_semaphore_create(1);
+    });
+    return semaphore;
+}
+
++ (NSDictionary *)schedulerStatistics
+{
+    NSMutableArray *arrayBounds = [NSMutableArray array];
+    for (int i = 0; i < REQUEST_HISTOGRAM_COUNT - 1; i ++)
+    {
+        [arrayBounds addObject:@(shRequestHistogramBounds[i])];
+    }
+    NSMutableDictionary *dictStatistics = [NSMutableDictionary dictionaryWithObject:arrayBounds forKey:@"buckets"];
+    NSArray *arrayNames = @[@"interactive", @"background_deadline", @"bulk"]; //same order as `SHRequestPriority`
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    for (int priority = 0; priority < REQUEST_PRIORITY_COUNT; priority ++)
+    {
+        NSMutableArray *arrayWait = [NSMutableArray array];
+        NSMutableArray *arrayExecution = [NSMutableArray array];
+        for (int i = 0; i < REQUEST_HISTOGRAM_COUNT; i ++)
+        {
+            [arrayWait addObject:@(shRequestQueueWait[priority][i])];
+            [arrayExecution addObject:@(shRequestExecution[priority][i])];
+        }
+        dictStatistics[arrayNames[priority]] = @{@"count": @(shRequestCount[priority]), @"missed_deadline": @(shRequestMissedDeadline[priority]), @"queue_wait": arrayWait, @"execution": arrayExecution};
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+    return dictStatistics;
+}
+
++ (NSDictionary *)singleFlightStatistics
+{
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    NSDictionary *dictStatistics = @{@"saved_calls": @(shRequestSavedCalls), @"saved_bytes": @(shRequestSavedBytes), @"in_flight": @(shRequestInFlight.count)};
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+    return dictStatistics;
+}
+
 + (NSError *)requestCancelledError
 {
     static NSError *error = nil;
@@ -110,17 +348,61 @@
 
 + (NSDictionary *)requestHeader
 {
-    static NSMutableDictionary *dictHeader = nil;
+    static NSDictionary *dictFixedHeader = nil;
+    static NSDictionary *dictHeader = nil;
+    static NSString *headerInstallId = nil;
     static dispatch_once_t onceToken;
     dispatch_once(&onceToken, ^
     {
-        dictHeader = [[NSMutableDictionary alloc] init];
-        [dictHeader setObject:[NSString stringWithFormat:@"%@(%@)", StreetHawk.appKey, StreetHawk.version] forKey:@"User-Agent"]; //e.g: "SHSample(1.5.3)"
-        [dictHeader setObject:NONULL(StreetHawk.appKey) forKey:@"X-App-Key"];
-        [dictHeader setObject:StreetHawk.version forKey:@"X-Version"];
+        NSMutableDictionary *dictFixed = [[NSMutableDictionary alloc] init];
+        [dictFixed setObject:[NSString stringWithFormat:@"%@(%@)", StreetHawk.appKey, StreetHawk.version] forKey:@"User-Agent"]; //e.g: "SHSample(1.5.3)"
+        [dictFixed setObject:NONULL(StreetHawk.appKey) forKey:@"X-App-Key"];
+        [dictFixed setObject:StreetHawk.version forKey:@"X-Version"];
+        dictFixedHeader = dictFixed;
     });
-    [dictHeader setObject:StreetHawk.currentInstall.suid != nil ? StreetHawk.currentInstall.suid : @"null" forKey:@"X-Installid"]; //move out of singleton, otherwise first launch not reset again.
-    return dictHeader;
+    NSString *installId = StreetHawk.currentInstall.suid != nil ? StreetHawk.currentInstall.suid : @"null";
+    @synchronized([SHRequest class])
+    {
+        if (dictHeader == nil || ![headerInstallId isEqualToString:installId]) //not in singleton, otherwise first launch not reset again.
+        {
+            NSMutableDictionary *dictNew = [NSMutableDictionary dictionaryWithDictionary:dictFixedHeader];
+            [dictNew setObject:installId forKey:@"X-Installid"];
+            dictHeader = dictNew;
+            headerInstallId = installId;
+        }
+        return dictHeader;
+    }
+}
+
++ (SHRequestTemplate *)templateForVersion:(SHHostVersion)hostVersion
+{
+    static SHRequestTemplate *templates[SHHostVersion_V2 + 1];
+    if (hostVersion != SHHostVersion_V1 && hostVersion != SHHostVersion_V2)
+    {
+        hostVersion = SHHostVersion_Unknown; //only for full URL path, no base URL.
+    }
+    NSString *baseUrl = (hostVersion != SHHostVersion_Unknown) ? [[SHAppStatus sharedInstance] aliveHostForVersion:hostVersion] : nil;
+    NSString *installId = StreetHawk.currentInstall.suid;
+    NSDictionary *headers = [SHRequest requestHeader];
+    @synchronized([SHRequest class])
+    {
+        SHRequestTemplate *requestTemplate = templates[hostVersion];
+        if (requestTemplate != nil && requestTemplate.baseUrl == baseUrl/*same instance until host change*/ && requestTemplate.headers == headers/*same instance until install id change*/)
+        {
+            return requestTemplate;
+        }
+        requestTemplate = [[SHRequestTemplate alloc] init];
+        requestTemplate.baseUrl = baseUrl;
+        requestTemplate.installId = installId;
+        requestTemplate.headers = headers;
+        //Every api.streethawk.com request, no matter GET or POST, should include "installid" in the request.
+        if (baseUrl != nil && [baseUrl rangeOfString:@"https://api.streethawk.com" options:NSCaseInsensitiveSearch | NSAnchoredSearch].location != NSNotFound && !shStrIsEmpty(installId))
+        {
+            requestTemplate.installIdParam = shAppendParamsArrayToString([NSMutableString string], @[@"installid", installId], YES);
+        }
+        templates[hostVersion] = requestTemplate;
+        return requestTemplate;
+    }
 }
 
 #pragma mark - life cycle
@@ -140,23 +422,49 @@
         self.isRequestExecuting = NO;
         self.isRequestFinished = NO;
         self.isRequestCancelled = NO;
+        self.isCountedNonBulk = NO;
+        self.deadline = 0;
+        //background fetch has limited time, requests created in background must finish inside it.
+        self.priority = ([UIApplication sharedApplication].applicationState == UIApplicationStateBackground) ? SHRequestPriority_BackgroundDeadline : SHRequestPriority_Interactive;
     }
     return self;
 }
 
+- (void)setPriority:(SHRequestPriority)priority
+{
+    if (priority == SHRequestPriority_BackgroundDeadline && self.deadline == 0)
+    {
+        self.deadline = [NSDate timeIntervalSinceReferenceDate] + self.request.timeoutInterval; //timeout is the background budget decided in `urlRequestWithPath:...`.
+    }
+    else if (priority != SHRequestPriority_BackgroundDeadline && _priority == SHRequestPriority_BackgroundDeadline)
+    {
+        self.deadline = 0; //deadline comes from background budget, not apply to other classes.
+    }
+    _priority = priority;
+}
+
 + (NSURLRequest *)urlRequestWithPath:(NSString *)path withVersion:(SHHostVersion)hostVersion withParams:(NSArray *)params withMethod:(NSString *)method withHeaders:(NSDictionary *)headers withBodyOrStream:(id)body_or_stream
 {
-    NSMutableString *completeUrl = [NSMutableString string];
-    if (path != nil && ([path.lowercaseString hasPrefix:@"http://"] || [path.lowercaseString hasPrefix:@"https://"]))
+    SHRequestTemplate *requestTemplate = [SHRequest templateForVersion:hostVersion];
+    NSMutableString *completeUrl = nil;
+    NSString *installIdParam = nil; //"installid=<suid>" if need to add
+    if (path != nil && ([path rangeOfString:@"http://" options:NSCaseInsensitiveSearch | NSAnchoredSearch].location != NSNotFound || [path rangeOfString:@"https://" options:NSCaseInsensitiveSearch | NSAnchoredSearch].location != NSNotFound))
     {
+        completeUrl = [NSMutableString stringWithCapacity:path.length + 16 * params.count + 64];
         [completeUrl appendString:path];
+        if ([path rangeOfString:@"https://api.streethawk.com" options:NSCaseInsensitiveSearch | NSAnchoredSearch].location != NSNotFound && !shStrIsEmpty(requestTemplate.installId))
+        {
+            installIdParam = shAppendParamsArrayToString([NSMutableString string], @[@"installid", requestTemplate.installId], YES);
+        }
     }
     else
     {
         //base url
-        NSString *hostUrl = [[SHAppStatus sharedInstance] aliveHostForVersion:hostVersion];
+        NSString *hostUrl = requestTemplate.baseUrl;
         NSAssert(hostUrl != nil && hostUrl.length > 0, @"No host base URL.");
-        [completeUrl appendString:hostUrl];
+        completeUrl = [NSMutableString stringWithCapacity:hostUrl.length + path.length + 16 * params.count + 64]; //preallocate for path, params and installid
+        [completeUrl appendString:NONULL(hostUrl)];
+        installIdParam = requestTemplate.installIdParam;
         //adding path
         if (path != nil && path.length > 0)
         {
@@ -164,26 +472,37 @@
             {
                 [completeUrl deleteCharactersInRange:NSMakeRange(completeUrl.length-1, 1)]; //remove last "/"
             }
+            NSRange pathRange = NSMakeRange(0, path.length);
             if ([path characterAtIndex:0] == '/')
             {
-                path = [path substringFromIndex:1];  //remove first "/"
+                pathRange.location = 1; //remove first "/"
+                pathRange.length --;
+            }
+            if (pathRange.length > 0 && [path characterAtIndex:path.length - 1] == '/') //remove last "/", recent change in StreetHawk server requires NOT have "/" at path end.
+            {
+                pathRange.length --;
+            }
+            [completeUrl appendString:@"/"];
+            unichar pathBuffer[256];
+            if (pathRange.length <= 256)
+            {
+                [path getCharacters:pathBuffer range:pathRange]; //append without making sub string
+                CFStringAppendCharacters((__bridge CFMutableStringRef)completeUrl, pathBuffer, pathRange.length);
             }
-            if ([path hasSuffix:@"/"])  //remove last "/", recent change in StreetHawk server requires NOT have "/" at path end.
+            else
             {
-                path = [path substringToIndex:path.length - 1];
+                [completeUrl appendString:[path substringWithRange:pathRange]];
             }
-            [completeUrl appendFormat:@"/%@", path];
         }
     }
     //Every api.streethawk.com request, no matter GET or POST, should include "installid" in the request. Add it no matter GET or POST in params.
-    BOOL needAddInstallId = [completeUrl.lowercaseString hasPrefix:@"https://api.streethawk.com"] && !shStrIsEmpty(StreetHawk.currentInstall.suid);
-    NSMutableArray *refinedParams = [NSMutableArray arrayWithArray:params];
+    BOOL needAddInstallId = (installIdParam != nil);
+    shAppendParamsArrayToString(completeUrl, params, NO);
     if (needAddInstallId && ![params containsObject:@"installid"])
     {
-        [refinedParams addObject:@"installid"];
-        [refinedParams addObject:StreetHawk.currentInstall.suid];
+        [completeUrl appendString:([completeUrl rangeOfString:@"?"].location == NSNotFound) ? @"?" : @"&"];
+        [completeUrl appendString:installIdParam];
     }
-    shAppendParamsArrayToString(completeUrl, refinedParams, NO);
     //method
     NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:completeUrl]];
     request.HTTPShouldHandleCookies = NO;
@@ -192,24 +511,18 @@
         method = @"GET";
     }
     [request setHTTPMethod:method];
-    //header, both from customer and from fixed StreetHawk request fields. it should be setup before body.
-    if (headers)
-    {
-        [request setAllHTTPHeaderFields:headers];
-    }
-    [[SHRequest requestHeader] enumerateKeysAndObjectsUsingBlock:^(id header, id value, BOOL *stop)
+    //header, both from customer and from fixed StreetHawk request fields, customer's wins. it should be setup before body.
+    [request setAllHTTPHeaderFields:requestTemplate.headers];
+    [headers enumerateKeysAndObjectsUsingBlock:^(id header, id value, BOOL *stop)
      {
-         if (![headers.allKeys containsObject:header])
-         {
-             [request setValue:value forHTTPHeaderField:header];
-         }
+         [request setValue:value forHTTPHeaderField:header];
      }];
     //body
     if (body_or_stream)
     {
         if ([body_or_stream isKindOfClass:[NSArray class]])
         {
-            if (![request.allHTTPHeaderFields.allKeys containsObject:@"Content-Type"])
+            if ([request valueForHTTPHeaderField:@"Content-Type"] == nil)
             {
                 [request setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
             }
@@ -225,7 +538,7 @@
         }
         else if ([body_or_stream isKindOfClass:[NSDictionary class]])
         {
-            if (![request.allHTTPHeaderFields.allKeys containsObject:@"Content-Type"])
+            if ([request valueForHTTPHeaderField:@"Content-Type"] == nil)
             {
                 [request setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
             }
@@ -240,7 +553,7 @@
         }
         else if ([body_or_stream isKindOfClass:[NSData class]])
         {
-            if (![request.allHTTPHeaderFields.allKeys containsObject:@"Content-Type"])
+            if ([request valueForHTTPHeaderField:@"Content-Type"] == nil)
             {
                 [request setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
             }
@@ -248,21 +561,24 @@
         }
         else if ([body_or_stream isKindOfClass:[NSString class]])
         {
-            if (![request.allHTTPHeaderFields.allKeys containsObject:@"Content-Type"])
+            if ([request valueForHTTPHeaderField:@"Content-Type"] == nil)
             {
                 [request setValue:@"application/x-www-form-urlencoded" forHTTPHeaderField:@"Content-Type"];
             }
             [request setHTTPBody:[body_or_stream dataUsingEncoding:NSUTF8StringEncoding]];
         }
-        else
+        else if ([body_or_stream isKindOfClass:[NSInputStream class]]) //big body such as crash report, caller should set "Content-Length".
         {
-            NSAssert(NO, @"Should not reach here for post body: %@.", body_or_stream);
-            if (![request.allHTTPHeaderFields.allKeys containsObject:@"Content-Type"])
+            if ([request valueForHTTPHeaderField:@"Content-Type"] == nil)
             {
                 [request setValue:@"multipart/form-data" forHTTPHeaderField:@"Content-Type"];
             }
             [request setHTTPBodyStream:(NSInputStream *)body_or_stream];
         }
+        else
+        {
+            NSAssert(NO, @"Should not reach here for post body: %@.", body_or_stream);
+        }
     }
     //Background fetch must be finished in 30 seconds, however when testing found `[UIApplication sharedApplication].backgroundTimeRemaining` sometimes is more than 30 seconds, for example if just enter background it's 180 seconds, if start background task it's 10 minutes. Thus cannot depend on `[UIApplication sharedApplication].backgroundTimeRemaining` to calculate timeout.
     //To be safe and simple, if in background, timeout is 13 seconds(sometimes heartbeat follow by location update), if in foreground, timeout is 60 seconds.
@@ -282,6 +598,56 @@
     return nil;
 }
 
++ (SHRequest *)requestWithPath:(NSString *)path withVersion:(SHHostVersion)hostVersion withParams:(NSArray *)params withCompressedJson:(NSData *)jsonData orFormField:(NSString *)formField
+{
+    if (path == nil)
+    {
+        return nil;
+    }
+    NSURLRequest *(^formRequestBuilder)(void) = ^NSURLRequest *(void)
+    {
+        NSString *jsonStr = [[NSString alloc] initWithData:jsonData encoding:NSUTF8StringEncoding];
+        return [SHRequest urlRequestWithPath:path withVersion:hostVersion withParams:params withMethod:@"POST" withHeaders:nil withBodyOrStream:@[formField, NONULL(jsonStr)]];
+    };
+    NSData *compressedData = [SHRequest isGzipAcceptedForPath:path] ? shGzipData(jsonData) : nil;
+    if (compressedData == nil) //endpoint not accept gzip, or fail to compress.
+    {
+        return [[SHRequest alloc] initWithRequest:formRequestBuilder()];
+    }
+    NSURLRequest *req = [SHRequest urlRequestWithPath:path withVersion:hostVersion withParams:params withMethod:@"POST" withHeaders:@{@"Content-Type": @"application/json", @"Content-Encoding": @"gzip"} withBodyOrStream:compressedData];
+    SHRequest *request = [[SHRequest alloc] initWithRequest:req];
+    request.fallbackRequestBuilder = formRequestBuilder;
+    request.compressPath = path;
+    return request;
+}
+
++ (BOOL)isGzipAcceptedForPath:(NSString *)path
+{
+    NSDictionary *dictRejected = [[NSUserDefaults standardUserDefaults] objectForKey:REQUEST_GZIP_REJECTED];
+    if (dictRejected != nil && [dictRejected isKindOfClass:[NSDictionary class]])
+    {
+        NSObject *rejectTime = dictRejected[path];
+        if (rejectTime != nil && [rejectTime isKindOfClass:[NSNumber class]])
+        {
+            return [NSDate timeIntervalSinceReferenceDate] - [(NSNumber *)rejectTime doubleValue] > REQUEST_GZIP_RETRY;
+        }
+    }
+    return YES;
+}
+
++ (void)markGzipRejectedForPath:(NSString *)path
+{
+    NSMutableDictionary *dictRejected = [NSMutableDictionary dictionary];
+    NSDictionary *dictStored = [[NSUserDefaults standardUserDefaults] objectForKey:REQUEST_GZIP_REJECTED];
+    if (dictStored != nil && [dictStored isKindOfClass:[NSDictionary class]])
+    {
+        [dictRejected addEntriesFromDictionary:dictStored];
+    }
+    dictRejected[path] = @([NSDate timeIntervalSinceReferenceDate]);
+    [[NSUserDefaults standardUserDefaults] setObject:dictRejected forKey:REQUEST_GZIP_REJECTED];
+    [[NSUserDefaults standardUserDefaults] synchronize];
+}
+
 + (SHRequest *)requestWithPath:(NSString *)path withParams:(NSArray *)params withMethod:(NSString *)method
 {
     return [self requestWithPath:path withVersion:SHHostVersion_V1 withParams:params withMethod:method withHeaders:nil withBodyOrStream:nil];
@@ -297,6 +663,11 @@
     return [self requestWithPath:path withVersion:SHHostVersion_V1 withParams:nil withMethod:nil withHeaders:nil withBodyOrStream:nil];
 }
 
++ (SHRequest *)requestWithURLRequest:(NSURLRequest *)urlRequest
+{
+    return [[SHRequest alloc] initWithRequest:urlRequest];
+}
+
 - (void)dealloc
 {
     flagsSemaphore = 0;
@@ -311,7 +682,30 @@
     {
         SHLog(@"Request (%@) add into operation queue: %@", self, self.request.URL);
     }
-    [[SHRequest defaultOperationQueue] addOperation:self];  //it's added into queue, but not start until queue start it. The start function is called by queue.
+    if (self.isDurable && self.journalId == 0)
+    {
+        self.journalId = [[SHRequestJournal sharedInstance] appendRequest:self.request withKey:self.journalKey]; //written before sending so it survives App kill.
+    }
+    if ([self joinSingleFlight])
+    {
+        return; //identical request in flight, result comes by `fanOutToFollowers`.
+    }
+    if (self.priority == SHRequestPriority_Bulk)
+    {
+        self.queuePriority = NSOperationQueuePriorityVeryLow;
+        [[SHRequest bulkOperationQueue] addOperation:self];
+    }
+    else
+    {
+        //bulk request not start while this is pending, the running one continues but with low task priority.
+        dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+        self.isCountedNonBulk = YES;
+        shRequestNonBulkPending++;
+        [SHRequest bulkOperationQueue].suspended = YES;
+        dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+        self.queuePriority = (self.priority == SHRequestPriority_Interactive) ? NSOperationQueuePriorityVeryHigh : NSOperationQueuePriorityHigh;
+        [[SHRequest defaultOperationQueue] addOperation:self];  //it's added into queue, but not start until queue start it. The start function is called by queue.
+    }
 }
 
 - (NSData *)startSynchronously
@@ -325,6 +719,13 @@
     NSError *error_ = nil;
     NSData *data = [NSURLConnection sendSynchronousRequest:self.request returningResponse:&response_ error:&error_];
     self.innerResponse = response_;
+    if ([self switchToFallbackRequest])
+    {
+        response_ = nil;
+        error_ = nil;
+        data = [NSURLConnection sendSynchronousRequest:self.request returningResponse:&response_ error:&error_];
+        self.innerResponse = response_;
+    }
     self.innerError = error_;
     self.innerResponseData = [NSMutableData dataWithData:data];
     [self invokeHandlerAndRelease];
@@ -350,6 +751,7 @@
         SHLog(@"Cancel request (%@), URL: %@", self, self.request);
     }
     [self.connection cancel];
+    [self.task cancel];
     [super cancel];
     [self invokeHandlerAndRelease];
 }
@@ -369,11 +771,34 @@
         {
             SHLog(@"Request (%@) started (after %0.6fs): %@", self, (self.timeStartExecute-self.timeAddIntoQueue), self.request.URL);
         }
-        self.connection = [[NSURLConnection alloc] initWithRequest:self.request delegate:self];
-        [self.connection start];
+        if (self.deadline > 0 && self.timeStartExecute >= self.deadline)
+        {
+            //waited too long in queue, background time is used up. Not send it, caller handles it same as timeout.
+            self.innerError = [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorTimedOut userInfo:@{NSLocalizedDescriptionKey: @"Request deadline passed before start."}];
+            dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+            shRequestMissedDeadline[self.priority]++;
+            dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+            [self invokeHandlerAndRelease];
+        }
+        else if (![SHRequest allowRequestToHost:self.request.URL.host])
+        {
+            self.innerError = [SHRequest hostUnhealthyError];
+            [self invokeHandlerAndRelease];
+        }
+        else
+        {
+            if (self.deadline > 0 && self.deadline - self.timeStartExecute < self.request.timeoutInterval)
+            {
+                NSMutableURLRequest *deadlineRequest = [self.request mutableCopy];
+                deadlineRequest.timeoutInterval = MAX(1, self.deadline - self.timeStartExecute); //only remaining budget
+                self.request = deadlineRequest;
+            }
+            [self addCacheValidators];
+            [self sendRequest];
+        }
     }
-    //If this request is not running in main thread, keep its run loop until it's finished. Otherwise the run loop disappear and it cannot run successfully.
-    if (![NSThread isMainThread])
+    //If this request is not running in main thread, keep its run loop until it's finished. Otherwise the run loop disappear and it cannot run successfully. Session task not depend on this thread's run loop, it finishes by KVO of `isFinished`.
+    if (self.task == nil && ![NSThread isMainThread])
     {
         while(!self.isRequestFinished)
         {
@@ -390,6 +815,41 @@
     }
 }
 
+- (void)sendRequest
+{
+    self.attempts++;
+    if (self.attempts > 1 && self.bodyStreamFilePath != nil) //previous attempt has read the stream.
+    {
+        NSMutableURLRequest *streamRequest = [self.request mutableCopy];
+        streamRequest.HTTPBodyStream = [self freshBodyStream];
+        self.request = streamRequest;
+    }
+    SHSessionTransport *transport = [SHSessionTransport sharedInstance];
+    if (transport != nil)
+    {
+        self.task = [transport dataTaskWithRequest:self.request forOwner:self];
+        if ([self.task respondsToSelector:@selector(setPriority:)]) //iOS 8+, use values instead of constants NSURLSessionTaskPriorityHigh etc which are not in iOS 7.
+        {
+            self.task.priority = (self.priority == SHRequestPriority_Bulk) ? 0.25 : ((self.priority == SHRequestPriority_Interactive) ? 0.75 : 0.5);
+        }
+        [self.task resume];
+    }
+    else
+    {
+        self.connection = [[NSURLConnection alloc] initWithRequest:self.request delegate:self];
+        [self.connection start];
+    }
+}
+
+- (NSURL *)currentURL
+{
+    if (self.task != nil)
+    {
+        return self.task.currentRequest.URL;
+    }
+    return self.connection.currentRequest.URL;
+}
+
 //Asynchronous request is concurrent, as operation queue max concurrent number = 3. Synchronous request not need this override.
 - (BOOL)isConcurrent
 {
@@ -436,11 +896,47 @@
 - (NSString *)responseString
 {
     if (self.responseData != nil)
-        return [[NSString alloc] initWithData:self.responseData encoding:NSUTF8StringEncoding];
+    {
+        NSString *str = self.cachedResponseString;
+        if (str == nil || self.isRequestExecuting) //still receiving data, not cache.
+        {
+            str = [[NSString alloc] initWithData:self.responseData encoding:NSUTF8StringEncoding];
+            self.cachedResponseString = self.isRequestExecuting ? nil : str;
+        }
+        return str;
+    }
     else
         return @"";
 }
 
+- (void)setInnerResponseData:(NSMutableData *)innerResponseData
+{
+    _innerResponseData = innerResponseData;
+    self.responseChunks = nil;
+    self.cachedResponseString = nil;
+    self.parsedResponseDict = nil;
+}
+
+- (void)joinResponseChunks
+{
+    if (self.responseChunks == nil)
+    {
+        return;
+    }
+    NSUInteger totalLength = self.innerResponseData.length;
+    for (NSData *chunk in self.responseChunks)
+    {
+        totalLength += chunk.length;
+    }
+    NSMutableData *data = [NSMutableData dataWithCapacity:totalLength];
+    [data appendData:self.innerResponseData];
+    for (NSData *chunk in self.responseChunks)
+    {
+        [data appendData:chunk];
+    }
+    self.innerResponseData = data;
+}
+
 - (NSError *)error
 {
     return self.innerError;
@@ -451,6 +947,140 @@
     return self.innerResultValue;
 }
 
+- (void)recordScheduling
+{
+    int waitBucket = REQUEST_HISTOGRAM_COUNT - 1;
+    int executionBucket = REQUEST_HISTOGRAM_COUNT - 1;
+    BOOL isStarted = (self.timeStartExecute > 0);
+    NSTimeInterval queueWait = (isStarted ? self.timeStartExecute : self.timeEndExecute) - self.timeAddIntoQueue;
+    NSTimeInterval execution = self.timeEndExecute - self.timeStartExecute;
+    for (int i = REQUEST_HISTOGRAM_COUNT - 2; i >= 0; i --)
+    {
+        if (queueWait <= shRequestHistogramBounds[i])
+        {
+            waitBucket = i;
+        }
+        if (execution <= shRequestHistogramBounds[i])
+        {
+            executionBucket = i;
+        }
+    }
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    if (self.timeAddIntoQueue > 0) //synchronous request not in queue, not count it.
+    {
+        shRequestCount[self.priority]++;
+        shRequestQueueWait[self.priority][waitBucket]++;
+        if (isStarted)
+        {
+            shRequestExecution[self.priority][executionBucket]++;
+        }
+    }
+    if (self.isCountedNonBulk)
+    {
+        self.isCountedNonBulk = NO;
+        shRequestNonBulkPending--;
+        if (shRequestNonBulkPending <= 0)
+        {
+            shRequestNonBulkPending = 0;
+            [SHRequest bulkOperationQueue].suspended = NO;
+        }
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+}
+
+- (NSString *)buildSingleFlightKey
+{
+    NSString *method = (self.request.HTTPMethod != nil) ? self.request.HTTPMethod.uppercaseString : @"GET";
+    if (!([method isEqualToString:@"GET"] || [method isEqualToString:@"HEAD"]) || self.request.HTTPBodyStream != nil || self.fallbackRequestBuilder != nil)
+    {
+        return nil; //only idempotent request whose body can be hashed
+    }
+    NSMutableString *key = [NSMutableString stringWithFormat:@"%@ %@", method, self.request.URL.absoluteString];
+    NSData *body = self.request.HTTPBody;
+    if (body.length > 0)
+    {
+        unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+        CC_SHA1(body.bytes, (CC_LONG)body.length, digest);
+        [key appendFormat:@" %@", shDataToHexString([NSData dataWithBytes:digest length:CC_SHA1_DIGEST_LENGTH])];
+    }
+    return key;
+}
+
+- (BOOL)joinSingleFlight
+{
+    NSString *key = [self buildSingleFlightKey];
+    if (key == nil)
+    {
+        return NO;
+    }
+    BOOL isFollower = NO;
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    if (shRequestInFlight == nil)
+    {
+        shRequestInFlight = [NSMutableDictionary dictionary];
+    }
+    SHRequest *leader = shRequestInFlight[key];
+    if (leader != nil)
+    {
+        [leader.followers addObject:self]; //leader is removed from table before reading followers, so it's not lost.
+        isFollower = YES;
+    }
+    else
+    {
+        self.singleFlightKey = key;
+        self.followers = [NSMutableArray array];
+        shRequestInFlight[key] = self;
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+    if (isFollower && LOG_REQUESTS)
+    {
+        SHLog(@"Request (%@) joins in-flight request (%@): %@", self, leader, self.request.URL);
+    }
+    return isFollower;
+}
+
+- (void)fanOutToFollowers
+{
+    if (self.singleFlightKey == nil)
+    {
+        return;
+    }
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    if (shRequestInFlight[self.singleFlightKey] == self)
+    {
+        [shRequestInFlight removeObjectForKey:self.singleFlightKey];
+    }
+    self.singleFlightKey = nil;
+    NSArray *arrayFollowers = self.followers;
+    self.followers = nil;
+    if (!self.isRequestCancelled)
+    {
+        shRequestSavedCalls += arrayFollowers.count;
+        shRequestSavedBytes += arrayFollowers.count * self.innerResponseData.length;
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+    for (SHRequest *follower in arrayFollowers)
+    {
+        if (self.isRequestCancelled)
+        {
+            if (!follower.isRequestCancelled)
+            {
+                [follower startAsynchronously]; //leader's caller gives up, but followers still want the result. The first one becomes new leader.
+            }
+        }
+        else
+        {
+            follower.innerResponse = self.innerResponse;
+            follower.responseStatusCode = self.responseStatusCode;
+            follower.innerResponseData = [self.innerResponseData mutableCopy];
+            follower.innerError = self.innerError;
+            follower.resultCode = self.resultCode;
+            follower.innerResultValue = self.innerResultValue;
+            [follower invokeHandlerAndRelease];
+        }
+    }
+}
+
 #pragma mark - UIConnection delegate handlers
 
 //Mark status to be finished, call requestHandler and release self.
@@ -474,6 +1104,13 @@
     {
         SHLog(@"Request (%@) completed in %0.6fs: %@", self, (self.timeEndExecute-self.timeStartExecute), self.request.URL);
     }
+    [self recordScheduling];
+    [self fanOutToFollowers];
+    if (self.journalId != 0)
+    {
+        [[SHRequestJournal sharedInstance] finishRequest:self.journalId withStatusCode:self.responseStatusCode withError:self.innerError];
+        self.journalId = 0;
+    }
     //handle result, such as error
     if (self.error == nil && (self.resultCode != CODE_OK || self.responseStatusCode >= 300/*2XX is OK, above is wrong*/))
     {
@@ -499,7 +1136,15 @@
         NSString *comment = [NSString stringWithFormat:@"Status(%ld) %@ - %@. Error: %@.", (long)self.responseStatusCode, method, url, self.error];
         if (method != nil && [method compare:@"POST" options:NSCaseInsensitiveSearch] == NSOrderedSame)
         {
-            NSString *postStr = [[[NSString alloc] initWithData:self.request.HTTPBody encoding:NSUTF8StringEncoding] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+            NSString *postStr = nil;
+            if ([[self.request valueForHTTPHeaderField:@"Content-Encoding"] isEqualToString:@"gzip"])
+            {
+                postStr = [NSString stringWithFormat:@"<gzip %lu bytes>", (unsigned long)self.request.HTTPBody.length];
+            }
+            else
+            {
+                postStr = [[[NSString alloc] initWithData:self.request.HTTPBody encoding:NSUTF8StringEncoding] stringByReplacingPercentEscapesUsingEncoding:NSUTF8StringEncoding];
+            }
             comment = [comment stringByAppendingFormat:@"\nPost body: %@.", postStr];
         }
         SHLog(@"Add breakpoint here to know error request happen for %@.", comment);
@@ -519,6 +1164,10 @@
         self.innerError = error_;
         self.innerResponseData = nil;
         self.innerResultValue = nil;
+        if ([self retryIfNeeded])
+        {
+            return;
+        }
         [self invokeHandlerAndRelease];
     }
 }
@@ -529,6 +1178,21 @@
     {
         self.innerResponse = response_;
         self.responseStatusCode = ((NSHTTPURLResponse *)self.response).statusCode;
+        //new response discards data received before, reserve capacity so appending not reallocate.
+        long long expectedLength = response_.expectedContentLength;
+        if (expectedLength > 0 && expectedLength <= REQUEST_BUFFER_HINT_MAX)
+        {
+            self.innerResponseData = [NSMutableData dataWithCapacity:(NSUInteger)expectedLength];
+        }
+        else
+        {
+            self.innerResponseData = [NSMutableData data];
+            if (self.arrayItemHandler == nil) //tokenizer needs continuous bytes
+            {
+                self.responseChunks = [NSMutableArray array];
+            }
+        }
+        self.arrayTokenizer = (self.arrayItemHandler != nil && self.responseStatusCode / 100 == 2) ? [[SHJsonArrayTokenizer alloc] initWithKey:@"value" itemHandler:self.arrayItemHandler] : nil;
         //https://bitbucket.org/shawk/streethawk/issue/230/make-sure-handling-other-status-codes-than
         if (self.responseStatusCode / 100 == 2)  // 2XX status codes are ok
         {
@@ -554,16 +1218,41 @@
 {
     if (!self.isRequestCancelled)
     {
-        [self.innerResponseData appendData:data];
-    }
-}
-
+        if (self.responseChunks != nil)
+        {
+            [self.responseChunks addObject:data]; //keep reference only, no copy
+        }
+        else
+        {
+            [self.innerResponseData appendData:data];
+            [self.arrayTokenizer consumeData:self.innerResponseData];
+        }
+    }
+}
+
 - (void)connectionDidFinishLoading:(NSURLConnection *)connection_
 {
     if (!self.isRequestCancelled)
     {
+        [self joinResponseChunks];
+        self.arrayTokenizer = nil;
+        if ([self switchToFallbackRequest])
+        {
+            //re-send in same operation, `requestHandler` waits for the result of form request.
+            [self sendRequest];
+            return;
+        }
+        if ([self retryIfNeeded])
+        {
+            return;
+        }
         NSString *contentType = [((NSHTTPURLResponse *)self.response) allHeaderFields][@"Content-Type"];
-        [self parseResponseForConnection:connection_ withContentType:contentType];
+        if ([self restoreCachedResponse])
+        {
+            contentType = self.cachedResponse.contentType; //304 not have it
+        }
+        [self parseResponseForURL:self.currentURL withContentType:contentType];
+        [self storeResponseToCache];
         [self invokeHandlerAndRelease];
     }
 }
@@ -585,9 +1274,341 @@
     return cachedResponse;
 }
 
+- (NSInputStream *)connection:(NSURLConnection *)connection_ needNewBodyStream:(NSURLRequest *)request_
+{
+    return [self freshBodyStream];
+}
+
+- (NSInputStream *)freshBodyStream
+{
+    if (self.bodyStreamFilePath == nil || ![[NSFileManager defaultManager] fileExistsAtPath:self.bodyStreamFilePath])
+    {
+        return nil;
+    }
+    return [NSInputStream inputStreamWithFileAtPath:self.bodyStreamFilePath];
+}
+
+- (BOOL)switchToFallbackRequest
+{
+    if (self.fallbackRequestBuilder == nil || ((NSHTTPURLResponse *)self.innerResponse).statusCode != 415/*Unsupported Media Type*/)
+    {
+        return NO;
+    }
+    SHLog(@"Endpoint %@ not accept gzip body, fallback to form.", self.compressPath);
+    [SHRequest markGzipRejectedForPath:self.compressPath];
+    self.request = self.fallbackRequestBuilder();
+    self.fallbackRequestBuilder = nil; //only fallback once.
+    self.innerResponse = nil;
+    self.responseStatusCode = 0;
+    self.innerResponseData = [NSMutableData data];
+    return YES;
+}
+
+#pragma mark - response cache
+
+- (void)addCacheValidators
+{
+    self.cachedResponse = nil;
+    self.isResponseFromCache = NO;
+    NSString *method = (self.request.HTTPMethod != nil) ? self.request.HTTPMethod.uppercaseString : @"GET";
+    if (!self.useResponseCache || ![method isEqualToString:@"GET"])
+    {
+        return;
+    }
+    SHCachedResponse *cachedResponse = [[SHResponseCache sharedInstance] cachedResponseForURL:self.request.URL];
+    if (cachedResponse == nil)
+    {
+        return;
+    }
+    NSMutableURLRequest *validateRequest = [self.request mutableCopy];
+    validateRequest.cachePolicy = NSURLRequestReloadIgnoringLocalCacheData; //304 must come to here, not handled by NSURLCache.
+    if (!shStrIsEmpty(cachedResponse.eTag))
+    {
+        [validateRequest setValue:cachedResponse.eTag forHTTPHeaderField:@"If-None-Match"];
+    }
+    if (!shStrIsEmpty(cachedResponse.lastModified))
+    {
+        [validateRequest setValue:cachedResponse.lastModified forHTTPHeaderField:@"If-Modified-Since"];
+    }
+    self.request = validateRequest;
+    self.cachedResponse = cachedResponse;
+}
+
+- (BOOL)restoreCachedResponse
+{
+    if (self.responseStatusCode != 304 || self.cachedResponse == nil)
+    {
+        return NO;
+    }
+    self.innerResponseData = [NSMutableData dataWithData:self.cachedResponse.body];
+    self.parsedResponseDict = self.cachedResponse.parsedDict; //nil if loaded from disk, parse body then.
+    self.responseStatusCode = 200;
+    self.isResponseFromCache = YES;
+    [[SHResponseCache sharedInstance] recordHitWithBytesSaved:self.cachedResponse.body.length];
+    if (LOG_REQUESTS)
+    {
+        SHLog(@"Request (%@) not modified, use cached %lu bytes: %@", self, (unsigned long)self.cachedResponse.body.length, self.request.URL);
+    }
+    return YES;
+}
+
+- (void)storeResponseToCache
+{
+    if (!self.useResponseCache || self.responseStatusCode != 200)
+    {
+        return;
+    }
+    if (self.isResponseFromCache)
+    {
+        if (self.cachedResponse.parsedDict == nil)
+        {
+            self.cachedResponse.parsedDict = self.parsedResponseDict; //entry loaded from disk, keep parsed result for next time.
+        }
+        return;
+    }
+    [[SHResponseCache sharedInstance] recordMiss];
+    NSDictionary *headers = ((NSHTTPURLResponse *)self.innerResponse).allHeaderFields;
+    SHCachedResponse *newResponse = [[SHCachedResponse alloc] init];
+    newResponse.eTag = headers[@"ETag"];
+    newResponse.lastModified = headers[@"Last-Modified"];
+    if (self.resultCode != CODE_OK || self.parsedResponseDict == nil || self.parsedResponseDict[@"push"] != nil || (shStrIsEmpty(newResponse.eTag) && shStrIsEmpty(newResponse.lastModified)))
+    {
+        [[SHResponseCache sharedInstance] removeResponseForURL:self.request.URL]; //cannot validate or must not replay, old entry is stale.
+        return;
+    }
+    newResponse.body = [NSData dataWithData:self.innerResponseData];
+    newResponse.contentType = headers[@"Content-Type"];
+    newResponse.parsedDict = self.parsedResponseDict;
+    [[SHResponseCache sharedInstance] storeResponse:newResponse forURL:self.request.URL];
+}
+
+#pragma mark - retry and circuit breaker
+
++ (NSError *)hostUnhealthyError
+{
+    return [NSError errorWithDomain:NSURLErrorDomain code:NSURLErrorCannotConnectToHost userInfo:@{NSLocalizedDescriptionKey: @"Host keeps failing, request not sent until it recovers."}];
+}
+
++ (BOOL)isHostHealthy:(NSString *)host
+{
+    if (host == nil)
+    {
+        return YES;
+    }
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    SHHostHealth *health = shRequestHostHealth[host];
+    BOOL isHealthy = (health == nil || health.openUntil == 0);
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+    return isHealthy;
+}
+
++ (BOOL)allowRequestToHost:(NSString *)host
+{
+    if (host == nil)
+    {
+        return YES;
+    }
+    BOOL isAllowed = YES;
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    SHHostHealth *health = shRequestHostHealth[host];
+    if (health != nil && health.openUntil > 0)
+    {
+        if (now < health.openUntil)
+        {
+            isAllowed = NO;
+        }
+        else if (health.probeTime > 0 && now - health.probeTime < REQUEST_BREAKER_COOLDOWN)
+        {
+            isAllowed = NO; //one probe at a time, if it's lost (for example cancelled) another probe after cooldown.
+        }
+        else
+        {
+            health.probeTime = now;
+        }
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+    return isAllowed;
+}
+
++ (void)recordAttemptToHost:(NSString *)host isHealthy:(BOOL)isHealthy
+{
+    if (host == nil)
+    {
+        return;
+    }
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    if (isHealthy)
+    {
+        [shRequestHostHealth removeObjectForKey:host];
+    }
+    else
+    {
+        if (shRequestHostHealth == nil)
+        {
+            shRequestHostHealth = [NSMutableDictionary dictionary];
+        }
+        SHHostHealth *health = shRequestHostHealth[host];
+        if (health == nil)
+        {
+            health = [[SHHostHealth alloc] init];
+            shRequestHostHealth[host] = health;
+        }
+        health.consecutiveFailures++;
+        if (health.openUntil > 0 && now >= health.openUntil) //probe failed, unhealthy again for longer.
+        {
+            health.cooldown = MIN(health.cooldown * 2, REQUEST_BREAKER_COOLDOWN_MAX);
+            health.openUntil = now + health.cooldown;
+            health.probeTime = 0;
+            SHLog(@"Host %@ still fails, not send request to it in %.0f seconds.", host, health.cooldown);
+        }
+        else if (health.openUntil == 0 && health.consecutiveFailures >= REQUEST_BREAKER_THRESHOLD)
+        {
+            health.cooldown = REQUEST_BREAKER_COOLDOWN;
+            health.openUntil = now + health.cooldown;
+            SHLog(@"Host %@ fails %ld times in a row, not send request to it in %.0f seconds.", host, (long)health.consecutiveFailures, health.cooldown);
+        }
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+}
+
++ (BOOL)isHostHealthKnownForStatusCode:(NSInteger)statusCode withError:(NSError *)error isHealthy:(BOOL *)pIsHealthy
+{
+    BOOL isHealthy = YES;
+    if (error != nil && [error.domain isEqualToString:NSURLErrorDomain])
+    {
+        switch (error.code)
+        {
+            case NSURLErrorTimedOut:
+            case NSURLErrorCannotConnectToHost:
+            case NSURLErrorCannotFindHost:
+            case NSURLErrorDNSLookupFailed:
+                isHealthy = NO;
+                break;
+            default:
+                return NO; //no connectivity (NotConnectedToInternet, NetworkConnectionLost, DataNotAllowed, InternationalRoamingOff...), cancelled or client side error, host is not reached.
+        }
+    }
+    else if (statusCode >= 500 || statusCode == 429)
+    {
+        isHealthy = NO;
+    }
+    if (pIsHealthy != NULL)
+    {
+        *pIsHealthy = isHealthy;
+    }
+    return YES;
+}
+
++ (void)releaseProbeToHost:(NSString *)host
+{
+    if (host == nil)
+    {
+        return;
+    }
+    dispatch_semaphore_wait([SHRequest schedulerSemaphore], DISPATCH_TIME_FOREVER);
+    SHHostHealth *health = shRequestHostHealth[host];
+    if (health != nil && health.openUntil > 0 && [NSDate timeIntervalSinceReferenceDate] >= health.openUntil)
+    {
+        health.probeTime = 0;
+    }
+    dispatch_semaphore_signal([SHRequest schedulerSemaphore]);
+}
+
++ (NSTimeInterval)retryAfterOfResponse:(NSURLResponse *)response
+{
+    if (![response isKindOfClass:[NSHTTPURLResponse class]])
+    {
+        return 0;
+    }
+    NSHTTPURLResponse *httpResponse = (NSHTTPURLResponse *)response;
+    if (httpResponse.statusCode != 429 && httpResponse.statusCode != 503)
+    {
+        return 0;
+    }
+    NSString *retryAfter = httpResponse.allHeaderFields[@"Retry-After"];
+    if (shStrIsEmpty(retryAfter))
+    {
+        return 0;
+    }
+    NSScanner *scanner = [NSScanner scannerWithString:retryAfter];
+    double seconds = 0;
+    if ([scanner scanDouble:&seconds] && scanner.isAtEnd) //delta-seconds
+    {
+        return MAX(0, seconds);
+    }
+    NSDate *date = [shGetDateFormatter(@"EEE, dd MMM yyyy HH:mm:ss zzz", nil, nil) dateFromString:retryAfter]; //HTTP-date
+    return (date != nil) ? MAX(0, [date timeIntervalSinceNow]) : 0;
+}
+
+- (BOOL)retryIfNeeded
+{
+    NSInteger statusCode = ((NSHTTPURLResponse *)self.innerResponse).statusCode;
+    BOOL isHealthy = YES;
+    if ([SHRequest isHostHealthKnownForStatusCode:statusCode withError:self.innerError isHealthy:&isHealthy])
+    {
+        [SHRequest recordAttemptToHost:self.request.URL.host isHealthy:isHealthy];
+    }
+    else
+    {
+        [SHRequest releaseProbeToHost:self.request.URL.host]; //offline, not count as failure so breaker is not opened by connectivity.
+    }
+    if (self.retryPolicy == nil || self.attempts >= self.retryPolicy.maxAttempts || self.isRequestCancelled)
+    {
+        return NO;
+    }
+    if (![self.retryPolicy shouldRetryForStatusCode:statusCode withError:self.innerError])
+    {
+        return NO;
+    }
+    NSTimeInterval delay = [self.retryPolicy delayAfterAttempt:self.attempts withRetryAfter:[SHRequest retryAfterOfResponse:self.innerResponse]];
+    if (delay < 0 || (self.deadline > 0 && [NSDate timeIntervalSinceReferenceDate] + delay >= self.deadline))
+    {
+        return NO;
+    }
+    if (LOG_REQUESTS)
+    {
+        SHLog(@"Request (%@) attempt %ld failed (status %ld, error %@), retry in %0.3fs: %@", self, (long)self.attempts, (long)statusCode, self.innerError, delay, self.request.URL);
+    }
+    self.innerResponse = nil;
+    self.responseStatusCode = 0;
+    self.innerResponseData = [NSMutableData data];
+    self.innerError = nil;
+    self.innerResultValue = nil;
+    self.resultCode = CODE_OK;
+    if (self.connection != nil)
+    {
+        [self performSelector:@selector(sendRetry) withObject:nil afterDelay:delay]; //NSURLConnection must be scheduled in this thread's run loop, which keeps running until request finished.
+    }
+    else
+    {
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(delay * NSEC_PER_SEC)), dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+        {
+            [self sendRetry];
+        });
+    }
+    return YES;
+}
+
+- (void)sendRetry
+{
+    if (self.isRequestCancelled) //cancel function has invokeHandlerAndRelease
+    {
+        return;
+    }
+    if (![SHRequest allowRequestToHost:self.request.URL.host])
+    {
+        self.innerError = [SHRequest hostUnhealthyError];
+        [self invokeHandlerAndRelease];
+        return;
+    }
+    [self sendRequest];
+}
+
 #pragma mark - parse function
 
--(void)parseResponseForConnection:(NSURLConnection *)theConnection withContentType:(NSString *)contentType
+-(void)parseResponseForURL:(NSURL *)currentURL withContentType:(NSString *)contentType
 {
     if (self.responseStatusCode >= 300/*2XX is OK, above is wrong*/) //server change format, if http status code is wrong it will not have "code" and "value".
     {
@@ -599,8 +1620,8 @@
         if ([contentType hasPrefix:@"application/json"] ||
             [contentType hasPrefix:@"text/json"])
         {
-            NSString *jsonStr = self.responseString;
-            NSDictionary *dict = shParseObjectToDict(jsonStr);
+            NSDictionary *dict = (self.parsedResponseDict != nil) ? self.parsedResponseDict/*304 reuses cached result*/ : shParseJsonDataToDict(self.innerResponseData); //parse received bytes directly, string is only made if needed.
+            self.parsedResponseDict = dict;
             NSAssert(dict != nil && [dict isKindOfClass:[NSDictionary class]], @"Fail to parse response %@.", self.responseString);
             if (dict != nil && [dict isKindOfClass:NSDictionary.class])
             {
@@ -608,7 +1629,7 @@
                 NSObject *value = dict[@"value"];
                 BOOL hasValidCode = (code != nil && [code isKindOfClass:[NSNumber class]]);
                 BOOL hasValidValue = value != nil && (value == (id)[NSNull null] || [value isKindOfClass:[NSArray class]] || [value isKindOfClass:[NSDictionary class]] || [value isKindOfClass:[NSString class]]/*when fail value is error message*/ || [value isKindOfClass:[NSNumber class]]/*when invite friend, return task id*/);
-                if ([theConnection.currentRequest.URL.absoluteString hasPrefix:@"https://api.streethawk.com"])
+                if ([currentURL.absoluteString hasPrefix:@"https://api.streethawk.com"])
                 {
                     //only force check this format for StreetHawk server, customer may use it to do other request.
                     NSAssert(hasValidCode, @"Wrong format to get resultCode. Dict: %@", dict);
@@ -625,66 +1646,77 @@
                 }
                 //response may have "app_status" section, but it's not guranteed to have all keys, or even have this section.
                 NSDictionary *dictStatus = nil;
-                if ([dict.allKeys containsObject:@"app_status"] && [dict[@"app_status"] isKindOfClass:[NSDictionary class]])
+                NSObject *appStatus = dict[@"app_status"];
+                if ([appStatus isKindOfClass:[NSDictionary class]])
                 {
-                    dictStatus = (NSDictionary *)dict[@"app_status"]; //Most request use "app_status" because they have installid
+                    dictStatus = (NSDictionary *)appStatus; //Most request use "app_status" because they have installid
                 }
-                else if ([theConnection.currentRequest.URL.absoluteString rangeOfString:@"apps/status"].location != NSNotFound && [self.innerResultValue isKindOfClass:[NSDictionary class]]) //First not have installid, Tobias return by value, must do it in else
+                else if ([currentURL.absoluteString rangeOfString:@"apps/status"].location != NSNotFound && [self.innerResultValue isKindOfClass:[NSDictionary class]]) //First not have installid, Tobias return by value, must do it in else
                 {
                     dictStatus = (NSDictionary *)self.innerResultValue;
                 }
                 if (dictStatus != nil)
                 {
+                    //Each key is looked up once by hash, nil means not in this response.
                     //check "streethawk" to enable/disable library function
-                    if ([dictStatus.allKeys containsObject:@"streethawk"] && [dictStatus[@"streethawk"] respondsToSelector:@selector(boolValue)])
+                    NSObject *streethawk = dictStatus[@"streethawk"];
+                    if ([streethawk respondsToSelector:@selector(boolValue)])
                     {
-                        [SHAppStatus sharedInstance].streethawkEnabled = [dictStatus[@"streethawk"] boolValue];
+                        [SHAppStatus sharedInstance].streethawkEnabled = [(NSNumber *)streethawk boolValue];
                     }
                     //check "host"
-                    if ([dictStatus.allKeys containsObject:@"host"] && [dictStatus[@"host"] isKindOfClass:[NSString class]])
+                    NSObject *host = dictStatus[@"host"];
+                    if ([host isKindOfClass:[NSString class]])
                     {
-                        [SHAppStatus sharedInstance].aliveHost = dictStatus[@"host"];
+                        [SHAppStatus sharedInstance].aliveHost = (NSString *)host;
                     }
                     //check "location_updates"
-                    if ([dictStatus.allKeys containsObject:@"location_updates"] && [dictStatus[@"location_updates"] respondsToSelector:@selector(boolValue)])
+                    NSObject *locationUpdates = dictStatus[@"location_updates"];
+                    if ([locationUpdates respondsToSelector:@selector(boolValue)])
                     {
-                        [SHAppStatus sharedInstance].uploadLocationChange = [dictStatus[@"location_updates"] boolValue];
+                        [SHAppStatus sharedInstance].uploadLocationChange = [(NSNumber *)locationUpdates boolValue];
                     }
                     //check "submit_views"
-                    if ([dictStatus.allKeys containsObject:@"submit_views"] && [dictStatus[@"submit_views"] respondsToSelector:@selector(boolValue)])
+                    NSObject *submitViews = dictStatus[@"submit_views"];
+                    if ([submitViews respondsToSelector:@selector(boolValue)])
                     {
-                        [SHAppStatus sharedInstance].allowSubmitFriendlyNames = [dictStatus[@"submit_views"] boolValue];
+                        [SHAppStatus sharedInstance].allowSubmitFriendlyNames = [(NSNumber *)submitViews boolValue];
                     }
+#ifdef SH_FEATURE_IBEACON
                     //check "ibeacon"
-                    if ([dictStatus.allKeys containsObject:@"ibeacon"])
+                    NSObject *ibeacon = dictStatus[@"ibeacon"];
+                    if (ibeacon != nil)
                     {
-#ifdef SH_FEATURE_IBEACON
-                        [SHAppStatus sharedInstance].iBeaconTimeStamp = dictStatus[@"ibeacon"]; //it may be nil
-#endif
+                        [SHAppStatus sharedInstance].iBeaconTimeStamp = (NSString *)ibeacon;
                     }
+#endif
+#ifdef SH_FEATURE_FEED
                     //check "feed"
-                    if ([dictStatus.allKeys containsObject:@"feed"])
+                    NSObject *feed = dictStatus[@"feed"];
+                    if (feed != nil)
                     {
-#ifdef SH_FEATURE_FEED
-                        [SHAppStatus sharedInstance].feedTimeStamp = dictStatus[@"feed"];
-#endif
+                        [SHAppStatus sharedInstance].feedTimeStamp = (NSString *)feed;
                     }
+#endif
                     //check "reregister"
-                    if ([dictStatus.allKeys containsObject:@"reregister"])
+                    NSObject *reregister = dictStatus[@"reregister"];
+                    if (reregister != nil)
                     {
-                        [SHAppStatus sharedInstance].reregister = [dictStatus[@"reregister"] boolValue];
+                        [SHAppStatus sharedInstance].reregister = [(NSNumber *)reregister boolValue];
                     }
                     //check "app_store_id"
-                    if ([dictStatus.allKeys containsObject:@"app_store_id"])
+                    NSObject *appstoreId = dictStatus[@"app_store_id"];
+                    if (appstoreId != nil)
                     {
-                        [SHAppStatus sharedInstance].appstoreId = dictStatus[@"app_store_id"];
+                        [SHAppStatus sharedInstance].appstoreId = (NSString *)appstoreId;
                     }
                 }
                 //response may have "push" for smart push.
-                if ([dict.allKeys containsObject:@"push"] && [dict[@"push"] isKindOfClass:[NSDictionary class]])
+                NSObject *push = dict[@"push"];
+                if ([push isKindOfClass:[NSDictionary class]])
                 {
 #ifdef SH_FEATURE_NOTIFICATION
-                    NSDictionary *payload = (NSDictionary *)dict[@"push"]; //it's same format as remote notification.
+                    NSDictionary *payload = (NSDictionary *)push; //it's same format as remote notification.
                     if ([UIApplication sharedApplication].applicationState == UIApplicationStateActive) //App in FG, directly handle this smart push.
                     {
                         if ([StreetHawk.notificationHandler isDefinedCode:payload])
@@ -711,3 +1743,308 @@
 }
 
 @end
+
+@implementation SHSessionTransport
+
++ (SHSessionTransport *)sharedInstance
+{
+    static SHSessionTransport *instance = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^
+    {
+        if (NSClassFromString(@"NSURLSession") != nil) //iOS 7+
+        {
+            instance = [[SHSessionTransport alloc] init];
+        }
+    });
+    return instance;
+}
+
+- (id)init
+{
+    if (self = [super init])
+    {
+        transportSemaphore = dispatch_semaphore_create(1);
+        self.dictSessions = [NSMutableDictionary dictionary];
+        self.mapTaskRequests = [NSMapTable mapTableWithKeyOptions:NSPointerFunctionsStrongMemory | NSPointerFunctionsObjectPointerPersonality valueOptions:NSPointerFunctionsStrongMemory];
+    }
+    return self;
+}
+
+- (NSURLSessionDataTask *)dataTaskWithRequest:(NSURLRequest *)urlRequest forOwner:(SHRequest *)owner
+{
+    NSString *host = NONULL(urlRequest.URL.host.lowercaseString);
+    dispatch_semaphore_wait(transportSemaphore, DISPATCH_TIME_FOREVER);
+    NSURLSession *session = self.dictSessions[host];
+    if (session == nil)
+    {
+        NSURLSessionConfiguration *configuration = [NSURLSessionConfiguration defaultSessionConfiguration];
+        configuration.HTTPShouldSetCookies = NO; //same as `HTTPShouldHandleCookies = NO` of each request.
+        configuration.HTTPMaximumConnectionsPerHost = 4; //HTTP/1.1 pool size, HTTP/2 uses one connection for all.
+        //delegate queue nil means session creates a serial queue, so callbacks of one task keep order.
+        session = [NSURLSession sessionWithConfiguration:configuration delegate:self delegateQueue:nil];
+        self.dictSessions[host] = session;
+    }
+    NSURLSessionDataTask *task = [session dataTaskWithRequest:urlRequest];
+    [self.mapTaskRequests setObject:owner forKey:task]; //keep owner alive until task complete, same as NSURLConnection retains its delegate.
+    dispatch_semaphore_signal(transportSemaphore);
+    return task;
+}
+
+- (SHRequest *)ownerOfTask:(NSURLSessionTask *)task remove:(BOOL)remove
+{
+    dispatch_semaphore_wait(transportSemaphore, DISPATCH_TIME_FOREVER);
+    SHRequest *owner = [self.mapTaskRequests objectForKey:task];
+    if (remove)
+    {
+        [self.mapTaskRequests removeObjectForKey:task];
+    }
+    dispatch_semaphore_signal(transportSemaphore);
+    return owner;
+}
+
+#pragma mark - NSURLSessionDataDelegate
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveResponse:(NSURLResponse *)response completionHandler:(void (^)(NSURLSessionResponseDisposition disposition))completionHandler
+{
+    SHRequest *owner = [self ownerOfTask:dataTask remove:NO];
+    [owner connection:nil didReceiveResponse:response];
+    completionHandler(NSURLSessionResponseAllow);
+}
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask didReceiveData:(NSData *)data
+{
+    SHRequest *owner = [self ownerOfTask:dataTask remove:NO];
+    [owner connection:nil didReceiveData:data];
+}
+
+- (void)URLSession:(NSURLSession *)session dataTask:(NSURLSessionDataTask *)dataTask willCacheResponse:(NSCachedURLResponse *)proposedResponse completionHandler:(void (^)(NSCachedURLResponse *cachedResponse))completionHandler
+{
+    SHRequest *owner = [self ownerOfTask:dataTask remove:NO];
+    completionHandler(owner != nil ? [owner connection:nil willCacheResponse:proposedResponse] : nil);
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task needNewBodyStream:(void (^)(NSInputStream *bodyStream))completionHandler
+{
+    SHRequest *owner = [self ownerOfTask:task remove:NO];
+    completionHandler([owner freshBodyStream]); //nil fails the task, same as not implementing it.
+}
+
+- (void)URLSession:(NSURLSession *)session task:(NSURLSessionTask *)task didCompleteWithError:(NSError *)error
+{
+    SHRequest *owner = [self ownerOfTask:task remove:YES];
+    if (owner == nil)
+    {
+        return;
+    }
+    //finish out of delegate queue, request handler may take time and should not delay other responses of this host.
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+    {
+        if (error != nil)
+        {
+            [owner connection:nil didFailWithError:error];
+        }
+        else
+        {
+            [owner connectionDidFinishLoading:nil];
+        }
+    });
+}
+
+@end
+
+@implementation SHHostHealth
+
+@end
+
+@implementation SHRetryPolicy
+
++ (SHRetryPolicy *)defaultPolicy
+{
+    return [[SHRetryPolicy alloc] init];
+}
+
+- (id)init
+{
+    if (self = [super init])
+    {
+        self.maxAttempts = 3;
+        self.baseDelay = 1;
+        self.maxDelay = 30;
+        self.jitter = 0.5;
+        self.retryOnNetworkError = YES;
+        self.retryOnServerError = YES;
+        self.retryOnTooManyRequests = YES;
+    }
+    return self;
+}
+
+- (BOOL)shouldRetryForStatusCode:(NSInteger)statusCode withError:(NSError *)error
+{
+    if (statusCode == 0)
+    {
+        return self.retryOnNetworkError && error != nil && [error.domain isEqualToString:NSURLErrorDomain] && error.code != NSURLErrorCancelled;
+    }
+    if (statusCode == 429)
+    {
+        return self.retryOnTooManyRequests;
+    }
+    if (statusCode == 503 && self.retryOnTooManyRequests)
+    {
+        return YES; //server busy, may have "Retry-After".
+    }
+    return self.retryOnServerError && ((statusCode >= 500 && statusCode != 501/*Not Implemented never changes*/) || statusCode == 408);
+}
+
+- (NSTimeInterval)delayAfterAttempt:(NSInteger)attempt withRetryAfter:(NSTimeInterval)retryAfter
+{
+    if (retryAfter > self.maxDelay)
+    {
+        return -1; //server asks to wait too long, give up and let caller try later.
+    }
+    NSTimeInterval backoff = MIN(self.maxDelay, self.baseDelay * pow(2, MAX(0, attempt - 1)));
+    backoff -= backoff * MIN(MAX(self.jitter, 0), 1) * (arc4random_uniform(1001) / 1000.0);
+    return MAX(backoff, retryAfter);
+}
+
+- (NSTimeInterval)maxDurationWithTimeout:(NSTimeInterval)timeout
+{
+    NSInteger attempts = MAX(1, self.maxAttempts);
+    return attempts * timeout + (attempts - 1) * MAX(0, self.maxDelay);
+}
+
+@end
+
+@implementation SHJsonArrayTokenizer
+
+- (id)initWithKey:(NSString *)key itemHandler:(void (^)(NSObject *item))itemHandler
+{
+    if (self = [super init])
+    {
+        self.key = [key dataUsingEncoding:NSUTF8StringEncoding];
+        self.itemHandler = itemHandler;
+        scanOffset = 0;
+        depth = 0;
+        isInString = NO;
+        isEscaped = NO;
+        lastKeyRange = NSMakeRange(NSNotFound, 0);
+        arrayDepth = 0;
+        itemStart = NSNotFound;
+        isDone = NO;
+    }
+    return self;
+}
+
+- (void)consumeData:(NSData *)data
+{
+    const char *bytes = (const char *)data.bytes;
+    NSUInteger length = data.length;
+    for (NSUInteger i = scanOffset; i < length && !isDone; i ++)
+    {
+        char c = bytes[i];
+        if (isInString)
+        {
+            if (isEscaped)
+            {
+                isEscaped = NO;
+            }
+            else if (c == '\\')
+            {
+                isEscaped = YES;
+            }
+            else if (c == '"')
+            {
+                isInString = NO;
+                if (depth == 1 && arrayDepth == 0)
+                {
+                    lastKeyRange = NSMakeRange(stringStart + 1, i - stringStart - 1);
+                }
+            }
+            continue;
+        }
+        BOOL isElementLevel = (arrayDepth > 0 && depth == arrayDepth);
+        switch (c)
+        {
+            case '"':
+                isInString = YES;
+                stringStart = i;
+                if (isElementLevel && itemStart == NSNotFound)
+                {
+                    itemStart = i;
+                }
+                break;
+            case '{':
+            case '[':
+                if (isElementLevel && itemStart == NSNotFound)
+                {
+                    itemStart = i;
+                }
+                if (c == '[' && arrayDepth == 0 && depth == 1 && lastKeyRange.location != NSNotFound && lastKeyRange.length == self.key.length && memcmp(bytes + lastKeyRange.location, self.key.bytes, self.key.length) == 0)
+                {
+                    arrayDepth = depth + 1; //enter target array, its elements are at this depth.
+                }
+                depth++;
+                break;
+            case '}':
+            case ']':
+                depth--;
+                if (arrayDepth > 0 && depth == arrayDepth - 1) //target array closed, last element may be scalar.
+                {
+                    [self emitItemFrom:bytes toEnd:i];
+                    isDone = YES;
+                }
+                else if (arrayDepth > 0 && depth == arrayDepth && itemStart != NSNotFound) //object or array element closed.
+                {
+                    [self emitItemFrom:bytes toEnd:i + 1];
+                }
+                break;
+            case ',':
+                if (isElementLevel)
+                {
+                    [self emitItemFrom:bytes toEnd:i];
+                }
+                break;
+            case ' ':
+            case '\t':
+            case '\r':
+            case '\n':
+                break;
+            default: //number, true, false, null
+                if (isElementLevel && itemStart == NSNotFound)
+                {
+                    itemStart = i;
+                }
+                break;
+        }
+    }
+    scanOffset = length;
+}
+
+- (void)emitItemFrom:(const char *)bytes toEnd:(NSUInteger)end
+{
+    if (itemStart == NSNotFound)
+    {
+        return;
+    }
+    NSData *itemData = [NSData dataWithBytes:bytes + itemStart length:end - itemStart];
+    NSObject *item = nil;
+    if (bytes[itemStart] == '{')
+    {
+        item = shParseJsonDataToDict(itemData); //same null handling as whole response.
+    }
+    else
+    {
+        item = [NSJSONSerialization JSONObjectWithData:itemData options:NSJSONReadingAllowFragments error:nil];
+    }
+    itemStart = NSNotFound;
+    if (item != nil && self.itemHandler != nil)
+    {
+        self.itemHandler(item);
+    }
+}
+
+@end
+
+@implementation SHRequestTemplate
+
+@end
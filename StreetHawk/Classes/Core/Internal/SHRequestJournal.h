@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ Notification sent when network changes from not connected to connected. Its user info is empty. Location module posts it from reachability, request journal replays pending requests when receiving it.
+ */
+extern NSString * const SHNetworkRecoverNotification;
+
+/**
+ Durable journal of outbound requests which must reach server even if App is offline or killed, for example feedback submit and alert settings. Requests opt in by `SHRequest.isDurable`: the request is written to SQLite table in Library/StreetHawk/requestjournal.db before sending, and removed when server accepts or rejects it. Rows left by network failure or App kill are replayed one by one from old to new when network recovers or App becomes active.
+ */
+@interface SHRequestJournal : NSObject
+
+/**
+ Singleton creator. It observes `SHNetworkRecoverNotification` once created.
+ */
++ (SHRequestJournal *)sharedInstance;
+
+/**
+ Path of journal database file, used to delete it for fresh install.
+ */
++ (NSString *)databasePath;
+
+/**
+ Write `urlRequest` into journal. Older pending rows of same `dedupKey` are removed as this one supersedes them. The row is in flight until `finishRequest:...` so replay does not send it again.
+ @param urlRequest The request to store. Its body must be data, stream body cannot be journaled.
+ @param dedupKey Key to supersede older rows, nil to use SHA1 of method, URL and body so only identical requests are collapsed.
+ @return Row id to finish later, 0 if fail to write.
+ */
+- (long long)appendRequest:(NSURLRequest *)urlRequest withKey:(NSString *)dedupKey;
+
+/**
+ Finish one sending of row `journalId`. The row is removed if server responds, except 5XX, 408 and 429 which can be replayed. Otherwise it's kept for replay.
+ @param journalId Row id returned by `appendRequest:withKey:`.
+ @param statusCode HTTP status code, 0 if no response.
+ @param error Network error, nil if got response.
+ @return YES if the row is removed, NO if kept for replay.
+ */
+- (BOOL)finishRequest:(long long)journalId withStatusCode:(NSInteger)statusCode withError:(NSError *)error;
+
+/**
+ Send pending rows one by one from old to new. It stops at the first row which cannot be delivered, and continues next time network recovers. Call it again while replaying does nothing.
+ */
+- (void)replay;
+
+/**
+ Number of rows not delivered yet, including in flight ones.
+ */
+@property (nonatomic, readonly) NSInteger pendingCount;
+
+/**
+ Number of rows delivered by replay since App launch.
+ */
+@property (nonatomic, readonly) NSInteger replayedCount;
+
+@end
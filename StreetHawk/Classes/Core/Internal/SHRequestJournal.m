@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import "SHRequestJournal.h"
+//header from StreetHawk
+#import "SHRequest.h" //for replay request
+#import "SHTypes.h" //for NONULL
+#import "SHUtils.h" //for streetHawkIsEnabled
+//header from System
+#import <CommonCrypto/CommonDigest.h> //for default dedup key
+#import <sqlite3.h>
+
+#define JOURNAL_TABLE           @"Requests"
+#define JOURNAL_MAX_ROWS        200 //oldest rows are dropped when exceeding, journal is for user actions, not for bulk data like logs.
+#define JOURNAL_MAX_AGE         (7 * 24 * 60 * 60) //seconds a row is kept, too old request has no meaning to server.
+
+NSString * const SHNetworkRecoverNotification = @"SHNetworkRecoverNotification";
+
+@interface SHRequestJournal ()
+{
+    sqlite3 *database;
+}
+
+@property (nonatomic, strong) NSMutableSet *inFlightIds; //row ids being sent now, by caller or by replay. Not persisted, rows of last App run are not in flight.
+@property (nonatomic) BOOL isReplaying;
+@property (nonatomic) NSInteger replayedCount;
+
+//Open or create database, and drop rows too old.
+- (void)openSqliteDatabase;
+//Execute sql without result, return NO if fail.
+- (BOOL)executeSql:(NSString *)sql;
+//SHA1 hex of method, URL and body.
+- (NSString *)defaultKeyForRequest:(NSURLRequest *)urlRequest;
+//Remove rows not in flight which match `condition`, for example "dedup_key = ?", `key` is bound to "?" if not nil. Must call inside @synchronized(self).
+- (void)removeIdleRowsWhere:(NSString *)condition withKey:(NSString *)key;
+//Load first row with id > `lastId` which is not in flight, and mark it in flight. Return nil if no more.
+- (NSURLRequest *)loadRequestAfter:(long long)lastId journalId:(long long *)journalId;
+//Send row after `lastId` and continue with next when it's delivered.
+- (void)replayNextAfter:(long long)lastId;
+//Handler of `SHNetworkRecoverNotification`.
+- (void)networkRecovered:(NSNotification *)notification;
+
+@end
+
+@implementation SHRequestJournal
+
+#pragma mark - life cycle
+
++ (SHRequestJournal *)sharedInstance
+{
+    static SHRequestJournal *instance = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^
+    {
+        instance = [[SHRequestJournal alloc] init];
+    });
+    return instance;
+}
+
++ (NSString *)databasePath
+{
+    static NSString *dbPath = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^
+    {
+        NSArray *libraryDirs = NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES);  //use /Library same as logcache.db, Caches may be purged while requests not delivered.
+        NSString *streetHawkDir = [libraryDirs[0] stringByAppendingPathComponent:@"StreetHawk"];
+        NSError *error;
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:streetHawkDir withIntermediateDirectories:YES attributes:nil error:&error])
+        {
+            SHLog(@"Fail to create /Library/StreetHawk dictionary: %@.", error.localizedDescription);
+        }
+        dbPath = [streetHawkDir stringByAppendingPathComponent:@"requestjournal.db"];
+    });
+    return dbPath;
+}
+
+- (id)init
+{
+    if (self = [super init])
+    {
+        database = NULL;
+        self.inFlightIds = [NSMutableSet set];
+        self.isReplaying = NO;
+        self.replayedCount = 0;
+        [self openSqliteDatabase];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(networkRecovered:) name:SHNetworkRecoverNotification object:nil];
+    }
+    return self;
+}
+
+- (void)dealloc
+{
+    [[NSNotificationCenter defaultCenter] removeObserver:self];
+    sqlite3_close(database);
+    database = NULL;
+}
+
+#pragma mark - public functions
+
+- (long long)appendRequest:(NSURLRequest *)urlRequest withKey:(NSString *)dedupKey
+{
+    if (urlRequest.URL == nil || urlRequest.HTTPBodyStream != nil || database == NULL)
+    {
+        return 0;
+    }
+    if (shStrIsEmpty(dedupKey))
+    {
+        dedupKey = [self defaultKeyForRequest:urlRequest];
+    }
+    NSData *headersData = nil;
+    if (urlRequest.allHTTPHeaderFields.count > 0)
+    {
+        headersData = [NSPropertyListSerialization dataWithPropertyList:urlRequest.allHTTPHeaderFields format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+    }
+    @synchronized(self)
+    {
+        [self removeIdleRowsWhere:@"dedup_key = ?" withKey:dedupKey]; //superseded by this one
+        NSString *insert_sql = [NSString stringWithFormat:@"INSERT INTO '%@' ('dedup_key', 'created', 'method', 'url', 'headers', 'body') VALUES (?, ?, ?, ?, ?, ?)", JOURNAL_TABLE];
+        sqlite3_stmt *insert_stmt = NULL;
+        long long journalId = 0;
+        if (sqlite3_prepare_v2(database, [insert_sql UTF8String], -1, &insert_stmt, NULL) == SQLITE_OK)
+        {
+            sqlite3_bind_text(insert_stmt, 1, [dedupKey UTF8String], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_double(insert_stmt, 2, [NSDate timeIntervalSinceReferenceDate]);
+            sqlite3_bind_text(insert_stmt, 3, [NONULL(urlRequest.HTTPMethod) UTF8String], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(insert_stmt, 4, [urlRequest.URL.absoluteString UTF8String], -1, SQLITE_TRANSIENT);
+            sqlite3_bind_blob(insert_stmt, 5, headersData.bytes, (int)headersData.length, SQLITE_TRANSIENT); //NULL if no header
+            sqlite3_bind_blob(insert_stmt, 6, urlRequest.HTTPBody.bytes, (int)urlRequest.HTTPBody.length, SQLITE_TRANSIENT);
+            if (sqlite3_step(insert_stmt) == SQLITE_DONE)
+            {
+                journalId = sqlite3_last_insert_rowid(database);
+                [self.inFlightIds addObject:@(journalId)];
+            }
+            else
+            {
+                SHLog(@"Fail to write request journal: %s", sqlite3_errmsg(database));
+            }
+        }
+        sqlite3_finalize(insert_stmt);
+        //keep the table small, drop oldest rows which not be able to deliver for long.
+        [self removeIdleRowsWhere:[NSString stringWithFormat:@"id NOT IN (SELECT id FROM '%@' ORDER BY id DESC LIMIT %d)", JOURNAL_TABLE, JOURNAL_MAX_ROWS] withKey:nil];
+        return journalId;
+    }
+}
+
+- (BOOL)finishRequest:(long long)journalId withStatusCode:(NSInteger)statusCode withError:(NSError *)error
+{
+    //server handled it, either accepted or rejected by 4XX which not change by sending again.
+    BOOL isDelivered = (statusCode > 0 && statusCode < 500 && statusCode != 408 && statusCode != 429);
+    @synchronized(self)
+    {
+        [self.inFlightIds removeObject:@(journalId)];
+        if (isDelivered && database != NULL)
+        {
+            [self executeSql:[NSString stringWithFormat:@"DELETE FROM '%@' WHERE id = %lld", JOURNAL_TABLE, journalId]];
+        }
+    }
+    if (!isDelivered)
+    {
+        SHLog(@"Request journal keeps %lld for replay, status %ld, error: %@.", journalId, (long)statusCode, error.localizedDescription);
+    }
+    return isDelivered;
+}
+
+- (void)replay
+{
+    if (!streetHawkIsEnabled() || database == NULL)
+    {
+        return;
+    }
+    @synchronized(self)
+    {
+        if (self.isReplaying)
+        {
+            return;
+        }
+        self.isReplaying = YES;
+    }
+    [self replayNextAfter:0];
+}
+
+- (NSInteger)pendingCount
+{
+    NSInteger count = 0;
+    @synchronized(self)
+    {
+        sqlite3_stmt *count_stmt = NULL;
+        if (database != NULL && sqlite3_prepare_v2(database, [[NSString stringWithFormat:@"SELECT COUNT(*) FROM '%@'", JOURNAL_TABLE] UTF8String], -1, &count_stmt, NULL) == SQLITE_OK && sqlite3_step(count_stmt) == SQLITE_ROW)
+        {
+            count = sqlite3_column_int(count_stmt, 0);
+        }
+        sqlite3_finalize(count_stmt);
+    }
+    return count;
+}
+
+#pragma mark - private functions
+
+- (void)openSqliteDatabase
+{
+    NSString *databasePath = [SHRequestJournal databasePath];
+    int createResult = sqlite3_open_v2([databasePath UTF8String], &database, SQLITE_OPEN_CREATE | SQLITE_OPEN_READWRITE | SQLITE_OPEN_FULLMUTEX, NULL);
+    if (createResult != SQLITE_OK)
+    {
+        sqlite3_close(database);
+        database = NULL;
+        SHLog(@"Could not create request journal: %@, Error: %d", databasePath, createResult);
+        return; //requests still send as before, only not durable.
+    }
+    [self executeSql:@"PRAGMA journal_mode=WAL"]; //append only, a row is usually written then deleted soon.
+    NSMutableString *create_sql = [NSMutableString stringWithFormat:@"CREATE TABLE IF NOT EXISTS '%@' (", JOURNAL_TABLE];
+    [create_sql appendString:@"'id' INTEGER PRIMARY KEY AUTOINCREMENT, "]; //replay order
+    [create_sql appendString:@"'dedup_key' TEXT, "];
+    [create_sql appendString:@"'created' REAL, "]; //time since reference date
+    [create_sql appendString:@"'method' TEXT, "];
+    [create_sql appendString:@"'url' TEXT, "];
+    [create_sql appendString:@"'headers' BLOB, "]; //binary plist of header fields
+    [create_sql appendString:@"'body' BLOB)"];
+    if (![self executeSql:create_sql] || ![self executeSql:[NSString stringWithFormat:@"CREATE INDEX IF NOT EXISTS 'dedup_index' ON '%@' ('dedup_key')", JOURNAL_TABLE]])
+    {
+        sqlite3_close(database);
+        database = NULL;
+        return;
+    }
+    [self executeSql:[NSString stringWithFormat:@"DELETE FROM '%@' WHERE created < %f", JOURNAL_TABLE, [NSDate timeIntervalSinceReferenceDate] - JOURNAL_MAX_AGE]];
+}
+
+- (BOOL)executeSql:(NSString *)sql
+{
+    char *errmsg = NULL;
+    int exec_result = sqlite3_exec(database, [sql UTF8String], NULL, NULL, &errmsg);
+    if (exec_result != SQLITE_OK)
+    {
+        SHLog(@"Could not execute sql [[[ %@ ]]], Error: %s", sql, errmsg);
+    }
+    sqlite3_free(errmsg); //harmless for NULL
+    return (exec_result == SQLITE_OK);
+}
+
+- (NSString *)defaultKeyForRequest:(NSURLRequest *)urlRequest
+{
+    CC_SHA1_CTX context;
+    CC_SHA1_Init(&context);
+    NSData *methodData = [NONULL(urlRequest.HTTPMethod) dataUsingEncoding:NSUTF8StringEncoding];
+    CC_SHA1_Update(&context, methodData.bytes, (CC_LONG)methodData.length);
+    NSData *urlData = [urlRequest.URL.absoluteString dataUsingEncoding:NSUTF8StringEncoding];
+    CC_SHA1_Update(&context, urlData.bytes, (CC_LONG)urlData.length);
+    CC_SHA1_Update(&context, urlRequest.HTTPBody.bytes, (CC_LONG)urlRequest.HTTPBody.length);
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1_Final(digest, &context);
+    return shDataToHexString([NSData dataWithBytes:digest length:CC_SHA1_DIGEST_LENGTH]);
+}
+
+- (void)removeIdleRowsWhere:(NSString *)condition withKey:(NSString *)key
+{
+    if (database == NULL)
+    {
+        return;
+    }
+    NSMutableString *delete_sql = [NSMutableString stringWithFormat:@"DELETE FROM '%@' WHERE (%@)", JOURNAL_TABLE, condition];
+    if (self.inFlightIds.count > 0)
+    {
+        [delete_sql appendFormat:@" AND id NOT IN (%@)", [self.inFlightIds.allObjects componentsJoinedByString:@","]]; //in flight row may still fail and need replay
+    }
+    sqlite3_stmt *delete_stmt = NULL;
+    if (sqlite3_prepare_v2(database, [delete_sql UTF8String], -1, &delete_stmt, NULL) == SQLITE_OK)
+    {
+        if (key != nil)
+        {
+            sqlite3_bind_text(delete_stmt, 1, [key UTF8String], -1, SQLITE_TRANSIENT);
+        }
+        sqlite3_step(delete_stmt);
+    }
+    sqlite3_finalize(delete_stmt);
+}
+
+- (NSURLRequest *)loadRequestAfter:(long long)lastId journalId:(long long *)journalId
+{
+    NSMutableURLRequest *urlRequest = nil;
+    @synchronized(self)
+    {
+        NSString *select_sql = [NSString stringWithFormat:@"SELECT id, method, url, headers, body FROM '%@' WHERE id > %lld ORDER BY id", JOURNAL_TABLE, lastId];
+        sqlite3_stmt *select_stmt = NULL;
+        if (database != NULL && sqlite3_prepare_v2(database, [select_sql UTF8String], -1, &select_stmt, NULL) == SQLITE_OK)
+        {
+            while (urlRequest == nil && sqlite3_step(select_stmt) == SQLITE_ROW)
+            {
+                long long rowId = sqlite3_column_int64(select_stmt, 0);
+                const char *urlText = (const char *)sqlite3_column_text(select_stmt, 2);
+                NSURL *url = (urlText != NULL) ? [NSURL URLWithString:[NSString stringWithUTF8String:urlText]] : nil;
+                if ([self.inFlightIds containsObject:@(rowId)])
+                {
+                    continue; //caller is sending it now
+                }
+                if (url == nil)
+                {
+                    [self executeSql:[NSString stringWithFormat:@"DELETE FROM '%@' WHERE id = %lld", JOURNAL_TABLE, rowId]]; //broken row
+                    continue;
+                }
+                urlRequest = [NSMutableURLRequest requestWithURL:url];
+                const char *methodText = (const char *)sqlite3_column_text(select_stmt, 1);
+                if (methodText != NULL && strlen(methodText) > 0)
+                {
+                    urlRequest.HTTPMethod = [NSString stringWithUTF8String:methodText];
+                }
+                int headersLength = sqlite3_column_bytes(select_stmt, 3);
+                if (headersLength > 0)
+                {
+                    NSDictionary *headers = [NSPropertyListSerialization propertyListWithData:[NSData dataWithBytes:sqlite3_column_blob(select_stmt, 3) length:headersLength] options:NSPropertyListImmutable format:NULL error:nil];
+                    if ([headers isKindOfClass:[NSDictionary class]])
+                    {
+                        urlRequest.allHTTPHeaderFields = headers;
+                    }
+                }
+                int bodyLength = sqlite3_column_bytes(select_stmt, 4);
+                if (bodyLength > 0)
+                {
+                    urlRequest.HTTPBody = [NSData dataWithBytes:sqlite3_column_blob(select_stmt, 4) length:bodyLength];
+                }
+                *journalId = rowId;
+                [self.inFlightIds addObject:@(rowId)];
+            }
+        }
+        sqlite3_finalize(select_stmt);
+    }
+    return urlRequest;
+}
+
+- (void)replayNextAfter:(long long)lastId
+{
+    long long journalId = 0;
+    NSURLRequest *urlRequest = [self loadRequestAfter:lastId journalId:&journalId];
+    if (urlRequest == nil)
+    {
+        @synchronized(self)
+        {
+            self.isReplaying = NO;
+        }
+        return;
+    }
+    SHRequest *request = [SHRequest requestWithURLRequest:urlRequest];
+    request.requestHandler = ^(SHRequest *replayRequest)
+    {
+        if ([self finishRequest:journalId withStatusCode:replayRequest.responseStatusCode withError:replayRequest.error])
+        {
+            @synchronized(self)
+            {
+                self.replayedCount++;
+            }
+            [self replayNextAfter:journalId];
+        }
+        else
+        {
+            //still cannot deliver, keep order by not sending later rows until next recover.
+            @synchronized(self)
+            {
+                self.isReplaying = NO;
+            }
+        }
+    };
+    [request startAsynchronously];
+}
+
+- (void)networkRecovered:(NSNotification *)notification
+{
+    [self replay];
+}
+
+@end
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import <Foundation/Foundation.h>
+
+/**
+ A cached GET response which server can validate by "ETag" or "Last-Modified".
+ */
+@interface SHCachedResponse : NSObject
+
+/**
+ Raw body of the response.
+ */
+@property (nonatomic, strong) NSData *body;
+
+/**
+ "Content-Type" of the response, used to parse `body` again as 304 does not have it.
+ */
+@property (nonatomic, strong) NSString *contentType;
+
+/**
+ "ETag" of the response, sent as "If-None-Match". nil if server not provide.
+ */
+@property (nonatomic, strong) NSString *eTag;
+
+/**
+ "Last-Modified" of the response, sent as "If-Modified-Since". nil if server not provide.
+ */
+@property (nonatomic, strong) NSString *lastModified;
+
+/**
+ Parsed JSON of `body`, kept in memory so 304 not parse again. nil if loaded from disk and not parsed yet.
+ */
+@property (nonatomic, strong) NSDictionary *parsedDict;
+
+@end
+
+/**
+ SDK owned response cache for conditional GET, keyed by URL. Entries are kept in memory and written to Library/Caches, the disk size is bounded by least recently used eviction. Requests opt in by `SHRequest.useResponseCache`.
+ */
+@interface SHResponseCache : NSObject
+
+/**
+ Singleton creator.
+ */
++ (SHResponseCache *)sharedInstance;
+
+/**
+ Max bytes of cache files on disk, least recently used entries are removed when exceeding it. Default is 2MB.
+ */
+@property (nonatomic) unsigned long long maxDiskBytes;
+
+/**
+ Get cached response of `url`, nil if not cached. It's marked as recently used.
+ */
+- (SHCachedResponse *)cachedResponseForURL:(NSURL *)url;
+
+/**
+ Store or replace cached response of `url`. It must have `eTag` or `lastModified`, otherwise it cannot be validated and is not stored.
+ */
+- (void)storeResponse:(SHCachedResponse *)response forURL:(NSURL *)url;
+
+/**
+ Remove cached response of `url`, for example server not provide validator anymore.
+ */
+- (void)removeResponseForURL:(NSURL *)url;
+
+/**
+ Remove all cached responses in memory and disk.
+ */
+- (void)clear;
+
+/** @name Statistics */
+
+/**
+ Record a 304 response served from cache, `bytes` is the body not downloaded.
+ */
+- (void)recordHitWithBytesSaved:(NSUInteger)bytes;
+
+/**
+ Record a cache-enabled request which downloaded the full body.
+ */
+- (void)recordMiss;
+
+/**
+ Number of 304 responses served from cache since App launch.
+ */
+@property (nonatomic, readonly) NSInteger hitCount;
+
+/**
+ Number of cache-enabled requests downloaded full body since App launch.
+ */
+@property (nonatomic, readonly) NSInteger missCount;
+
+/**
+ hitCount / (hitCount + missCount), 0 if no request yet.
+ */
+@property (nonatomic, readonly) double hitRatio;
+
+/**
+ Body bytes not downloaded due to 304 since App launch.
+ */
+@property (nonatomic, readonly) unsigned long long bytesSaved;
+
+@end
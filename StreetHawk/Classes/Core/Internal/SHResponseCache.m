@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import "SHResponseCache.h"
+//header from StreetHawk
+#import "SHUtils.h" //for shDataToHexString
+//header from System
+#import <CommonCrypto/CommonDigest.h> //for file name of URL
+
+#define CACHE_DEFAULT_MAX_BYTES     (2 * 1024 * 1024) //default disk bound
+#define CACHE_MEMORY_COUNT          20 //entries kept in memory with parsed result
+
+//keys of cache file, it's a binary plist.
+#define CACHE_FILE_URL              @"url"
+#define CACHE_FILE_BODY             @"body"
+#define CACHE_FILE_CONTENTTYPE      @"content_type"
+#define CACHE_FILE_ETAG             @"etag"
+#define CACHE_FILE_LASTMODIFIED     @"last_modified"
+
+@implementation SHCachedResponse
+
+@end
+
+@interface SHResponseCache ()
+
+@property (nonatomic, strong) NSString *cacheDirectory; //Library/Caches/StreetHawk/Response
+@property (nonatomic, strong) NSCache *memoryCache; //file name -> SHCachedResponse
+@property (nonatomic, strong) NSMutableDictionary *dictIndex; //file name -> @[size, last access time], loaded from disk when first used.
+@property (nonatomic) unsigned long long diskBytes; //total size of cache files
+
+@property (nonatomic) NSInteger hitCount;
+@property (nonatomic) NSInteger missCount;
+@property (nonatomic) unsigned long long bytesSaved;
+
+//File name of `url`, SHA1 of the absolute string.
+- (NSString *)fileNameForURL:(NSURL *)url;
+//Load `dictIndex` from files in `cacheDirectory`, last access time is file modification date.
+- (void)loadIndex;
+//Remove least recently used files until disk size is under `maxDiskBytes`.
+- (void)evictIfNeeded;
+
+@end
+
+@implementation SHResponseCache
+
+#pragma mark - life cycle
+
++ (SHResponseCache *)sharedInstance
+{
+    static SHResponseCache *instance = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^
+    {
+        instance = [[SHResponseCache alloc] init];
+    });
+    return instance;
+}
+
+- (id)init
+{
+    if (self = [super init])
+    {
+        NSArray *cachesDirs = NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES); //use /Library/Caches as it can be re-downloaded
+        self.cacheDirectory = [[cachesDirs[0] stringByAppendingPathComponent:@"StreetHawk"] stringByAppendingPathComponent:@"Response"];
+        NSError *error;
+        if (![[NSFileManager defaultManager] createDirectoryAtPath:self.cacheDirectory withIntermediateDirectories:YES attributes:nil error:&error])
+        {
+            SHLog(@"Fail to create response cache dictionary: %@.", error.localizedDescription);
+        }
+        self.memoryCache = [[NSCache alloc] init];
+        self.memoryCache.countLimit = CACHE_MEMORY_COUNT;
+        self.maxDiskBytes = CACHE_DEFAULT_MAX_BYTES;
+        self.hitCount = 0;
+        self.missCount = 0;
+        self.bytesSaved = 0;
+    }
+    return self;
+}
+
+#pragma mark - public functions
+
+- (SHCachedResponse *)cachedResponseForURL:(NSURL *)url
+{
+    if (url == nil)
+    {
+        return nil;
+    }
+    NSString *fileName = [self fileNameForURL:url];
+    @synchronized(self)
+    {
+        [self loadIndex];
+        NSArray *indexEntry = self.dictIndex[fileName];
+        if (indexEntry == nil)
+        {
+            return nil;
+        }
+        NSDate *now = [NSDate date];
+        self.dictIndex[fileName] = @[indexEntry[0], @(now.timeIntervalSinceReferenceDate)];
+        NSString *filePath = [self.cacheDirectory stringByAppendingPathComponent:fileName];
+        [[NSFileManager defaultManager] setAttributes:@{NSFileModificationDate: now} ofItemAtPath:filePath error:nil]; //keep LRU order for next launch
+        SHCachedResponse *response = [self.memoryCache objectForKey:fileName];
+        if (response == nil)
+        {
+            NSData *fileData = [NSData dataWithContentsOfFile:filePath];
+            NSDictionary *dictFile = (fileData != nil) ? [NSPropertyListSerialization propertyListWithData:fileData options:NSPropertyListImmutable format:NULL error:nil] : nil;
+            if (![dictFile isKindOfClass:[NSDictionary class]] || ![dictFile[CACHE_FILE_URL] isEqualToString:url.absoluteString] || ![dictFile[CACHE_FILE_BODY] isKindOfClass:[NSData class]])
+            {
+                [self removeResponseForURL:url]; //broken file
+                return nil;
+            }
+            response = [[SHCachedResponse alloc] init];
+            response.body = dictFile[CACHE_FILE_BODY];
+            response.contentType = dictFile[CACHE_FILE_CONTENTTYPE];
+            response.eTag = dictFile[CACHE_FILE_ETAG];
+            response.lastModified = dictFile[CACHE_FILE_LASTMODIFIED];
+            [self.memoryCache setObject:response forKey:fileName];
+        }
+        return response;
+    }
+}
+
+- (void)storeResponse:(SHCachedResponse *)response forURL:(NSURL *)url
+{
+    if (url == nil || response.body == nil || (shStrIsEmpty(response.eTag) && shStrIsEmpty(response.lastModified)))
+    {
+        return;
+    }
+    NSMutableDictionary *dictFile = [NSMutableDictionary dictionary];
+    dictFile[CACHE_FILE_URL] = url.absoluteString;
+    dictFile[CACHE_FILE_BODY] = response.body;
+    if (response.contentType != nil)
+    {
+        dictFile[CACHE_FILE_CONTENTTYPE] = response.contentType;
+    }
+    if (response.eTag != nil)
+    {
+        dictFile[CACHE_FILE_ETAG] = response.eTag;
+    }
+    if (response.lastModified != nil)
+    {
+        dictFile[CACHE_FILE_LASTMODIFIED] = response.lastModified;
+    }
+    NSData *fileData = [NSPropertyListSerialization dataWithPropertyList:dictFile format:NSPropertyListBinaryFormat_v1_0 options:0 error:nil];
+    if (fileData == nil || fileData.length > self.maxDiskBytes)
+    {
+        return;
+    }
+    NSString *fileName = [self fileNameForURL:url];
+    @synchronized(self)
+    {
+        [self loadIndex];
+        NSArray *oldEntry = self.dictIndex[fileName];
+        if (oldEntry != nil)
+        {
+            self.diskBytes -= [oldEntry[0] unsignedLongLongValue];
+        }
+        if ([fileData writeToFile:[self.cacheDirectory stringByAppendingPathComponent:fileName] atomically:YES])
+        {
+            self.dictIndex[fileName] = @[@(fileData.length), @([NSDate timeIntervalSinceReferenceDate])];
+            self.diskBytes += fileData.length;
+            [self.memoryCache setObject:response forKey:fileName];
+        }
+        else
+        {
+            [self.dictIndex removeObjectForKey:fileName];
+            [self.memoryCache removeObjectForKey:fileName];
+        }
+        [self evictIfNeeded];
+    }
+}
+
+- (void)removeResponseForURL:(NSURL *)url
+{
+    if (url == nil)
+    {
+        return;
+    }
+    NSString *fileName = [self fileNameForURL:url];
+    @synchronized(self)
+    {
+        [self loadIndex];
+        NSArray *oldEntry = self.dictIndex[fileName];
+        if (oldEntry != nil)
+        {
+            self.diskBytes -= [oldEntry[0] unsignedLongLongValue];
+            [self.dictIndex removeObjectForKey:fileName];
+            [[NSFileManager defaultManager] removeItemAtPath:[self.cacheDirectory stringByAppendingPathComponent:fileName] error:nil];
+        }
+        [self.memoryCache removeObjectForKey:fileName];
+    }
+}
+
+- (void)clear
+{
+    @synchronized(self)
+    {
+        [self.memoryCache removeAllObjects];
+        [[NSFileManager defaultManager] removeItemAtPath:self.cacheDirectory error:nil];
+        [[NSFileManager defaultManager] createDirectoryAtPath:self.cacheDirectory withIntermediateDirectories:YES attributes:nil error:nil];
+        self.dictIndex = [NSMutableDictionary dictionary];
+        self.diskBytes = 0;
+    }
+}
+
+#pragma mark - statistics
+
+- (void)recordHitWithBytesSaved:(NSUInteger)bytes
+{
+    @synchronized(self)
+    {
+        self.hitCount++;
+        self.bytesSaved += bytes;
+    }
+}
+
+- (void)recordMiss
+{
+    @synchronized(self)
+    {
+        self.missCount++;
+    }
+}
+
+- (double)hitRatio
+{
+    @synchronized(self)
+    {
+        NSInteger total = self.hitCount + self.missCount;
+        return (total > 0) ? (double)self.hitCount / total : 0;
+    }
+}
+
+#pragma mark - private functions
+
+- (NSString *)fileNameForURL:(NSURL *)url
+{
+    NSData *urlData = [url.absoluteString dataUsingEncoding:NSUTF8StringEncoding];
+    unsigned char digest[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1(urlData.bytes, (CC_LONG)urlData.length, digest);
+    return shDataToHexString([NSData dataWithBytes:digest length:CC_SHA1_DIGEST_LENGTH]);
+}
+
+- (void)loadIndex
+{
+    if (self.dictIndex != nil)
+    {
+        return;
+    }
+    self.dictIndex = [NSMutableDictionary dictionary];
+    self.diskBytes = 0;
+    NSArray *arrayFiles = [[NSFileManager defaultManager] contentsOfDirectoryAtURL:[NSURL fileURLWithPath:self.cacheDirectory] includingPropertiesForKeys:@[NSURLFileSizeKey, NSURLContentModificationDateKey] options:NSDirectoryEnumerationSkipsHiddenFiles error:nil];
+    for (NSURL *fileUrl in arrayFiles)
+    {
+        NSNumber *fileSize = nil;
+        NSDate *modifyDate = nil;
+        [fileUrl getResourceValue:&fileSize forKey:NSURLFileSizeKey error:nil];
+        [fileUrl getResourceValue:&modifyDate forKey:NSURLContentModificationDateKey error:nil];
+        self.dictIndex[fileUrl.lastPathComponent] = @[@(fileSize.unsignedLongLongValue), @(modifyDate.timeIntervalSinceReferenceDate)];
+        self.diskBytes += fileSize.unsignedLongLongValue;
+    }
+    [self evictIfNeeded];
+}
+
+- (void)evictIfNeeded
+{
+    if (self.diskBytes <= self.maxDiskBytes)
+    {
+        return;
+    }
+    NSArray *arrayNames = [self.dictIndex keysSortedByValueUsingComparator:^NSComparisonResult(NSArray *entry1, NSArray *entry2)
+    {
+        return [entry1[1] compare:entry2[1]]; //oldest access first
+    }];
+    for (NSString *fileName in arrayNames)
+    {
+        if (self.diskBytes <= self.maxDiskBytes)
+        {
+            break;
+        }
+        self.diskBytes -= [self.dictIndex[fileName][0] unsignedLongLongValue];
+        [self.dictIndex removeObjectForKey:fileName];
+        [self.memoryCache removeObjectForKey:fileName];
+        [[NSFileManager defaultManager] removeItemAtPath:[self.cacheDirectory stringByAppendingPathComponent:fileName] error:nil];
+    }
+}
+
+@end
@@ -51,14 +51,14 @@ extern NSString *shDataToHexString(NSData *data);
 extern NSDateFormatter *shGetDateFormatter(NSString *dateFormat, NSTimeZone *timeZone, NSLocale *locale);
 
 /**
- Formats a date into a string in StreetHawk-wide format. Must use this format to be recognizable by server. Format is yyyy-MM-dd HH:mm:ss in UTC timezone.
+ Formats a date into a string in StreetHawk-wide format. Must use this format to be recognizable by server. Format is yyyy-MM-dd HH:mm:ss in UTC timezone. It's formatted by hand without NSDateFormatter, safe to call from any thread.
  @param date The date value to be formatted.
  @return The return string.
  */
 extern NSString *shFormatStreetHawkDate(NSDate *date);
 
 /**
- Parses date string into NSDate format. It tries to support as much format as possible. Refer to `input` parameters for the supported date time format.
+ Parses date string into NSDate format. It tries to support as much format as possible. Refer to `input` parameters for the supported date time format. StreetHawk format (yyyy-MM-dd HH:mm:ss or yyyy-MM-dd in UTC) is parsed by hand, other formats use NSDateFormatter cached per thread.
  @param input Date time string. It supports this kinds of strings:
  
  * yyyy-MM-dd HH:mm:ss, for example 2012-12-20 18:20:50
@@ -79,6 +79,13 @@ extern NSDate *shParseDate(NSString *input, int offsetSeconds);
  */
 extern NSDictionary *shParseObjectToDict(NSObject *obj);
 
+/**
+ Parse UTF-8 JSON data to a dictionary directly from the bytes, without converting to string. Same as `shParseObjectToDict` for the string of `data`, including ": null," and ": null}" parsed as empty string.
+ @param data The received JSON bytes.
+ @return Dictionary if `data` is a JSON object. If fail return nil.
+ */
+extern NSDictionary *shParseJsonDataToDict(NSData *data);
+
 /**
  Serialize the NSObject to json string. 
  @param obj The object to be serialized.
@@ -86,6 +93,13 @@ extern NSDictionary *shParseObjectToDict(NSObject *obj);
  */
 extern NSString *shSerializeObjToJson(NSObject *obj);
 
+/**
+ Compress data in gzip format, used for request body with "Content-Encoding: gzip".
+ @param data The data to be compressed.
+ @return Compressed data. If `data` is empty or fail to compress return nil.
+ */
+extern NSData *shGzipData(NSData *data);
+
 /** @name URL Process Utility */
 
 /**
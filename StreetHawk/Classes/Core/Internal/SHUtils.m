@@ -80,52 +80,147 @@ NSDateFormatter *shGetDateFormatter(NSString *dateFormat, NSTimeZone *timeZone,
     return dateFormatter;  //as this file is ARC, this return value is auto-released.
 }
 
-NSString *shFormatStreetHawkDate(NSDate *date)
+//Days since 1970-01-01 of a proleptic Gregorian date, same calendar NSDateFormatter uses for en_US. Algorithm from http://howardhinnant.github.io/date_algorithms.html.
+static long long shDaysFromCivil(long long year, unsigned month, unsigned day)
 {
-    NSDateFormatter *date_formatter = shGetDateFormatter(nil, nil, nil);
-    return [date_formatter stringFromDate:date];
+    year -= (month <= 2);
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yearOfEra = (unsigned)(year - era * 400);
+    unsigned dayOfYear = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    return era * 146097 + (long long)dayOfEra - 719468;
 }
 
-NSDate *shParseDate(NSString *input, int offsetSeconds)
+//Reverse of `shDaysFromCivil`.
+static void shCivilFromDays(long long days, long long *year, unsigned *month, unsigned *day)
 {
-    static dispatch_semaphore_t formatter_semaphore;
-    static dispatch_once_t onceToken;
-    dispatch_once(&onceToken, ^{
-        formatter_semaphore = dispatch_semaphore_create(1);
-    });
-    NSDate *out = nil;
-    if (input && input != (id)[NSNull null])
+    days += 719468;
+    long long era = (days >= 0 ? days : days - 146096) / 146097;
+    unsigned dayOfEra = (unsigned)(days - era * 146097);
+    unsigned yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    unsigned dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    unsigned mp = (5 * dayOfYear + 2) / 153;
+    *day = dayOfYear - (153 * mp + 2) / 5 + 1;
+    *month = mp < 10 ? mp + 3 : mp - 9;
+    *year = (long long)yearOfEra + era * 400 + (*month <= 2);
+}
+
+//Read `count` digits as number, return -1 if any is not digit.
+static int shReadDigits(const char *str, int count)
+{
+    int value = 0;
+    for (int i = 0; i < count; i ++)
     {
-        dispatch_semaphore_wait(formatter_semaphore, DISPATCH_TIME_FOREVER);
-        NSDateFormatter *dateFormatter = shGetDateFormatter(nil, nil, nil);
-        out = [dateFormatter dateFromString:input];
-        if (out == nil)
+        if (str[i] < '0' || str[i] > '9')
         {
-            [dateFormatter setDateFormat:@"yyyy-MM-dd"];
-            out = [dateFormatter dateFromString:input];
+            return -1;
         }
-        if (out == nil)
-        {
-            [dateFormatter setDateFormat:@"dd/MM/yyyy HH:mm:ss"];
-            out = [dateFormatter dateFromString:input];
-        }
-        if (out == nil)
+        value = value * 10 + (str[i] - '0');
+    }
+    return value;
+}
+
+//Hand-written parser for StreetHawk format "yyyy-MM-dd HH:mm:ss" and "yyyy-MM-dd" in UTC, no locale or calendar machinery. Return NO if `str` is not exactly one of these, caller falls back to NSDateFormatter.
+static BOOL shParseStreetHawkDateFast(const char *str, NSTimeInterval *interval1970)
+{
+    if (str == NULL)
+    {
+        return NO;
+    }
+    size_t length = strlen(str);
+    if (length != 19 && length != 10)
+    {
+        return NO;
+    }
+    if (str[4] != '-' || str[7] != '-')
+    {
+        return NO;
+    }
+    int year = shReadDigits(str, 4);
+    int month = shReadDigits(str + 5, 2);
+    int day = shReadDigits(str + 8, 2);
+    int hour = 0, minute = 0, second = 0;
+    if (length == 19)
+    {
+        if (str[10] != ' ' || str[13] != ':' || str[16] != ':')
         {
-            [dateFormatter setDateFormat:@"dd/MM/yyyy"];
-            out = [dateFormatter dateFromString:input];
+            return NO;
         }
-        if (out == nil)
+        hour = shReadDigits(str + 11, 2);
+        minute = shReadDigits(str + 14, 2);
+        second = shReadDigits(str + 17, 2);
+    }
+    static const int daysInMonth[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    if (year < 1 || month < 1 || month > 12 || day < 1 || day > daysInMonth[month - 1] || hour < 0 || hour > 23 || minute < 0 || minute > 59 || second < 0 || second > 59)
+    {
+        return NO;
+    }
+    if (month == 2 && day == 29 && !((year % 4 == 0 && year % 100 != 0) || year % 400 == 0))
+    {
+        return NO;
+    }
+    *interval1970 = (NSTimeInterval)(shDaysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second);
+    return YES;
+}
+
+//NSDateFormatter is not thread-safe and expensive to create, cache one per thread per format for parsing fallback formats. Formatters are in UTC and en_US same as `shGetDateFormatter(format, nil, nil)`.
+static NSDateFormatter *shThreadCachedDateFormatter(NSString *dateFormat)
+{
+    NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
+    NSString *cacheKey = [@"SHDateFormatter_" stringByAppendingString:dateFormat];
+    NSDateFormatter *dateFormatter = threadDictionary[cacheKey];
+    if (dateFormatter == nil)
+    {
+        dateFormatter = shGetDateFormatter(dateFormat, nil, nil);
+        threadDictionary[cacheKey] = dateFormatter;
+    }
+    return dateFormatter;
+}
+
+NSString *shFormatStreetHawkDate(NSDate *date)
+{
+    if (date == nil)
+    {
+        return nil;
+    }
+    double seconds = floor([date timeIntervalSince1970]); //formatter truncates fraction to previous second, also for time before 1970.
+    long long days = (long long)floor(seconds / 86400);
+    long long secondOfDay = (long long)seconds - days * 86400;
+    long long year;
+    unsigned month, day;
+    shCivilFromDays(days, &year, &month, &day);
+    if (year < 1 || year > 9999) //out of 4 digits, let formatter handle it.
+    {
+        return [shGetDateFormatter(nil, nil, nil) stringFromDate:date];
+    }
+    char buffer[20];
+    snprintf(buffer, sizeof(buffer), "%04lld-%02u-%02u %02lld:%02lld:%02lld", year, month, day, secondOfDay / 3600, (secondOfDay % 3600) / 60, secondOfDay % 60);
+    return [NSString stringWithUTF8String:buffer];
+}
+
+NSDate *shParseDate(NSString *input, int offsetSeconds)
+{
+    NSDate *out = nil;
+    if (input && input != (id)[NSNull null] && [input isKindOfClass:[NSString class]])
+    {
+        NSTimeInterval interval1970 = 0;
+        if (shParseStreetHawkDateFast([input UTF8String], &interval1970)) //most input is server or local StreetHawk format.
         {
-            [dateFormatter setDateFormat:@"MM/dd/yyyy HH:mm:ss"];
-            out = [dateFormatter dateFromString:input];
+            out = [NSDate dateWithTimeIntervalSince1970:interval1970];
         }
-        if (out == nil)
+        else
         {
-            [dateFormatter setDateFormat:@"MM/dd/yyyy"];
-            out = [dateFormatter dateFromString:input];
+            NSArray *fallbackFormats = @[@"yyyy-MM-dd HH:mm:ss", @"yyyy-MM-dd", @"dd/MM/yyyy HH:mm:ss", @"dd/MM/yyyy", @"MM/dd/yyyy HH:mm:ss", @"MM/dd/yyyy"]; //StreetHawk formats are tried again by formatter as it's more tolerant than fast parser.
+            for (NSString *dateFormat in fallbackFormats)
+            {
+                out = [shThreadCachedDateFormatter(dateFormat) dateFromString:input];
+                if (out != nil)
+                {
+                    break;
+                }
+            }
         }
-        dispatch_semaphore_signal(formatter_semaphore);
-        if (offsetSeconds != 0)
+        if (out != nil && offsetSeconds != 0)
         {
             out = [NSDate dateWithTimeInterval:offsetSeconds sinceDate:out];
         }
@@ -165,6 +260,46 @@ NSDictionary *shParseObjectToDict(NSObject *obj)
     return nil;
 }
 
+NSDictionary *shParseJsonDataToDict(NSData *data)
+{
+    if (data.length == 0)
+    {
+        return nil;
+    }
+    //Same as `shParseObjectToDict`, ": null," and ": null}" become empty string. Only copy the bytes when it happens, which is rare.
+    const char *bytes = (const char *)data.bytes;
+    NSUInteger length = data.length;
+    NSMutableData *replacedData = nil;
+    NSUInteger copiedTo = 0;
+    for (NSUInteger i = 0; i + 7 <= length; i ++)
+    {
+        if (bytes[i] == ':' && bytes[i + 1] == ' ' && strncasecmp(bytes + i + 2, "null", 4) == 0 && (bytes[i + 6] == ',' || bytes[i + 6] == '}'))
+        {
+            if (replacedData == nil)
+            {
+                replacedData = [NSMutableData dataWithCapacity:length + 16];
+            }
+            [replacedData appendBytes:bytes + copiedTo length:i + 2 - copiedTo];
+            [replacedData appendBytes:"\"\"" length:2];
+            copiedTo = i + 6;
+            i += 5;
+        }
+    }
+    if (replacedData != nil)
+    {
+        [replacedData appendBytes:bytes + copiedTo length:length - copiedTo];
+        data = replacedData;
+    }
+    NSError *error;
+    NSObject *dictObj = [NSJSONSerialization JSONObjectWithData:data options:0/*no special option*/ error:&error];
+    if (dictObj != nil && [dictObj isKindOfClass:[NSDictionary class]])
+    {
+        return (NSDictionary *)dictObj;
+    }
+    SHLog(@"Fail to parse data (%lu bytes) to dict, error: %@.", (unsigned long)data.length, error.localizedDescription);
+    return nil;
+}
+
 NSString *shSerializeObjToJson(NSObject *obj)
 {
     if (obj == nil)
@@ -184,6 +319,37 @@ NSString *shSerializeObjToJson(NSObject *obj)
     }
 }
 
+#include <zlib.h>
+
+NSData *shGzipData(NSData *data)
+{
+    if (data == nil || data.length == 0)
+    {
+        return nil;
+    }
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    //windowBits 15 + 16 makes zlib write gzip header and trailer, which is what "Content-Encoding: gzip" expects.
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        return nil;
+    }
+    NSMutableData *compressed = [NSMutableData dataWithLength:deflateBound(&stream, (uLong)data.length)];
+    stream.next_in = (Bytef *)data.bytes;
+    stream.avail_in = (uInt)data.length;
+    stream.next_out = (Bytef *)compressed.mutableBytes;
+    stream.avail_out = (uInt)compressed.length;
+    int result = deflate(&stream, Z_FINISH); //deflateBound guarantees single call finishes.
+    uLong totalOut = stream.total_out;
+    deflateEnd(&stream);
+    if (result != Z_STREAM_END)
+    {
+        return nil;
+    }
+    compressed.length = totalOut;
+    return compressed;
+}
+
 NSString *shAppendString(NSString *str1, NSString *str2)
 {
     NSString *ret = nil;
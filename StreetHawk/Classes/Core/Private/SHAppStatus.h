@@ -50,7 +50,7 @@ extern NSString * const SHAppStatusChangeNotification;
 @property (nonatomic, strong) NSString *defaultHost;
 
 /**
- The current alive host url. It can be switched to other host at runtime by app_status. This function return the local cached alive host root url, if it's empty return default one `defaultHost`. It also contains version, for example @"https://api.streethawk.com/v1". Use `makeBaseUrlString([[SHAppStatus sharedInstance] aliveHostForVersion:SHHostVersion_V1], @"install/details/")` to create request path.
+ The current alive host url. It can be switched to other host at runtime by app_status. This function return the local cached alive host root url, if it's empty return default one `defaultHost`. It also contains version, for example @"https://api.streethawk.com/v1". Use `makeBaseUrlString([[SHAppStatus sharedInstance] aliveHostForVersion:SHHostVersion_V1], @"install/details/")` to create request path. The string is memorised, same instance is returned until alive host changes.
  */
 - (NSString *)aliveHostForVersion:(SHHostVersion)hostVersion;
 
@@ -33,7 +33,22 @@
 #define APPSTATUS_UPLOAD_LOCATION           @"APPSTATUS_UPLOAD_LOCATION" //whether send install/log for location update
 #define APPSTATUS_SUBMIT_FRIENDLYNAME       @"APPSTATUS_SUBMIT_FRIENDLYNAME"  //whether server allow submit friendly name
 #define APPSTATUS_IBEACON_FETCH_TIME        @"APPSTATUS_IBEACON_FETCH_TIME"  //last successfully fetch iBeacon list time
-#define APPSTATUS_IBEACON_FETCH_LIST        @"APPSTATUS_IBEACON_FETCH_LIST"  //iBeacon list fetched from server, it contains array for object: UUID, major, minor, id. This is used as iBeacon monitor region.
+#define APPSTATUS_IBEACON_FETCH_LIST        @"APPSTATUS_IBEACON_FETCH_LIST"  //iBeacon list fetched from server by previous version, string array of `SHServeriBeacon.description`. Only read to migrate into APPSTATUS_IBEACON_FETCH_FILE.
+#define APPSTATUS_IBEACON_FETCH_FILE        @"ibeacons.dat" //iBeacon list fetched from server in /Library/StreetHawk, binary format written by `SHServeriBeacon saveArray:toFile:`. This is used as iBeacon monitor region.
+#define APPSTATUS_IBEACON_DISTANCE_FILE     @"ibeacons.journal" //distance changes appended after APPSTATUS_IBEACON_FETCH_FILE is written, one `SHServeriBeaconDistanceRecord` each. Applied in order when load, and removed when APPSTATUS_IBEACON_FETCH_FILE is written again.
+#define APPSTATUS_IBEACON_FILE_MAGIC        0x42494853 //"SHIB" in little endian
+#define APPSTATUS_IBEACON_FLUSH_DELAY       3 //seconds to collect distance changes before append to APPSTATUS_IBEACON_DISTANCE_FILE, ranging happens every second.
+#define APPSTATUS_IBEACON_JOURNAL_MAX       1024 //records in APPSTATUS_IBEACON_DISTANCE_FILE to write whole list again and start an empty journal.
+
+#define IBEACON_ENTER_ACCURACY              @"IBEACON_ENTER_ACCURACY" //optional NSUserDefaults number, a ranged iBeacon counts as inside only if accuracy (meters) <= this. Default 0 means any accuracy.
+#define IBEACON_EXIT_ACCURACY               @"IBEACON_EXIT_ACCURACY" //optional NSUserDefaults number, an inside iBeacon ranged with accuracy > this counts as outside. Default 0 means only not ranged is outside. Keep it bigger than enter accuracy so iBeacon at the edge not flap.
+#define IBEACON_MIN_DWELL                   @"IBEACON_MIN_DWELL" //optional NSUserDefaults number, seconds an iBeacon must keep observed inside (or outside) before enter (or exit) is confirmed. Default IBEACON_DEFAULT_DWELL.
+#define IBEACON_LOG_WINDOW                  @"IBEACON_LOG_WINDOW" //optional NSUserDefaults number, seconds to collect confirmed enter/exit into one log 21. Default IBEACON_DEFAULT_WINDOW.
+#define IBEACON_DEFAULT_DWELL               3
+#define IBEACON_DEFAULT_WINDOW              10
+#define IBEACON_LOG_DWELL_ENABLED           @"IBEACON_LOG_DWELL_ENABLED" //optional NSUserDefaults bool, add IBEACON_LOG_DWELL to log 21 comment. Default NO keeps comment a flat {serverid: distance} map, only enable when server accepts the nested key.
+#define IBEACON_LOG_DWELL                   @"dwell" //key in log 21 comment for {serverid: seconds inside} of exited iBeacons, only when IBEACON_LOG_DWELL_ENABLED.
+#define APPSTATUS_IBEACON_FILE_VERSION      1
 #define APPSTATUS_REREGISTER                @"APPSTATUS_REREGISTER" //a flag set to notice next launch must re-register install
 #define APPSTATUS_APPSTOREID                @"APPSTATUS_APPSTOREID" //server push itunes id to client side
 
@@ -43,13 +58,33 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 
 #ifdef SH_FEATURE_IBEACON
 
+//One iBeacon in APPSTATUS_IBEACON_FETCH_FILE, fixed 16 bytes. All Apple devices are little endian so written as memory layout.
+typedef struct
+{
+    uint16_t uuidIndex; //index in uuid table of file
+    uint16_t major;
+    uint16_t minor;
+    uint16_t reserved;
+    int32_t serverId;
+    float distance; //negative means outside
+} SHServeriBeaconRecord;
+
+//One distance change in APPSTATUS_IBEACON_DISTANCE_FILE, fixed 12 bytes. A partial record written when App is killed is ignored.
+typedef struct
+{
+    int32_t serverId;
+    uint16_t major;
+    uint16_t minor;
+    float distance; //negative means outside
+} SHServeriBeaconDistanceRecord;
+
 /**
  An object to represent server fetched iBeacon information. It's different from CLBeaconRegion and CLBeacon, so create an object to store it.
  */
 @interface SHServeriBeacon : NSObject
 
 /**
- Match to iBeacon's proximity UUID.
+ Match to iBeacon's proximity UUID. It's normalised to upper case when set, same as `NSUUID.UUIDString`.
  */
 @property (nonatomic, strong) NSString *uuid;
 
@@ -73,33 +108,132 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
  */
 @property (nonatomic) double distance;
 
+/**
+ Time (since reference date) when enter is confirmed, 0 if outside or not known, for example inside before App re-launch. Not stored.
+ */
+@property (nonatomic) NSTimeInterval enterTime;
+
+/**
+ Seconds inside when last exit is confirmed, 0 if not known.
+ */
+@property (nonatomic) NSTimeInterval lastDwell;
+
+/**
+ Time (since reference date) when it's first observed in state different from `distance`, 0 if observed same. Transition is confirmed after min dwell.
+ */
+@property (nonatomic) NSTimeInterval candidateTime;
+
 /**
  Compare function.
  */
 - (BOOL)isEqual:(id)object;
 
+/**
+ Hash consistent with `isEqual:`, so it can be used in set.
+ */
+- (NSUInteger)hash;
+
+/**
+ Key of major and minor in a UUID bucket of `SHServeriBeaconRegistry`.
+ */
++ (NSNumber *)keyForMajor:(int)major minor:(int)minor;
+
 /**
  Get one iBeacon region from UUid, identifier also use the uuid to be unique. It may return nil if fail to create one.
  */
 + (CLBeaconRegion *)getBeaconRegionForUUid:(NSString *)uuid;
 
 /**
- Make this object array to string array for store to NSUserDefaults.
+ Order by uuid, major, minor then server id. Fetch list is kept sorted by it so server and local lists are compared by one linear merge.
+ */
+- (NSComparisonResult)compareKey:(SHServeriBeacon *)other;
+
+/**
+ Parse "/ibeacons/" result {uuid: {major: {minor: server id}}} to object array sorted by `compareKey:`. Invalid items are skipped.
+ */
++ (NSMutableArray *)parseServerList:(NSDictionary *)dictList;
+
+/**
+ Write object array to binary file: header (magic, version, uuid count, record count), 16 bytes per uuid, then one `SHServeriBeaconRecord` per object. Distance is kept so exit is logged after re-launch.
  */
-+ (NSArray *)serializeToStringArray:(NSArray *)objArray;
++ (BOOL)saveArray:(NSArray *)objArray toFile:(NSString *)filePath;
 
 /**
- When read from NSUserDefaults, parse back to object array.
+ Read object array from file written by `saveArray:toFile:`. Return nil if file not exist or broken.
+ */
++ (NSMutableArray *)loadArrayFromFile:(NSString *)filePath;
+
+/**
+ When read from NSUserDefaults of previous version, parse back to object array.
  */
 + (NSArray *)deserializeToObjArray:(NSArray *)stringArray;
 
 @end
 
+/**
+ Index of server iBeacons by UUID bucket and (major, minor), built from `arrayiBeaconFetchList` and sharing its objects. Each bucket also keeps the iBeacons currently inside, so ranging only touches ranged and previously inside iBeacons instead of scanning whole list.
+ */
+@interface SHServeriBeaconRegistry : NSObject
+
+/**
+ Build from an array of `SHServeriBeacon`. iBeacons with distance > 0 are inside.
+ */
+- (id)initWithServeriBeacons:(NSArray *)arrayServeriBeacons;
+
+/**
+ All server iBeacons of `uuid`, empty if none.
+ */
+- (NSArray *)serveriBeaconsForUUid:(NSString *)uuid;
+
+/**
+ Server iBeacons of `uuid` which are inside now, empty if none.
+ */
+- (NSArray *)insideServeriBeaconsForUUid:(NSString *)uuid;
+
+/**
+ Mark `serveriBeacon` inside with `distance`, or outside if `distance` < 0.
+ */
+- (void)setServeriBeacon:(SHServeriBeacon *)serveriBeacon distance:(double)distance;
+
+/**
+ Accuracy (meters) a ranged iBeacon must be within to be observed inside, 0 means any.
+ */
+@property (nonatomic) double enterAccuracy;
+
+/**
+ Accuracy (meters) beyond which an inside iBeacon is observed outside, 0 means only not ranged is outside.
+ */
+@property (nonatomic) double exitAccuracy;
+
+/**
+ Seconds an observation different from current state must last before the transition is confirmed, 0 means confirm immediately.
+ */
+@property (nonatomic) NSTimeInterval minDwell;
+
+/**
+ Stop waiting for transition of iBeacons in `uuid`, used when region exits and ranging stops so an old observation not confirm next time.
+ @param uuid Region's UUID, case insensitive.
+ */
+- (void)resetCandidatesForUUid:(NSString *)uuid;
+
+/**
+ Diff one ranging result against iBeacons inside `uuid` or waiting for transition, and update their distance. Enter and exit are only reported after observed for `minDwell`.
+ @param arrayBeacons `CLBeacon` ranged this time.
+ @param uuid UUID of the ranged region.
+ @param arrayChangeIn Output server iBeacons newly inside.
+ @param arrayChangeOut Output server iBeacons newly outside.
+ */
+- (void)applyRangedBeacons:(NSArray *)arrayBeacons forUUid:(NSString *)uuid changeIn:(NSMutableArray *)arrayChangeIn changeOut:(NSMutableArray *)arrayChangeOut;
+
+@end
+
 #endif
 
 @interface SHAppStatus ()
 
 @property (nonatomic, strong) NSString *aliveHostInner; //inner memory variable
+@property (nonatomic, strong) NSString *aliveHostV1; //memorised "<aliveHostInner>/v1", cleared when `aliveHostInner` changes.
+@property (nonatomic, strong) NSString *aliveHostV2; //memorised "<aliveHostInner>/v2", cleared when `aliveHostInner` changes.
 
 //make sure update happens in sequence for each property
 @property (nonatomic) dispatch_semaphore_t semaphore_streethawkEnabled;
@@ -113,7 +247,23 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 #ifdef SH_FEATURE_IBEACON
 //iBeacon update
 @property (strong, nonatomic) NSMutableArray *arrayiBeaconFetchList;  //Server controls client to monitor a certain iBeacon list by request "/ibeacons", this list is cached locally and returned by this property. It's array of `SHServeriBeacon`. "app_status"'s "ibeacon" timestamp controls when to fetch this list again.
-- (void)sendLogForiBeacons:(NSArray *)arrayServeriBeacons isInside:(BOOL)isInside; //Send install/log for enter or exit(stop monitor) server iBeacons. If enter region, distance = ranged first distance or 1; if exit region, distance = `null`. If not enter or exit but only distance change, not send this install/log. code=21, comment formatted as {serverid: distance}.
+@property (strong, nonatomic) SHServeriBeaconRegistry *iBeaconRegistry; //index of `arrayiBeaconFetchList` for lookup when ranging, built when first used and cleared when list is replaced.
+- (void)sendLogForiBeacons:(NSArray *)arrayServeriBeacons isInside:(BOOL)isInside; //Queue install/log for enter or exit(stop monitor) server iBeacons, sent together by `flushiBeaconLogs` after IBEACON_LOG_WINDOW, or at once when App is not active as it may be suspended before window ends. If enter region, distance = ranged first distance or 1; if exit region, distance = -1. If not enter or exit but only distance change, not send this install/log. code=21, comment formatted as {serverid: distance}, with "dwell": {serverid: seconds} for exited iBeacons whose enter time is known only if IBEACON_LOG_DWELL_ENABLED.
+@property (strong, nonatomic) NSMutableDictionary *dictPendingiBeaconDistance; //serverid string -> distance waiting to send in log 21. Also used as lock for pending logs.
+@property (strong, nonatomic) NSMutableDictionary *dictPendingiBeaconDwell; //serverid string -> seconds inside for exited iBeacons waiting to send.
+@property (nonatomic) BOOL isLogFlushScheduled; //a flush of pending logs is scheduled after IBEACON_LOG_WINDOW.
+- (void)flushiBeaconLogs; //send pending enter/exit as one log 21.
++ (NSString *)iBeaconFetchListPath; //path of APPSTATUS_IBEACON_FETCH_FILE.
+- (void)saveiBeaconFetchList; //write `arrayiBeaconFetchList` with distance to APPSTATUS_IBEACON_FETCH_FILE, and remove APPSTATUS_IBEACON_DISTANCE_FILE as it's included.
++ (NSString *)iBeaconDistancePath; //path of APPSTATUS_IBEACON_DISTANCE_FILE.
+@property (strong, nonatomic) NSMutableSet *setDirtyiBeacons; //SHServeriBeacon whose distance changed but not written yet. Also used as lock for iBeacon files.
+@property (nonatomic) BOOL isDistanceFlushScheduled; //a flush is scheduled after APPSTATUS_IBEACON_FLUSH_DELAY.
+@property (nonatomic) NSInteger distanceRecordCount; //records in APPSTATUS_IBEACON_DISTANCE_FILE.
+- (void)markDistanceChanged:(NSArray *)arrayServeriBeacons; //remember distance change and schedule a flush, not write file immediately.
+- (void)flushiBeaconDistances; //append dirty distances to APPSTATUS_IBEACON_DISTANCE_FILE, or write whole list if journal is too long.
+- (void)applyDistanceJournalToList:(NSArray *)arrayList; //replay APPSTATUS_IBEACON_DISTANCE_FILE to objects loaded from APPSTATUS_IBEACON_FETCH_FILE.
+- (void)appDidEnterBackgroundNotificationHandler:(NSNotification *)notification; //flush distance changes and pending logs as App may be killed in background.
+- (void)updateiBeaconFetchList:(NSMutableArray *)arrayServer; //merge sorted server list with sorted local list, start monitor new UUID regions, stop removed ones, keep distance of not changed iBeacons and store.
 - (NSArray *)findServeriBeaconsInsideRegion:(CLBeaconRegion *)region onlyWithDistance:(BOOL)requireDistance needSetOutside:(BOOL)setOutside;  //get SHServeriBeacon list, subset of self.arrayiBeaconFetchList, which match this region. If `requireDistance` means get those with distance, otherwise get all SHServeriBeacon inside this region.
 - (void)regionStateChangeNotificationHandler:(NSNotification *)notification; //monitor when a region state change.
 - (void)regionRangeNotificationHandler:(NSNotification *)notification; //when range a region to know exact iBeacons.
@@ -125,6 +275,7 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 
 #ifdef SH_FEATURE_IBEACON
 @synthesize arrayiBeaconFetchList = _arrayiBeaconFetchList;
+@synthesize iBeaconRegistry = _iBeaconRegistry;
 #endif
 
 #pragma mark - life cycle
@@ -167,6 +318,14 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 #ifdef SH_FEATURE_IBEACON
         [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(regionStateChangeNotificationHandler:) name:SHLMRegionStateChangeNotification object:nil];
         [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(regionRangeNotificationHandler:) name:SHLMRangeiBeaconChangedNotification object:nil];
+        self.setDirtyiBeacons = [NSMutableSet set];
+        self.isDistanceFlushScheduled = NO;
+        self.distanceRecordCount = 0;
+        self.dictPendingiBeaconDistance = [NSMutableDictionary dictionary];
+        self.dictPendingiBeaconDwell = [NSMutableDictionary dictionary];
+        self.isLogFlushScheduled = NO;
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(appDidEnterBackgroundNotificationHandler:) name:UIApplicationDidEnterBackgroundNotification object:nil];
+        [[NSNotificationCenter defaultCenter] addObserver:self selector:@selector(appDidEnterBackgroundNotificationHandler:) name:UIApplicationWillTerminateNotification object:nil];
 #endif
     }
     return self;
@@ -235,13 +394,29 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
     {
         self.aliveHostInner = [self.aliveHostInner substringToIndex:self.aliveHostInner.length - 1]; //remove last "/"
     }
+    //Same instance is returned until host changes, so caller can compare by pointer to know it changes.
     switch (hostVersion)
     {
         case SHHostVersion_V1:
-            return [NSString stringWithFormat:@"%@/%@", self.aliveHostInner, @"v1"];
-            break;
+        {
+            NSString *hostUrl = self.aliveHostV1;
+            if (hostUrl == nil)
+            {
+                hostUrl = [NSString stringWithFormat:@"%@/%@", self.aliveHostInner, @"v1"];
+                self.aliveHostV1 = hostUrl;
+            }
+            return hostUrl;
+        }
         case SHHostVersion_V2:
-            return [NSString stringWithFormat:@"%@/%@", self.aliveHostInner, @"v2"];
+        {
+            NSString *hostUrl = self.aliveHostV2;
+            if (hostUrl == nil)
+            {
+                hostUrl = [NSString stringWithFormat:@"%@/%@", self.aliveHostInner, @"v2"];
+                self.aliveHostV2 = hostUrl;
+            }
+            return hostUrl;
+        }
         default:
             NSAssert(NO, @"Meet unknown host version;");
             break;
@@ -249,6 +424,13 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
     return nil;
 }
 
+- (void)setAliveHostInner:(NSString *)aliveHostInner
+{
+    _aliveHostInner = aliveHostInner;
+    self.aliveHostV1 = nil;
+    self.aliveHostV2 = nil;
+}
+
 - (void)setAliveHost:(NSString *)aliveHost
 {
     if (aliveHost != nil && aliveHost.length > 0)
@@ -373,6 +555,7 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
                 [[NSUserDefaults standardUserDefaults] setObject:@([[NSDate date] timeIntervalSinceReferenceDate]) forKey:APPSTATUS_IBEACON_FETCH_TIME];
                 [[NSUserDefaults standardUserDefaults] synchronize];
                 SHRequest *fetchRequest = [SHRequest requestWithPath:@"/ibeacons/"];
+                fetchRequest.useResponseCache = YES; //timestamp may change while list not, 304 reuses cached list.
                 fetchRequest.requestHandler = ^(SHRequest *request)
                 {
                     if (request.error == nil)
@@ -382,110 +565,7 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
                         NSAssert([request.resultValue isKindOfClass:[NSDictionary class]], @"Server return should be dictionary.");
                         if ([request.resultValue isKindOfClass:[NSDictionary class]])
                         {
-                            NSMutableArray *arrayList = [NSMutableArray array];
-                            NSDictionary *dictList = (NSDictionary *)request.resultValue;
-                            for (NSObject *uuidValue in dictList.allKeys)
-                            {
-                                NSAssert([uuidValue isKindOfClass:[NSString class]] && [dictList[uuidValue] isKindOfClass:[NSDictionary class]], @"UUID dictionary invalid: %@.", uuidValue);
-                                if ([uuidValue isKindOfClass:[NSString class]] && [dictList[uuidValue] isKindOfClass:[NSDictionary class]])
-                                {
-                                    NSDictionary *dictuuid = (NSDictionary *)dictList[uuidValue];
-                                    for (NSObject *majorValue in dictuuid.allKeys)
-                                    {
-                                        NSAssert(([majorValue isKindOfClass:[NSNumber class]] || [majorValue isKindOfClass:[NSString class]]) && [dictuuid[majorValue] isKindOfClass:[NSDictionary class]], @"Major dictionary invalid: %@.", majorValue);
-                                        if (([majorValue isKindOfClass:[NSNumber class]] || [majorValue isKindOfClass:[NSString class]]) && [dictuuid[majorValue] isKindOfClass:[NSDictionary class]])
-                                        {
-                                            NSDictionary *dictMajor = (NSDictionary *)dictuuid[majorValue];
-                                            for (NSObject *minorValue in dictMajor.allKeys)
-                                            {
-                                                NSAssert(([minorValue isKindOfClass:[NSNumber class]] || [minorValue isKindOfClass:[NSString class]]) && ([dictMajor[minorValue] isKindOfClass:[NSNumber class]] || [dictMajor[minorValue] isKindOfClass:[NSString class]]), @"Minor dictionary invalid: %@.", minorValue);
-                                                if (([minorValue isKindOfClass:[NSNumber class]] || [minorValue isKindOfClass:[NSString class]]) && ([dictMajor[minorValue] isKindOfClass:[NSNumber class]] || [dictMajor[minorValue] isKindOfClass:[NSString class]]))
-                                                {
-                                                    SHServeriBeacon *serveriBeacon = [[SHServeriBeacon alloc] init];
-                                                    serveriBeacon.uuid = (NSString *)uuidValue;
-                                                    if ([majorValue isKindOfClass:[NSNumber class]])
-                                                    {
-                                                        serveriBeacon.major = [(NSNumber *)majorValue intValue];
-                                                    }
-                                                    else if ([majorValue isKindOfClass:[NSString class]])
-                                                    {
-                                                        serveriBeacon.major = [(NSString *)majorValue intValue];
-                                                    }
-                                                    if ([minorValue isKindOfClass:[NSNumber class]])
-                                                    {
-                                                        serveriBeacon.minor = [(NSNumber *)minorValue intValue];
-                                                    }
-                                                    else if ([minorValue isKindOfClass:[NSString class]])
-                                                    {
-                                                        serveriBeacon.minor = [(NSString *)minorValue intValue];
-                                                    }
-                                                    serveriBeacon.serverId = [dictMajor[minorValue] intValue];
-                                                    [arrayList addObject:serveriBeacon];
-                                                }
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                            //compare current memory's `arrayiBeaconFetchList` (same as cached APPSTATUS_IBEACON_FETCH_LIST), if not in new list, stop monitor; if find new, add monitor. Note: start/stop iBeacon region uses wild-match, that is ONLY uuid is used to create the region, major and minor not provided. This is because same identifier causes previous region removed, so must create unique identifier, the less region the better. CLLocationManager only supports 50 region including iBeacon and Geofence. When find match, use major and minor to match to server id.
-                            NSMutableArray *serverUUids = [[NSMutableArray alloc] init];
-                            NSMutableArray *localUUids = [[NSMutableArray alloc] init];
-                            for (SHServeriBeacon *ibeacon in arrayList)
-                            {
-                                if (![serverUUids containsObject:ibeacon.uuid])
-                                {
-                                    [serverUUids addObject:ibeacon.uuid];
-                                }
-                            }
-                            for (SHServeriBeacon *ibeacon in self.arrayiBeaconFetchList)
-                            {
-                                if (![localUUids containsObject:ibeacon.uuid])
-                                {
-                                    [localUUids addObject:ibeacon.uuid];
-                                }
-                            }
-                            for (NSString *serverUUid in serverUUids)
-                            {
-                                BOOL findInLocal = NO;
-                                for (NSString *localUUid in localUUids)
-                                {
-                                    if ([serverUUid compare:localUUid options:NSCaseInsensitiveSearch] == NSOrderedSame)  //only consider uuid, wild-match
-                                    {
-                                        findInLocal = YES;
-                                        break;
-                                    }
-                                }
-                                if (!findInLocal) //server return one not in local cache, start monitor.
-                                {
-                                    SHLog(@"Start monitor server's iBeacon region for UUid: %@.", serverUUid);
-                                    [StreetHawk.locationManager startMonitorRegion:[SHServeriBeacon getBeaconRegionForUUid:serverUUid]];
-                                }
-                            }
-                            for (NSString *localUUid in localUUids)
-                            {
-                                BOOL findInServer = NO;
-                                for (NSString *serverUUid in serverUUids)
-                                {
-                                    if ([serverUUid compare:localUUid options:NSCaseInsensitiveSearch] == NSOrderedSame)
-                                    {
-                                        findInServer = YES;
-                                        break;
-                                    }
-                                }
-                                if (!findInServer) //local has one not in server, stop monitor.
-                                {
-                                    CLBeaconRegion *stopRegion = [SHServeriBeacon getBeaconRegionForUUid:localUUid];
-                                    [StreetHawk.locationManager stopMonitorRegion:stopRegion];
-                                    NSArray *arrayStopMonitorServeriBeacons = [self findServeriBeaconsInsideRegion:stopRegion onlyWithDistance:NO/*all, not from inside to outside*/ needSetOutside:YES];
-                                    NSAssert(arrayStopMonitorServeriBeacons.count != 0, @"Fail to find matching server iBeacons for region %@.", stopRegion);
-                                    [self sendLogForiBeacons:arrayStopMonitorServeriBeacons isInside:NO]; //need this because "stop monitor" not trigger any delegate.
-                                    SHLog(@"Stop monitor server's iBeacon region for UUid: %@.", localUUid);
-                                }
-                            }
-                            //store server's list into local cache and update memory
-                            self.arrayiBeaconFetchList = arrayList;
-                            [[NSUserDefaults standardUserDefaults] setObject:[SHServeriBeacon serializeToStringArray:arrayList] forKey:APPSTATUS_IBEACON_FETCH_LIST];
-                            [[NSUserDefaults standardUserDefaults] synchronize];
+                            [self updateiBeaconFetchList:[SHServeriBeacon parseServerList:(NSDictionary *)request.resultValue]];
                         }
                     }
                     else
@@ -505,9 +585,9 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
         [StreetHawk.locationManager stopMonitorRegion:[SHServeriBeacon getBeaconRegionForUUid:localiBeacon.uuid]]; //harmless for duplicate call
     }
     [self sendLogForiBeacons:self.arrayiBeaconFetchList isInside:NO]; //set all to be distance=null in server, need this because "stop monitor" not trigger any delegate.
-    self.arrayiBeaconFetchList = [NSMutableArray array]; //cannot set to nil, as nil will read from NSUserDefaults again.
-    [[NSUserDefaults standardUserDefaults] setObject:[NSArray array] forKey:APPSTATUS_IBEACON_FETCH_LIST];  //clear local cache, not start when kill and launch App.
-    [[NSUserDefaults standardUserDefaults] synchronize];
+    [self flushiBeaconLogs];
+    self.arrayiBeaconFetchList = [NSMutableArray array]; //cannot set to nil, as nil will read from file again.
+    [self saveiBeaconFetchList];  //clear local cache, not start when kill and launch App.
 #endif
 }
 
@@ -639,6 +719,7 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
         }
     }
     SHRequest *request = [SHRequest requestWithPath:@"apps/status/" withParams:@[@"app_key", NONULL(StreetHawk.appKey)]];
+    request.useResponseCache = YES;
     request.requestHandler = handler;
     [request startAsynchronously];
 }
@@ -657,44 +738,356 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 {
     if (_arrayiBeaconFetchList == nil) //never initialized
     {
-        _arrayiBeaconFetchList = [NSMutableArray arrayWithArray:[SHServeriBeacon deserializeToObjArray:[[NSUserDefaults standardUserDefaults] objectForKey:APPSTATUS_IBEACON_FETCH_LIST]]]; //it will not get nil even empty
+        _arrayiBeaconFetchList = [SHServeriBeacon loadArrayFromFile:[SHAppStatus iBeaconFetchListPath]];
+        if (_arrayiBeaconFetchList != nil)
+        {
+            [self applyDistanceJournalToList:_arrayiBeaconFetchList]; //distance changed after the list is written
+        }
+        else
+        {
+            //not have file, move list of previous version from NSUserDefaults.
+            _arrayiBeaconFetchList = [NSMutableArray arrayWithArray:[SHServeriBeacon deserializeToObjArray:[[NSUserDefaults standardUserDefaults] objectForKey:APPSTATUS_IBEACON_FETCH_LIST]]]; //it will not get nil even empty
+            [_arrayiBeaconFetchList sortUsingSelector:@selector(compareKey:)];
+            [SHServeriBeacon saveArray:_arrayiBeaconFetchList toFile:[SHAppStatus iBeaconFetchListPath]];
+            [[NSUserDefaults standardUserDefaults] removeObjectForKey:APPSTATUS_IBEACON_FETCH_LIST];
+            [[NSUserDefaults standardUserDefaults] synchronize];
+        }
     }
     return _arrayiBeaconFetchList;
 }
 
+- (void)setArrayiBeaconFetchList:(NSMutableArray *)arrayiBeaconFetchList
+{
+    _arrayiBeaconFetchList = arrayiBeaconFetchList;
+    _iBeaconRegistry = nil; //index old objects, build again when used.
+}
+
++ (NSString *)iBeaconFetchListPath
+{
+    static NSString *filePath = nil;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^
+    {
+        NSArray *libraryDirs = NSSearchPathForDirectoriesInDomains(NSLibraryDirectory, NSUserDomainMask, YES); //use /Library same as NSUserDefaults used before, not purged.
+        NSString *streetHawkDir = [libraryDirs[0] stringByAppendingPathComponent:@"StreetHawk"];
+        [[NSFileManager defaultManager] createDirectoryAtPath:streetHawkDir withIntermediateDirectories:YES attributes:nil error:nil];
+        filePath = [streetHawkDir stringByAppendingPathComponent:APPSTATUS_IBEACON_FETCH_FILE];
+    });
+    return filePath;
+}
+
+- (void)saveiBeaconFetchList
+{
+    @synchronized(self.setDirtyiBeacons)
+    {
+        [self.setDirtyiBeacons removeAllObjects]; //whole list includes them
+        //remove journal first: if killed before new list is written, old list is used without applying journal of newer changes to it.
+        [[NSFileManager defaultManager] removeItemAtPath:[SHAppStatus iBeaconDistancePath] error:nil];
+        self.distanceRecordCount = 0;
+        if (![SHServeriBeacon saveArray:self.arrayiBeaconFetchList toFile:[SHAppStatus iBeaconFetchListPath]])
+        {
+            SHLog(@"Fail to save server iBeacon list.");
+        }
+    }
+}
+
++ (NSString *)iBeaconDistancePath
+{
+    return [[[SHAppStatus iBeaconFetchListPath] stringByDeletingLastPathComponent] stringByAppendingPathComponent:APPSTATUS_IBEACON_DISTANCE_FILE];
+}
+
+- (void)markDistanceChanged:(NSArray *)arrayServeriBeacons
+{
+    if (arrayServeriBeacons.count == 0)
+    {
+        return;
+    }
+    @synchronized(self.setDirtyiBeacons)
+    {
+        [self.setDirtyiBeacons addObjectsFromArray:arrayServeriBeacons];
+        if (self.isDistanceFlushScheduled)
+        {
+            return; //written together with previous changes
+        }
+        self.isDistanceFlushScheduled = YES;
+    }
+    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(APPSTATUS_IBEACON_FLUSH_DELAY * NSEC_PER_SEC)), dispatch_get_main_queue(), ^
+    {
+        [self flushiBeaconDistances];
+    });
+}
+
+- (void)flushiBeaconDistances
+{
+    @synchronized(self.setDirtyiBeacons)
+    {
+        self.isDistanceFlushScheduled = NO;
+        if (self.setDirtyiBeacons.count == 0)
+        {
+            return;
+        }
+        if (self.distanceRecordCount + self.setDirtyiBeacons.count > MAX(APPSTATUS_IBEACON_JOURNAL_MAX, self.arrayiBeaconFetchList.count))
+        {
+            [self saveiBeaconFetchList]; //journal is longer than list, start again from whole list.
+            return;
+        }
+        NSMutableData *recordsData = [NSMutableData dataWithCapacity:self.setDirtyiBeacons.count * sizeof(SHServeriBeaconDistanceRecord)];
+        for (SHServeriBeacon *serveriBeacon in self.setDirtyiBeacons)
+        {
+            SHServeriBeaconDistanceRecord record;
+            record.serverId = serveriBeacon.serverId;
+            record.major = (uint16_t)serveriBeacon.major;
+            record.minor = (uint16_t)serveriBeacon.minor;
+            record.distance = (serveriBeacon.distance > 0) ? (float)serveriBeacon.distance : -1;
+            [recordsData appendBytes:&record length:sizeof(record)];
+        }
+        NSString *journalPath = [SHAppStatus iBeaconDistancePath];
+        if (![[NSFileManager defaultManager] fileExistsAtPath:journalPath])
+        {
+            [[NSFileManager defaultManager] createFileAtPath:journalPath contents:nil attributes:nil];
+        }
+        NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:journalPath];
+        if (fileHandle == nil)
+        {
+            [self saveiBeaconFetchList]; //cannot append, keep state by whole list.
+            return;
+        }
+        unsigned long long fileLength = [fileHandle seekToEndOfFile];
+        if (fileLength % sizeof(SHServeriBeaconDistanceRecord) != 0)
+        {
+            [fileHandle truncateFileAtOffset:fileLength - fileLength % sizeof(SHServeriBeaconDistanceRecord)]; //drop partial record of killed write, otherwise following records are misaligned.
+        }
+        [fileHandle writeData:recordsData];
+        [fileHandle closeFile];
+        self.distanceRecordCount = (NSInteger)(fileLength / sizeof(SHServeriBeaconDistanceRecord)) + self.setDirtyiBeacons.count;
+        [self.setDirtyiBeacons removeAllObjects];
+    }
+}
+
+- (void)applyDistanceJournalToList:(NSArray *)arrayList
+{
+    NSData *journalData = [NSData dataWithContentsOfFile:[SHAppStatus iBeaconDistancePath]];
+    NSUInteger recordCount = journalData.length / sizeof(SHServeriBeaconDistanceRecord); //partial record at end is ignored
+    self.distanceRecordCount = recordCount;
+    if (recordCount == 0)
+    {
+        return;
+    }
+    NSMutableDictionary *dictServerId = [NSMutableDictionary dictionaryWithCapacity:arrayList.count];
+    for (SHServeriBeacon *serveriBeacon in arrayList)
+    {
+        dictServerId[@(serveriBeacon.serverId)] = serveriBeacon;
+    }
+    const SHServeriBeaconDistanceRecord *records = (const SHServeriBeaconDistanceRecord *)journalData.bytes;
+    for (NSUInteger i = 0; i < recordCount; i++) //later record overwrites earlier one
+    {
+        SHServeriBeacon *serveriBeacon = dictServerId[@(records[i].serverId)];
+        if (serveriBeacon != nil && serveriBeacon.major == records[i].major && serveriBeacon.minor == records[i].minor)
+        {
+            serveriBeacon.distance = (records[i].distance > 0) ? records[i].distance : INT64_MIN;
+        }
+    }
+}
+
+- (void)appDidEnterBackgroundNotificationHandler:(NSNotification *)notification
+{
+    [self flushiBeaconLogs];
+    [self flushiBeaconDistances];
+}
+
+- (void)updateiBeaconFetchList:(NSMutableArray *)arrayServer
+{
+    NSArray *arrayLocal = self.arrayiBeaconFetchList;
+    //merge records: keep local object of same iBeacon so its distance is not lost, take server object for new one.
+    NSMutableArray *arrayList = [NSMutableArray arrayWithCapacity:arrayServer.count];
+    BOOL isChanged = NO;
+    NSUInteger serverIndex = 0;
+    NSUInteger localIndex = 0;
+    while (serverIndex < arrayServer.count && localIndex < arrayLocal.count)
+    {
+        NSComparisonResult order = [arrayServer[serverIndex] compareKey:arrayLocal[localIndex]];
+        if (order == NSOrderedSame)
+        {
+            [arrayList addObject:arrayLocal[localIndex]];
+            serverIndex++;
+            localIndex++;
+        }
+        else if (order == NSOrderedAscending) //new in server
+        {
+            [arrayList addObject:arrayServer[serverIndex]];
+            serverIndex++;
+            isChanged = YES;
+        }
+        else //removed from server
+        {
+            localIndex++;
+            isChanged = YES;
+        }
+    }
+    if (serverIndex < arrayServer.count || localIndex < arrayLocal.count)
+    {
+        [arrayList addObjectsFromArray:[arrayServer subarrayWithRange:NSMakeRange(serverIndex, arrayServer.count - serverIndex)]];
+        isChanged = YES;
+    }
+    if (!isChanged)
+    {
+        return; //same list, regions and local file are correct.
+    }
+    //merge UUIDs of both sorted lists, if not in new list, stop monitor; if find new, add monitor. Note: start/stop iBeacon region uses wild-match, that is ONLY uuid is used to create the region, major and minor not provided. This is because same identifier causes previous region removed, so must create unique identifier, the less region the better. CLLocationManager only supports 50 region including iBeacon and Geofence. When find match, use major and minor to match to server id.
+    serverIndex = 0;
+    localIndex = 0;
+    while (serverIndex < arrayServer.count || localIndex < arrayLocal.count)
+    {
+        NSString *serverUUid = (serverIndex < arrayServer.count) ? ((SHServeriBeacon *)arrayServer[serverIndex]).uuid : nil;
+        NSString *localUUid = (localIndex < arrayLocal.count) ? ((SHServeriBeacon *)arrayLocal[localIndex]).uuid : nil;
+        NSComparisonResult order = (serverUUid == nil) ? NSOrderedDescending : ((localUUid == nil) ? NSOrderedAscending : [serverUUid compare:localUUid]);
+        if (order == NSOrderedAscending) //server return one not in local cache, start monitor.
+        {
+            SHLog(@"Start monitor server's iBeacon region for UUid: %@.", serverUUid);
+            [StreetHawk.locationManager startMonitorRegion:[SHServeriBeacon getBeaconRegionForUUid:serverUUid]];
+        }
+        else if (order == NSOrderedDescending) //local has one not in server, stop monitor.
+        {
+            CLBeaconRegion *stopRegion = [SHServeriBeacon getBeaconRegionForUUid:localUUid];
+            [StreetHawk.locationManager stopMonitorRegion:stopRegion];
+            NSArray *arrayStopMonitorServeriBeacons = [self findServeriBeaconsInsideRegion:stopRegion onlyWithDistance:NO/*all, not from inside to outside*/ needSetOutside:YES];
+            NSAssert(arrayStopMonitorServeriBeacons.count != 0, @"Fail to find matching server iBeacons for region %@.", stopRegion);
+            [self sendLogForiBeacons:arrayStopMonitorServeriBeacons isInside:NO]; //need this because "stop monitor" not trigger any delegate.
+            [self flushiBeaconLogs];
+            SHLog(@"Stop monitor server's iBeacon region for UUid: %@.", localUUid);
+        }
+        //skip rest of this UUID in both lists, they are sorted by uuid first.
+        if (order != NSOrderedDescending)
+        {
+            while (serverIndex < arrayServer.count && [((SHServeriBeacon *)arrayServer[serverIndex]).uuid isEqualToString:serverUUid])
+            {
+                serverIndex++;
+            }
+        }
+        if (order != NSOrderedAscending)
+        {
+            while (localIndex < arrayLocal.count && [((SHServeriBeacon *)arrayLocal[localIndex]).uuid isEqualToString:localUUid])
+            {
+                localIndex++;
+            }
+        }
+    }
+    //store server's list into local cache and update memory
+    self.arrayiBeaconFetchList = arrayList;
+    [self saveiBeaconFetchList];
+}
+
+- (SHServeriBeaconRegistry *)iBeaconRegistry
+{
+    if (_iBeaconRegistry == nil)
+    {
+        _iBeaconRegistry = [[SHServeriBeaconRegistry alloc] initWithServeriBeacons:self.arrayiBeaconFetchList];
+        NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
+        _iBeaconRegistry.enterAccuracy = [userDefaults doubleForKey:IBEACON_ENTER_ACCURACY];
+        _iBeaconRegistry.exitAccuracy = [userDefaults doubleForKey:IBEACON_EXIT_ACCURACY];
+        _iBeaconRegistry.minDwell = ([userDefaults objectForKey:IBEACON_MIN_DWELL] != nil) ? [userDefaults doubleForKey:IBEACON_MIN_DWELL] : IBEACON_DEFAULT_DWELL;
+    }
+    return _iBeaconRegistry;
+}
+
 - (void)sendLogForiBeacons:(NSArray *)arrayServeriBeacons isInside:(BOOL)isInside
 {
-    if (arrayServeriBeacons != nil && arrayServeriBeacons.count > 0)
+    if (arrayServeriBeacons == nil || arrayServeriBeacons.count == 0)
+    {
+        return;
+    }
+    BOOL needFlushFirst = NO;
+    @synchronized(self.dictPendingiBeaconDistance)
+    {
+        for (SHServeriBeacon *iBeacon in arrayServeriBeacons)
+        {
+            NSNumber *pendingDistance = self.dictPendingiBeaconDistance[[NSString stringWithFormat:@"%d", iBeacon.serverId]];
+            if (pendingDistance != nil && (pendingDistance.doubleValue > 0) != isInside)
+            {
+                needFlushFirst = YES; //same iBeacon changes back within window, server must get both in order.
+                break;
+            }
+        }
+    }
+    if (needFlushFirst)
+    {
+        [self flushiBeaconLogs];
+    }
+    BOOL isDwellEnabled = [[NSUserDefaults standardUserDefaults] boolForKey:IBEACON_LOG_DWELL_ENABLED];
+    BOOL needSchedule = NO;
+    @synchronized(self.dictPendingiBeaconDistance)
     {
-        NSMutableDictionary *dictDistance = [[NSMutableDictionary alloc] init];
         for (SHServeriBeacon *iBeacon in arrayServeriBeacons)
         {
+            NSString *serverIdStr = [NSString stringWithFormat:@"%d", iBeacon.serverId]; //must use string for key, cannot use NSNumber
             double distance = isInside ? (iBeacon.distance > 0 ? iBeacon.distance : 1)/*enter region set distance=meter value*/ : -1/*exit region set distance=-1*/;
-            [dictDistance setObject:[NSNumber numberWithDouble:distance] forKey:[NSString stringWithFormat:@"%d", iBeacon.serverId]/*must use string for key, cannot use NSNumber*/];
+            self.dictPendingiBeaconDistance[serverIdStr] = @(distance);
+            if (isDwellEnabled && !isInside && iBeacon.lastDwell > 0)
+            {
+                self.dictPendingiBeaconDwell[serverIdStr] = @(round(iBeacon.lastDwell));
+            }
+            else
+            {
+                [self.dictPendingiBeaconDwell removeObjectForKey:serverIdStr];
+            }
+        }
+        if (!self.isLogFlushScheduled)
+        {
+            self.isLogFlushScheduled = YES;
+            needSchedule = YES;
+        }
+    }
+    if ([UIApplication sharedApplication].applicationState != UIApplicationStateActive)
+    {
+        //background region wake only gives App a few seconds, pending logs in memory are lost if App is suspended or killed before window ends and enter background notification does not come again. Write to log database now.
+        [self flushiBeaconLogs];
+    }
+    else if (needSchedule)
+    {
+        NSUserDefaults *userDefaults = [NSUserDefaults standardUserDefaults];
+        double window = ([userDefaults objectForKey:IBEACON_LOG_WINDOW] != nil) ? [userDefaults doubleForKey:IBEACON_LOG_WINDOW] : IBEACON_DEFAULT_WINDOW;
+        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(MAX(0, window) * NSEC_PER_SEC)), dispatch_get_main_queue(), ^
+        {
+            [self flushiBeaconLogs];
+        });
+    }
+}
+
+- (void)flushiBeaconLogs
+{
+    NSMutableDictionary *dictLog = nil;
+    @synchronized(self.dictPendingiBeaconDistance)
+    {
+        self.isLogFlushScheduled = NO;
+        if (self.dictPendingiBeaconDistance.count == 0)
+        {
+            return;
         }
-        NSString *distanceStr = shSerializeObjToJson(dictDistance);
-        if (distanceStr != nil && distanceStr.length > 0)
+        dictLog = [NSMutableDictionary dictionaryWithDictionary:self.dictPendingiBeaconDistance];
+        if (self.dictPendingiBeaconDwell.count > 0)
         {
-            [StreetHawk sendLogForCode:LOG_CODE_LOCATION_IBEACON withComment:distanceStr];
+            dictLog[IBEACON_LOG_DWELL] = [NSDictionary dictionaryWithDictionary:self.dictPendingiBeaconDwell];
         }
+        [self.dictPendingiBeaconDistance removeAllObjects];
+        [self.dictPendingiBeaconDwell removeAllObjects];
+    }
+    NSString *distanceStr = shSerializeObjToJson(dictLog);
+    if (distanceStr != nil && distanceStr.length > 0)
+    {
+        [StreetHawk sendLogForCode:LOG_CODE_LOCATION_IBEACON withComment:distanceStr];
     }
 }
 
 - (NSArray *)findServeriBeaconsInsideRegion:(CLBeaconRegion *)region onlyWithDistance:(BOOL)requireDistance needSetOutside:(BOOL)setOutside
 {
-    NSMutableArray *arrayMatchServeriBeacons = [[NSMutableArray alloc] init];
-    for (SHServeriBeacon *serveriBeacon in self.arrayiBeaconFetchList)
+    NSString *uuid = region.proximityUUID.UUIDString;
+    NSArray *arrayMatchServeriBeacons = requireDistance ? [self.iBeaconRegistry insideServeriBeaconsForUUid:uuid] : [self.iBeaconRegistry serveriBeaconsForUUid:uuid];
+    if (setOutside)
     {
-        if ([serveriBeacon.uuid compare:region.proximityUUID.UUIDString options:NSCaseInsensitiveSearch] == NSOrderedSame)
+        [self.iBeaconRegistry resetCandidatesForUUid:uuid]; //ranging stops, not confirm with old observation.
+        for (SHServeriBeacon *serveriBeacon in arrayMatchServeriBeacons)
         {
-            if (!requireDistance || serveriBeacon.distance > 0)
-            {
-                [arrayMatchServeriBeacons addObject:serveriBeacon];
-                if (setOutside)
-                {
-                    serveriBeacon.distance = INT64_MIN; //set to outside, used for exit region.
-                }
-            }
+            [self.iBeaconRegistry setServeriBeacon:serveriBeacon distance:INT64_MIN]; //set to outside, used for exit region.
         }
     }
     return arrayMatchServeriBeacons;
@@ -715,12 +1108,9 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
         [StreetHawk.locationManager stopRangeiBeaconRegion:region];   //exit one region so stop ranging it, after each one iBeacon outside, it may range for a while and trigger exit region state.
         NSArray *arrayServeriBeacons = [self findServeriBeaconsInsideRegion:region onlyWithDistance:YES needSetOutside:YES]; //this updates distance already
         [self sendLogForiBeacons:arrayServeriBeacons isInside:NO];
-        if (arrayServeriBeacons.count > 0)
-        {
-            //distance should be serialize to disk, in case re-launch and exit region, should find match server ibeacon from disk with distance.
-            [[NSUserDefaults standardUserDefaults] setObject:[SHServeriBeacon serializeToStringArray:self.arrayiBeaconFetchList] forKey:APPSTATUS_IBEACON_FETCH_LIST];
-            [[NSUserDefaults standardUserDefaults] synchronize];
-        }
+        [self flushiBeaconLogs]; //region exit is already delayed by system, not wait more.
+        //distance should be serialize to disk, in case re-launch and exit region, should find match server ibeacon from disk with distance.
+        [self markDistanceChanged:arrayServeriBeacons];
     }
     //do nothing for state=unknown.
 }
@@ -730,51 +1120,10 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
     CLBeaconRegion *region = notification.userInfo[SHLMNotification_kRegion];
     NSArray *arrayThisRanging = notification.userInfo[SHLMNotification_kBeacons];
     //inside one region must keep ranging, because in case iBeacon1 and iBeacon2 have same UUID so in same region, when iBeacon1 out and iBeacon2 still in, the region state won't change until iBeacon2 out. To know exactly what iBeacons inside must keep ranging until exit this region. But server does not expect receive duplicated logs, so only when one iBeacon int or out send log.
-    NSArray *arrayPreviousRanging = [self findServeriBeaconsInsideRegion:region onlyWithDistance:NO needSetOutside:NO]; //all server iBeacon inside this region.
+    //This is called every second while inside the region, registry finds each ranged iBeacon by (major, minor) and only visits previously inside ones for exit.
     NSMutableArray *arrayChangeIn = [NSMutableArray array];
     NSMutableArray *arrayChangeOut = [NSMutableArray array];
-    for (CLBeacon *iBeacon in arrayThisRanging)
-    {
-        SHServeriBeacon *matchingServeriBeacon = nil;
-        for (SHServeriBeacon *serveriBeacon in arrayPreviousRanging)
-        {
-            NSAssert([iBeacon.proximityUUID.UUIDString compare:serveriBeacon.uuid options:NSCaseInsensitiveSearch] == NSOrderedSame, @"Range should in same region.");
-            if (iBeacon.major.intValue == serveriBeacon.major && iBeacon.minor.intValue == serveriBeacon.minor)
-            {
-                matchingServeriBeacon = serveriBeacon;
-                break;
-            }
-        }
-        if (matchingServeriBeacon != nil) //possible to monitor other iBeacon not added into streethawk server
-        {
-            if (matchingServeriBeacon.distance < 0) //means newly inside
-            {
-                matchingServeriBeacon.distance = iBeacon.accuracy > 0/*by testing it occassionally negative*/ ? iBeacon.accuracy : 1; //self.arrayiBeaconFetchList object's distance also updated
-                [arrayChangeIn addObject:matchingServeriBeacon];
-            }
-        }
-    }
-    for (SHServeriBeacon *serveriBeacon in arrayPreviousRanging)
-    {
-        if (serveriBeacon.distance > 0 && ![arrayChangeIn containsObject:serveriBeacon])
-        {
-            BOOL findInThis = NO;
-            for (CLBeacon *iBeacon in arrayThisRanging)
-            {
-                NSAssert([iBeacon.proximityUUID.UUIDString compare:serveriBeacon.uuid options:NSCaseInsensitiveSearch] == NSOrderedSame, @"Range should in same region.");
-                if (iBeacon.major.intValue == serveriBeacon.major && iBeacon.minor.intValue == serveriBeacon.minor)
-                {
-                    findInThis = YES;
-                    break;
-                }
-            }
-            if (!findInThis) //means newly outside
-            {
-                serveriBeacon.distance = INT64_MIN;
-                [arrayChangeOut addObject:serveriBeacon];
-            }
-        }
-    }
+    [self.iBeaconRegistry applyRangedBeacons:arrayThisRanging forUUid:region.proximityUUID.UUIDString changeIn:arrayChangeIn changeOut:arrayChangeOut];
     if (arrayChangeIn.count > 0)
     {
         [self sendLogForiBeacons:arrayChangeIn isInside:YES];
@@ -783,12 +1132,9 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
     {
         [self sendLogForiBeacons:arrayChangeOut isInside:NO];
     }
-    if (arrayChangeIn.count > 0 || arrayChangeOut.count > 0)
-    {
-        //distance should be serialize to disk, in case re-launch and exit region, should find match server ibeacon from disk with distance.
-        [[NSUserDefaults standardUserDefaults] setObject:[SHServeriBeacon serializeToStringArray:self.arrayiBeaconFetchList] forKey:APPSTATUS_IBEACON_FETCH_LIST];
-        [[NSUserDefaults standardUserDefaults] synchronize];
-    }
+    //distance should be serialize to disk, in case re-launch and exit region, should find match server ibeacon from disk with distance. Changes in following seconds are written together.
+    [self markDistanceChanged:arrayChangeIn];
+    [self markDistanceChanged:arrayChangeOut];
 }
 
 #endif
@@ -817,7 +1163,7 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 - (void)setUuid:(NSString *)uuid
 {
     NSAssert(uuid != nil && uuid.length > 0, @"Invalid UUID: %@.", uuid);
-    _uuid = uuid;
+    _uuid = uuid.uppercaseString; //registry and `hash` use it as key, compare without case each time is slow.
 }
 
 - (void)setMajor:(int)major
@@ -855,6 +1201,16 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
     return NO;
 }
 
+- (NSUInteger)hash
+{
+    return self.uuid.hash ^ [SHServeriBeacon keyForMajor:self.major minor:self.minor].unsignedIntegerValue ^ ((NSUInteger)self.serverId << 7);
+}
+
++ (NSNumber *)keyForMajor:(int)major minor:(int)minor
+{
+    return @(((major & 0xFFFF) << 16) | (minor & 0xFFFF)); //both are 16 bits
+}
+
 + (CLBeaconRegion *)getBeaconRegionForUUid:(NSString *)uuid
 {
     //March 23 2015: customer reports serious issue: iBeacon enter/exit not trigger. https://bitbucket.org/shawk/streethawk/issue/599/unable-to-detect-beacons-for-shsample
@@ -888,14 +1244,146 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
     return region;
 }
 
-+ (NSArray *)serializeToStringArray:(NSArray *)objArray
+- (NSComparisonResult)compareKey:(SHServeriBeacon *)other
+{
+    NSComparisonResult order = [self.uuid compare:other.uuid]; //both upper case
+    if (order != NSOrderedSame)
+    {
+        return order;
+    }
+    if (self.major != other.major)
+    {
+        return (self.major < other.major) ? NSOrderedAscending : NSOrderedDescending;
+    }
+    if (self.minor != other.minor)
+    {
+        return (self.minor < other.minor) ? NSOrderedAscending : NSOrderedDescending;
+    }
+    if (self.serverId != other.serverId)
+    {
+        return (self.serverId < other.serverId) ? NSOrderedAscending : NSOrderedDescending;
+    }
+    return NSOrderedSame;
+}
+
++ (NSMutableArray *)parseServerList:(NSDictionary *)dictList
 {
-    NSMutableArray *strArray = [NSMutableArray array];
+    NSMutableArray *arrayList = [NSMutableArray array];
+    [dictList enumerateKeysAndObjectsUsingBlock:^(NSObject *uuidValue, NSObject *majorsValue, BOOL *stop)
+    {
+        NSAssert([uuidValue isKindOfClass:[NSString class]] && [majorsValue isKindOfClass:[NSDictionary class]], @"UUID dictionary invalid: %@.", uuidValue);
+        if (![uuidValue isKindOfClass:[NSString class]] || ![majorsValue isKindOfClass:[NSDictionary class]] || [[NSUUID alloc] initWithUUIDString:(NSString *)uuidValue] == nil/*cannot monitor*/)
+        {
+            return;
+        }
+        NSString *uuid = ((NSString *)uuidValue).uppercaseString; //share one string for all iBeacons of this UUID
+        [(NSDictionary *)majorsValue enumerateKeysAndObjectsUsingBlock:^(NSObject *majorValue, NSObject *minorsValue, BOOL *stopMajor)
+        {
+            NSAssert(([majorValue isKindOfClass:[NSNumber class]] || [majorValue isKindOfClass:[NSString class]]) && [minorsValue isKindOfClass:[NSDictionary class]], @"Major dictionary invalid: %@.", majorValue);
+            if (!([majorValue isKindOfClass:[NSNumber class]] || [majorValue isKindOfClass:[NSString class]]) || ![minorsValue isKindOfClass:[NSDictionary class]])
+            {
+                return;
+            }
+            int major = [(NSNumber *)majorValue intValue]; //NSString also responds intValue
+            [(NSDictionary *)minorsValue enumerateKeysAndObjectsUsingBlock:^(NSObject *minorValue, NSObject *idValue, BOOL *stopMinor)
+            {
+                NSAssert(([minorValue isKindOfClass:[NSNumber class]] || [minorValue isKindOfClass:[NSString class]]) && ([idValue isKindOfClass:[NSNumber class]] || [idValue isKindOfClass:[NSString class]]), @"Minor dictionary invalid: %@.", minorValue);
+                if (([minorValue isKindOfClass:[NSNumber class]] || [minorValue isKindOfClass:[NSString class]]) && ([idValue isKindOfClass:[NSNumber class]] || [idValue isKindOfClass:[NSString class]]))
+                {
+                    SHServeriBeacon *serveriBeacon = [[SHServeriBeacon alloc] init];
+                    serveriBeacon.uuid = uuid;
+                    serveriBeacon.major = major;
+                    serveriBeacon.minor = [(NSNumber *)minorValue intValue];
+                    serveriBeacon.serverId = [(NSNumber *)idValue intValue];
+                    [arrayList addObject:serveriBeacon];
+                }
+            }];
+        }];
+    }];
+    [arrayList sortUsingSelector:@selector(compareKey:)];
+    return arrayList;
+}
+
++ (BOOL)saveArray:(NSArray *)objArray toFile:(NSString *)filePath
+{
+    NSMutableDictionary *dictUUidIndex = [NSMutableDictionary dictionary];
+    NSMutableData *uuidTable = [NSMutableData data];
+    NSMutableData *recordTable = [NSMutableData dataWithCapacity:objArray.count * sizeof(SHServeriBeaconRecord)];
     for (SHServeriBeacon *obj in objArray)
     {
-        [strArray addObject:obj.description];
+        NSNumber *uuidIndex = dictUUidIndex[obj.uuid];
+        if (uuidIndex == nil)
+        {
+            NSUUID *uuid = [[NSUUID alloc] initWithUUIDString:obj.uuid];
+            if (uuid == nil)
+            {
+                continue; //cannot monitor, for example wrong one migrated from previous version.
+            }
+            uuid_t uuidBytes;
+            [uuid getUUIDBytes:uuidBytes];
+            uuidIndex = @(dictUUidIndex.count);
+            dictUUidIndex[obj.uuid] = uuidIndex;
+            [uuidTable appendBytes:uuidBytes length:sizeof(uuid_t)];
+        }
+        SHServeriBeaconRecord record;
+        record.uuidIndex = uuidIndex.unsignedShortValue;
+        record.major = (uint16_t)obj.major;
+        record.minor = (uint16_t)obj.minor;
+        record.reserved = 0;
+        record.serverId = obj.serverId;
+        record.distance = (obj.distance > 0) ? (float)obj.distance : -1;
+        [recordTable appendBytes:&record length:sizeof(record)];
+    }
+    uint32_t header[4] = {APPSTATUS_IBEACON_FILE_MAGIC, APPSTATUS_IBEACON_FILE_VERSION, (uint32_t)dictUUidIndex.count, (uint32_t)(recordTable.length / sizeof(SHServeriBeaconRecord))};
+    NSMutableData *fileData = [NSMutableData dataWithCapacity:sizeof(header) + uuidTable.length + recordTable.length];
+    [fileData appendBytes:header length:sizeof(header)];
+    [fileData appendData:uuidTable];
+    [fileData appendData:recordTable];
+    return [fileData writeToFile:filePath atomically:YES];
+}
+
++ (NSMutableArray *)loadArrayFromFile:(NSString *)filePath
+{
+    NSData *fileData = [NSData dataWithContentsOfFile:filePath];
+    uint32_t header[4];
+    if (fileData == nil || fileData.length < sizeof(header))
+    {
+        return nil;
+    }
+    [fileData getBytes:header length:sizeof(header)];
+    NSUInteger uuidCount = header[2];
+    NSUInteger recordCount = header[3];
+    if (header[0] != APPSTATUS_IBEACON_FILE_MAGIC || header[1] != APPSTATUS_IBEACON_FILE_VERSION || fileData.length != sizeof(header) + uuidCount * sizeof(uuid_t) + recordCount * sizeof(SHServeriBeaconRecord))
+    {
+        SHLog(@"Server iBeacon list file is broken, fetch again.");
+        return nil;
     }
-    return strArray;
+    const unsigned char *uuidTable = (const unsigned char *)fileData.bytes + sizeof(header);
+    NSMutableArray *arrayUUids = [NSMutableArray arrayWithCapacity:uuidCount];
+    for (NSUInteger i = 0; i < uuidCount; i++)
+    {
+        [arrayUUids addObject:[[NSUUID alloc] initWithUUIDBytes:uuidTable + i * sizeof(uuid_t)].UUIDString];
+    }
+    const SHServeriBeaconRecord *records = (const SHServeriBeaconRecord *)(uuidTable + uuidCount * sizeof(uuid_t));
+    NSMutableArray *objArray = [NSMutableArray arrayWithCapacity:recordCount];
+    for (NSUInteger i = 0; i < recordCount; i++)
+    {
+        if (records[i].uuidIndex >= uuidCount)
+        {
+            return nil;
+        }
+        SHServeriBeacon *obj = [[SHServeriBeacon alloc] init];
+        obj.uuid = arrayUUids[records[i].uuidIndex];
+        obj.major = records[i].major;
+        obj.minor = records[i].minor;
+        obj.serverId = records[i].serverId;
+        if (records[i].distance > 0)
+        {
+            obj.distance = records[i].distance;
+        }
+        [objArray addObject:obj];
+    }
+    return objArray; //written from sorted list, still sorted.
 }
 
 + (NSArray *)deserializeToObjArray:(NSArray *)stringArray
@@ -940,4 +1428,196 @@ NSString * const SHAppStatusChangeNotification = @"SHAppStatusChangeNotification
 
 @end
 
+@interface SHServeriBeaconRegistry ()
+
+@property (nonatomic, strong) NSMutableDictionary *dictBuckets; //upper case UUID -> dictionary {`keyForMajor:minor:` -> SHServeriBeacon}
+@property (nonatomic, strong) NSMutableDictionary *dictAll; //upper case UUID -> array of all SHServeriBeacon, including duplicated (major, minor) with another server id.
+@property (nonatomic, strong) NSMutableDictionary *dictInside; //upper case UUID -> set of SHServeriBeacon inside
+@property (nonatomic, strong) NSMutableDictionary *dictCandidate; //upper case UUID -> set of SHServeriBeacon whose `candidateTime` > 0
+
+//Set or clear `candidateTime` and keep `dictCandidate`.
+- (void)setServeriBeacon:(SHServeriBeacon *)serveriBeacon candidateTime:(NSTimeInterval)candidateTime;
+//Whether observation `observeInside` at `now` confirms a transition of `serveriBeacon`. Start or reset waiting if not.
+- (BOOL)confirmServeriBeacon:(SHServeriBeacon *)serveriBeacon observeInside:(BOOL)observeInside atTime:(NSTimeInterval)now;
+
+@end
+
+@implementation SHServeriBeaconRegistry
+
+- (id)initWithServeriBeacons:(NSArray *)arrayServeriBeacons
+{
+    if (self = [super init])
+    {
+        self.dictBuckets = [NSMutableDictionary dictionary];
+        self.dictAll = [NSMutableDictionary dictionary];
+        self.dictInside = [NSMutableDictionary dictionary];
+        self.dictCandidate = [NSMutableDictionary dictionary];
+        self.enterAccuracy = 0;
+        self.exitAccuracy = 0;
+        self.minDwell = 0;
+        for (SHServeriBeacon *serveriBeacon in arrayServeriBeacons)
+        {
+            serveriBeacon.candidateTime = 0; //objects kept from previous registry may wait for transition, but new `dictCandidate` is empty and never clears it, an old observation must not confirm next sighting.
+            NSMutableDictionary *dictBucket = self.dictBuckets[serveriBeacon.uuid];
+            if (dictBucket == nil)
+            {
+                dictBucket = [NSMutableDictionary dictionary];
+                self.dictBuckets[serveriBeacon.uuid] = dictBucket;
+                self.dictAll[serveriBeacon.uuid] = [NSMutableArray array];
+            }
+            [self.dictAll[serveriBeacon.uuid] addObject:serveriBeacon];
+            NSNumber *key = [SHServeriBeacon keyForMajor:serveriBeacon.major minor:serveriBeacon.minor];
+            if (dictBucket[key] != nil)
+            {
+                continue; //same iBeacon with another server id, first one matches as before.
+            }
+            dictBucket[key] = serveriBeacon;
+            if (serveriBeacon.distance > 0)
+            {
+                [self setServeriBeacon:serveriBeacon distance:serveriBeacon.distance];
+            }
+        }
+    }
+    return self;
+}
+
+- (NSArray *)serveriBeaconsForUUid:(NSString *)uuid
+{
+    NSArray *arrayAll = self.dictAll[uuid.uppercaseString];
+    return (arrayAll != nil) ? [NSArray arrayWithArray:arrayAll] : [NSArray array];
+}
+
+- (NSArray *)insideServeriBeaconsForUUid:(NSString *)uuid
+{
+    NSSet *setInside = self.dictInside[uuid.uppercaseString];
+    return (setInside != nil) ? setInside.allObjects : [NSArray array];
+}
+
+- (void)setServeriBeacon:(SHServeriBeacon *)serveriBeacon distance:(double)distance
+{
+    BOOL wasInside = (serveriBeacon.distance > 0);
+    NSTimeInterval changeTime = (serveriBeacon.candidateTime > 0) ? serveriBeacon.candidateTime : [NSDate timeIntervalSinceReferenceDate]; //transition happens when first observed, not when confirmed.
+    if (!wasInside && distance > 0)
+    {
+        serveriBeacon.enterTime = changeTime;
+    }
+    else if (wasInside && distance <= 0)
+    {
+        serveriBeacon.lastDwell = (serveriBeacon.enterTime > 0) ? MAX(0, changeTime - serveriBeacon.enterTime) : 0;
+        serveriBeacon.enterTime = 0;
+    }
+    serveriBeacon.distance = distance;
+    [self setServeriBeacon:serveriBeacon candidateTime:0]; //state decided, not wait anymore
+    NSMutableSet *setInside = self.dictInside[serveriBeacon.uuid];
+    if (distance > 0)
+    {
+        if (setInside == nil)
+        {
+            setInside = [NSMutableSet set];
+            self.dictInside[serveriBeacon.uuid] = setInside;
+        }
+        [setInside addObject:serveriBeacon];
+    }
+    else
+    {
+        [setInside removeObject:serveriBeacon];
+    }
+}
+
+- (void)applyRangedBeacons:(NSArray *)arrayBeacons forUUid:(NSString *)uuid changeIn:(NSMutableArray *)arrayChangeIn changeOut:(NSMutableArray *)arrayChangeOut
+{
+    uuid = uuid.uppercaseString;
+    NSDictionary *dictBucket = self.dictBuckets[uuid];
+    if (dictBucket == nil)
+    {
+        return; //not a server iBeacon region
+    }
+    NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+    NSMutableSet *setNotRanged = [NSMutableSet setWithSet:self.dictInside[uuid]]; //previously inside or waiting, remove those ranged this time, left ones are observed outside.
+    [setNotRanged unionSet:self.dictCandidate[uuid]];
+    for (CLBeacon *iBeacon in arrayBeacons)
+    {
+        NSAssert([iBeacon.proximityUUID.UUIDString compare:uuid options:NSCaseInsensitiveSearch] == NSOrderedSame, @"Range should in same region.");
+        SHServeriBeacon *matchingServeriBeacon = dictBucket[[SHServeriBeacon keyForMajor:iBeacon.major.intValue minor:iBeacon.minor.intValue]];
+        if (matchingServeriBeacon == nil) //possible to monitor other iBeacon not added into streethawk server
+        {
+            continue;
+        }
+        [setNotRanged removeObject:matchingServeriBeacon];
+        BOOL isInside = (matchingServeriBeacon.distance > 0);
+        //different thresholds for enter and exit, so accuracy swinging around one value not flap.
+        BOOL observeInside = isInside ? (self.exitAccuracy <= 0 || iBeacon.accuracy <= self.exitAccuracy) : (self.enterAccuracy <= 0 || (iBeacon.accuracy > 0 && iBeacon.accuracy <= self.enterAccuracy));
+        if ([self confirmServeriBeacon:matchingServeriBeacon observeInside:observeInside atTime:now])
+        {
+            if (isInside) //means newly outside by accuracy
+            {
+                [self setServeriBeacon:matchingServeriBeacon distance:INT64_MIN];
+                [arrayChangeOut addObject:matchingServeriBeacon];
+            }
+            else //means newly inside
+            {
+                [self setServeriBeacon:matchingServeriBeacon distance:(iBeacon.accuracy > 0/*by testing it occassionally negative*/ ? iBeacon.accuracy : 1)]; //self.arrayiBeaconFetchList object's distance also updated
+                [arrayChangeIn addObject:matchingServeriBeacon];
+            }
+        }
+    }
+    for (SHServeriBeacon *serveriBeacon in setNotRanged)
+    {
+        if ([self confirmServeriBeacon:serveriBeacon observeInside:NO atTime:now]) //means newly outside
+        {
+            [self setServeriBeacon:serveriBeacon distance:INT64_MIN];
+            [arrayChangeOut addObject:serveriBeacon];
+        }
+    }
+}
+
+- (void)resetCandidatesForUUid:(NSString *)uuid
+{
+    uuid = uuid.uppercaseString;
+    for (SHServeriBeacon *serveriBeacon in self.dictCandidate[uuid])
+    {
+        serveriBeacon.candidateTime = 0;
+    }
+    [self.dictCandidate removeObjectForKey:uuid];
+}
+
+- (void)setServeriBeacon:(SHServeriBeacon *)serveriBeacon candidateTime:(NSTimeInterval)candidateTime
+{
+    if (serveriBeacon.candidateTime == candidateTime)
+    {
+        return;
+    }
+    serveriBeacon.candidateTime = candidateTime;
+    NSMutableSet *setCandidate = self.dictCandidate[serveriBeacon.uuid];
+    if (candidateTime > 0)
+    {
+        if (setCandidate == nil)
+        {
+            setCandidate = [NSMutableSet set];
+            self.dictCandidate[serveriBeacon.uuid] = setCandidate;
+        }
+        [setCandidate addObject:serveriBeacon];
+    }
+    else
+    {
+        [setCandidate removeObject:serveriBeacon];
+    }
+}
+
+- (BOOL)confirmServeriBeacon:(SHServeriBeacon *)serveriBeacon observeInside:(BOOL)observeInside atTime:(NSTimeInterval)now
+{
+    if (observeInside == (serveriBeacon.distance > 0))
+    {
+        [self setServeriBeacon:serveriBeacon candidateTime:0]; //back to current state before dwell, it was a flap.
+        return NO;
+    }
+    if (serveriBeacon.candidateTime == 0)
+    {
+        [self setServeriBeacon:serveriBeacon candidateTime:now];
+    }
+    return (now - serveriBeacon.candidateTime >= self.minDwell);
+}
+
+@end
+
 #endif
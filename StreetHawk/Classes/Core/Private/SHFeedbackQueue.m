@@ -102,6 +102,7 @@
     NSArray *params = @[@"title", NONULL(feedbackTitle), @"feedback_type", @(feedbackType), @"contents", NONULL(feedbackContent), @"built_at", shFormatStreetHawkDate([NSDate date]), @"anonymous", @"no", @"installid", NONULL(StreetHawk.currentInstall.suid)];
     handler = [handler copy];
     SHRequest *request = [SHRequest requestWithPath:@"feedback/submit/" withVersion:SHHostVersion_V1 withParams:nil withMethod:@"POST" withHeaders:nil withBodyOrStream:params];
+    request.isDurable = YES; //user typed feedback should not lose if offline.
     request.requestHandler = ^(SHRequest *request)
     {
         if (showError)
@@ -20,6 +20,7 @@
 #import "SHInstall.h"
 #import "SHInstallHandler.h"
 #import "SHLogger.h"
+#import "SHRequestJournal.h"
 #import "SHInterceptor.h"
 #import "SHAppStatus.h"
 #import "SHFeedbackQueue.h"
@@ -852,6 +853,8 @@
     }
     //check when App is active
     [self shRegularTask:nil needComplete:NO];
+    //send durable requests left by offline or killed App, reachability not notify if network is already connected when launch.
+    [[SHRequestJournal sharedInstance] replay];
     //check smart push
 #ifdef SH_FEATURE_NOTIFICATION
     NSObject *smartpushObj = [[NSUserDefaults standardUserDefaults] objectForKey:SMART_PUSH_PAYLOAD];
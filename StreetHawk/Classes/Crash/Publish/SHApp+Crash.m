@@ -27,14 +27,18 @@
 #import <mach/mach.h>
 #import <mach/mach_host.h>
 
+#define CRASH_BOUNDARY          @"---------------------------114896232643685925846960113" //multipart boundary, each part starts with "--" + boundary.
+#define CRASH_KEY_LINE          @"CrashReporter Key:   " //line of PLCrashReporter text enriched with install information
+#define CRASH_WRITE_BUFFER      (64 * 1024) //bytes buffered before writing to body file
+
 @interface SHApp (Private)
 
 //Handle install update notification for sending crash report.
 - (void)installUpdateSucceededForCrash:(NSNotification *)aNotification;
-//Get MD5 of a string
-- (NSString*)getMD5Checksum:(NSString*)content;
-//Sends crash report content info to the server.
-- (void)sendCrashReportForInstall:(NSString *)installId withContent:(NSString *)crashReportContent onCrashDate:(NSDate *)crashDate withHandler:(SHCallbackHandler)handler;
+//Write the whole multipart body (header part, crash report, created part) to a new unique temporary file line by line. "TODO" is removed and `CRASH_KEY_LINE` is replaced by `keyLine` on the fly, `md5` is calculated on the raw report before enrichment so it is stable across attempts. Return file path, nil if fail.
+- (NSString *)writeCrashReportBody:(NSString *)crashReport withKeyLine:(NSString *)keyLine onCrashDate:(NSDate *)crashDate md5:(NSString **)md5;
+//Sends crash report body file to the server by streaming it, the file is deleted after request finish.
+- (void)sendCrashReportForInstall:(NSString *)installId withBodyFile:(NSString *)bodyFilePath withHandler:(SHCallbackHandler)handler;
 
 @end
 
@@ -96,6 +100,10 @@
 {
     //note: after install/update, not call "registerForRemoteNotification", because "registerForRemoteNotification" calls install/update after: a)successfully register and get new token; b)unregister and send install/update with revoked.
     //update crash logs if any
+    if (self.isSendingCrashReport)
+    {
+        return; //previous upload is streaming its body file, it purges the report when done or next install update tries again.
+    }
     if ([StreetHawk.crashHandler hasPendingCrashReport])
     {
         NSString *crashReport = [StreetHawk.crashHandler loadPendingCrashReport];
@@ -104,8 +112,7 @@
             [StreetHawk.crashHandler purgePendingCrashReport]; //fail to load, purge to avoid next loading
             return;
         }
-        //PLCrashReporter generates text with "TODO", replace that to be "".
-        crashReport = [crashReport stringByReplacingOccurrencesOfString:@"TODO" withString:@"" options:NSCaseInsensitiveSearch range:NSMakeRange(0, crashReport.length)];
+        //PLCrashReporter generates text with "TODO", it's replaced to be "" when writing body file.
         //Add more information. CrashReporter Key:   [Development platform], [AppStore/Simulator/Other], [SDK Version, e.g. 1/1.3.2], [Install Id, e.g. ABDEF2CBF6CYX927], [battery], [memory]
         //battery
         [UIDevice currentDevice].batteryMonitoringEnabled = YES;
@@ -130,19 +137,25 @@
             natural_t mem_total = mem_used + mem_free;
             memoryUsage = [NSString stringWithFormat:@"used %llu MB free %llu MB total %llu MB", ((mem_used/1024ll)/1024ll), ((mem_free/1024ll)/1024ll), ((mem_total/1024ll)/1024ll)];
         }
-        NSString *infoStr = [NSString stringWithFormat:@"CrashReporter Key:   %@, %@, %@, %@, Battery %@, Memory: %@", shDevelopmentPlatformString(), shAppModeString(shAppMode()), StreetHawk.version, StreetHawk.currentInstall.suid, battery, memoryUsage];
-        crashReport = [crashReport stringByReplacingOccurrencesOfString:@"CrashReporter Key:   " withString:infoStr];
+        NSString *infoStr = [NSString stringWithFormat:@"%@%@, %@, %@, %@, Battery %@, Memory: %@", CRASH_KEY_LINE, shDevelopmentPlatformString(), shAppModeString(shAppMode()), StreetHawk.version, StreetHawk.currentInstall.suid, battery, memoryUsage];
+        NSDate *crashDate = [StreetHawk.crashHandler crashReportDate] == nil ? [NSDate date] : [StreetHawk.crashHandler crashReportDate];
+        //report text is written to body file once, not kept in memory again as replaced string or request body.
+        NSString *md5 = nil;
+        NSString *bodyFilePath = [self writeCrashReportBody:crashReport withKeyLine:infoStr onCrashDate:crashDate md5:&md5];
+        crashReport = nil;
+        if (bodyFilePath == nil)
+        {
+            return; //try again next time
+        }
         //store MD5 in NSUserDefaults and compare with next send to avoid double reporting of crashlogs
-        NSString *md5 = [self getMD5Checksum:crashReport];
         NSString *previousSend = [[NSUserDefaults standardUserDefaults] objectForKey:@"CrashLog_MD5"];
-        if (previousSend != md5)
+        if (![previousSend isEqualToString:md5])
         {
-            NSDate *crashDate = [StreetHawk.crashHandler crashReportDate] == nil ? [NSDate date] : [StreetHawk.crashHandler crashReportDate];
-            [self sendCrashReportForInstall:StreetHawk.currentInstall.suid withContent:crashReport onCrashDate:crashDate withHandler:^(id result, NSError *error)
+            [self sendCrashReportForInstall:StreetHawk.currentInstall.suid withBodyFile:bodyFilePath withHandler:^(id result, NSError *error)
              {
                  if (!error)
                  {
-                     SHLog(@"Crash Log Uploaded: %@", crashReport);
+                     SHLog(@"Crash Log Uploaded: %@", md5);
                      [StreetHawk.crashHandler purgePendingCrashReport]; //OK, load successfully, purge local.
                      [[NSUserDefaults standardUserDefaults] setObject:md5 forKey:@"CrashLog_MD5"];
                  }
@@ -150,49 +163,128 @@
         }
         else
         {
+            [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
             [StreetHawk.crashHandler purgePendingCrashReport]; //Same as before, purge local.
         }
     }
 }
 
-- (NSString*)getMD5Checksum:(NSString*)content
+- (NSString *)writeCrashReportBody:(NSString *)crashReport withKeyLine:(NSString *)keyLine onCrashDate:(NSDate *)crashDate md5:(NSString **)md5
 {
-    const char *cStr = [[NSData dataWithContentsOfFile:content] bytes];
+    NSString *bodyFilePath = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString stringWithFormat:@"StreetHawkCrashReport-%@.body", [NSProcessInfo processInfo].globallyUniqueString]]; //unique so an upload in flight never reads a file rewritten by another call.
+    NSOutputStream *fileStream = [NSOutputStream outputStreamToFileAtPath:bodyFilePath append:NO];
+    [fileStream open];
+    if (fileStream.streamStatus != NSStreamStatusOpen)
+    {
+        SHLog(@"Fail to create crash report body file: %@.", fileStream.streamError);
+        return nil;
+    }
+    __block BOOL isWriteOK = YES;
+    NSMutableData *buffer = [NSMutableData dataWithCapacity:CRASH_WRITE_BUFFER];
+    void (^flushBuffer)(void) = ^
+    {
+        NSUInteger written = 0;
+        while (isWriteOK && written < buffer.length)
+        {
+            NSInteger ret = [fileStream write:(const uint8_t *)buffer.bytes + written maxLength:buffer.length - written];
+            if (ret <= 0)
+            {
+                isWriteOK = NO;
+            }
+            else
+            {
+                written += ret;
+            }
+        }
+        buffer.length = 0;
+    };
+    //header part
+    NSMutableString *enclosingString = [NSMutableString string];
+    [enclosingString appendFormat:@"--%@\r\n", CRASH_BOUNDARY];
+    [enclosingString appendFormat:@"Content-Disposition: form-data; name=\"exception_file\"; filename=\"%@\"\r\n", @"Crash Report"];
+    [enclosingString appendString:@"Content-Type: text/text\r\n\r\n"];
+    [buffer appendData:[enclosingString dataUsingEncoding:NSUTF8StringEncoding]];
+    //crash report, line by line, each line is enriched and converted to UTF-8 independently. MD5 is of raw report before enrichment, key line has battery and memory which change every attempt, so same pending report keeps same MD5.
+    CC_MD5_CTX md5Context;
+    CC_MD5_Init(&md5Context);
+    NSUInteger lineStart = 0;
+    NSUInteger reportLength = crashReport.length;
+    while (lineStart < reportLength)
+    {
+        @autoreleasepool
+        {
+            NSUInteger lineEnd = 0;
+            [crashReport getLineStart:NULL end:&lineEnd contentsEnd:NULL forRange:NSMakeRange(lineStart, 0)];
+            NSString *rawLine = [crashReport substringWithRange:NSMakeRange(lineStart, lineEnd - lineStart)];
+            lineStart = lineEnd;
+            NSData *rawLineData = [rawLine dataUsingEncoding:NSUTF8StringEncoding];
+            CC_MD5_Update(&md5Context, rawLineData.bytes, (CC_LONG)rawLineData.length);
+            NSString *line = rawLine;
+            if ([line rangeOfString:@"TODO" options:NSCaseInsensitiveSearch].location != NSNotFound)
+            {
+                line = [line stringByReplacingOccurrencesOfString:@"TODO" withString:@"" options:NSCaseInsensitiveSearch range:NSMakeRange(0, line.length)];
+            }
+            if ([line rangeOfString:CRASH_KEY_LINE].location != NSNotFound)
+            {
+                line = [line stringByReplacingOccurrencesOfString:CRASH_KEY_LINE withString:keyLine];
+            }
+            NSData *lineData = (line == rawLine) ? rawLineData : [line dataUsingEncoding:NSUTF8StringEncoding];
+            [buffer appendData:lineData];
+            if (buffer.length >= CRASH_WRITE_BUFFER)
+            {
+                flushBuffer();
+            }
+        }
+    }
     unsigned char result[CC_MD5_DIGEST_LENGTH];
-    NSInteger length = [[NSData dataWithContentsOfFile:content] length]; // strlen(cStr);
-    CC_MD5(cStr, (int)length, result);
-    return [NSString stringWithFormat:
-            @"%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X", result[0], result[1], result[2], result[3], result[4], result[5], result[6], result[7], result[8], result[9], result[10], result[11], result[12], result[13], result[14], result[15]];
+    CC_MD5_Final(result, &md5Context);
+    //created part and trailer
+    enclosingString = [NSMutableString string];
+    [enclosingString appendFormat:@"--%@\r\n", CRASH_BOUNDARY];
+    [enclosingString appendString:@"Content-Disposition: form-data; name=\"created\"\r\n\r\n"];
+    [enclosingString appendString:shFormatStreetHawkDate(crashDate)];
+    [enclosingString appendFormat:@"\r\n--%@--", CRASH_BOUNDARY];
+    [buffer appendData:[enclosingString dataUsingEncoding:NSUTF8StringEncoding]];
+    flushBuffer();
+    [fileStream close];
+    if (!isWriteOK)
+    {
+        SHLog(@"Fail to write crash report body file: %@.", fileStream.streamError);
+        [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
+        return nil;
+    }
+    if (md5 != NULL)
+    {
+        *md5 = [NSString stringWithFormat:
+                @"%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X%02X", result[0], result[1], result[2], result[3], result[4], result[5], result[6], result[7], result[8], result[9], result[10], result[11], result[12], result[13], result[14], result[15]];
+    }
+    return bodyFilePath;
 }
 
--(void)sendCrashReportForInstall:(NSString *)installId withContent:(NSString *)crashReportContent onCrashDate:(NSDate *)crashDate withHandler:(SHCallbackHandler)handler
+-(void)sendCrashReportForInstall:(NSString *)installId withBodyFile:(NSString *)bodyFilePath withHandler:(SHCallbackHandler)handler
 {
     if (!streetHawkIsEnabled())
     {
+        [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
         return;
     }
     if (self.isSendingCrashReport)
+    {
+        [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
         return;
+    }
     self.isSendingCrashReport = YES;
     NSString *upload_url = [NSString stringWithFormat:@"installs/%@/crash/", installId];
-    NSMutableData *body = [NSMutableData data];
-    NSMutableString *enclosingString = [NSMutableString string];
-    [enclosingString appendString:@"-----------------------------114896232643685925846960113\r\n"];
-    [enclosingString appendFormat:@"Content-Disposition: form-data; name=\"exception_file\"; filename=\"%@\"\r\n", @"Crash Report"];
-    [enclosingString appendString:@"Content-Type: text/text\r\n\r\n"];
-    [body appendData:[enclosingString dataUsingEncoding:NSUTF8StringEncoding]];
-    [body appendData:[crashReportContent dataUsingEncoding:NSUTF8StringEncoding]];
-    enclosingString = [NSMutableString string];
-    [enclosingString appendString:@"-----------------------------114896232643685925846960113\r\n"];
-    [enclosingString appendString:@"Content-Disposition: form-data; name=\"created\"\r\n\r\n"];
-    [enclosingString appendString:shFormatStreetHawkDate(crashDate)];
-    [enclosingString appendString:@"\r\n-----------------------------114896232643685925846960113--"];
-    [body appendData:[enclosingString dataUsingEncoding:NSUTF8StringEncoding]];
-    NSDictionary *header = @{@"Accept": @"*/*", @"Content-Type": @"multipart/form-data; boundary=---------------------------114896232643685925846960113", @"Content-Length": [NSString stringWithFormat:@"%d", (int)body.length]};
-    SHRequest *request = [SHRequest requestWithPath:upload_url withVersion:SHHostVersion_V1 withParams:nil withMethod:@"POST" withHeaders:header withBodyOrStream:body];
+    unsigned long long bodyLength = [[[NSFileManager defaultManager] attributesOfItemAtPath:bodyFilePath error:nil] fileSize];
+    NSDictionary *header = @{@"Accept": @"*/*", @"Content-Type": [NSString stringWithFormat:@"multipart/form-data; boundary=%@", CRASH_BOUNDARY], @"Content-Length": [NSString stringWithFormat:@"%llu", bodyLength]};
+    //body is streamed from file, not loaded in memory.
+    SHRequest *request = [SHRequest requestWithPath:upload_url withVersion:SHHostVersion_V1 withParams:nil withMethod:@"POST" withHeaders:header withBodyOrStream:[NSInputStream inputStreamWithFileAtPath:bodyFilePath]];
+    request.priority = SHRequestPriority_Bulk; //big upload, must not delay other requests such as push result log.
+    request.bodyStreamFilePath = bodyFilePath; //reopen stream when session resends body.
     handler = [handler copy];
     request.requestHandler = ^(SHRequest *request)
     {
+        [[NSFileManager defaultManager] removeItemAtPath:bodyFilePath error:nil];
         self.isSendingCrashReport = NO;
         if (handler)
         {
@@ -53,10 +53,24 @@
     [[NSUserDefaults standardUserDefaults] synchronize];
     handler = [handler copy];
     SHRequest *fetchRequest = [SHRequest requestWithPath:@"/feed/" withParams:@[@"offset", @(offset)]];
+    fetchRequest.useResponseCache = YES;
+    //create feed objects while the page is downloading, handler only needs to check they are complete.
+    NSMutableArray *arrayStreamedFeeds = [NSMutableArray array];
+    fetchRequest.arrayItemHandler = ^(NSObject *item)
+    {
+        if ([item isKindOfClass:[NSDictionary class]])
+        {
+            [arrayStreamedFeeds addObject:[SHFeedObject createFromDictionary:(NSDictionary *)item]];
+        }
+    };
     fetchRequest.requestHandler = ^(SHRequest *request)
     {
         NSMutableArray *arrayFeeds = [NSMutableArray array];
-        if (request.error == nil)
+        if (request.error == nil && [request.resultValue isKindOfClass:[NSArray class]] && arrayStreamedFeeds.count > 0 && arrayStreamedFeeds.count == ((NSArray *)request.resultValue).count)
+        {
+            [arrayFeeds addObjectsFromArray:arrayStreamedFeeds];
+        }
+        else if (request.error == nil)
         {
             NSAssert([request.resultValue isKindOfClass:[NSArray class]], @"Feed result should be array, got %@.", request.resultValue);
             if ([request.resultValue isKindOfClass:[NSArray class]])
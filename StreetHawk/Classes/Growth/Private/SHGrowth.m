@@ -409,6 +409,7 @@ static const NSString *GrowthServer = @"https://pointzi.streethawk.com";
     handler = [handler copy];
     //Not need to consider offline mode. If device is offline short link cannot redirect to full link and will not pass above check.
     SHRequest *request = [SHRequest requestWithPath:[NSString stringWithFormat:@"%@/increase_clicks/", GrowthServer] withVersion:SHHostVersion_Unknown withParams:nil withMethod:@"POST" withHeaders:nil withBodyOrStream:dictParam];
+    request.isDurable = YES; //click is counted even if server not reachable now.
     request.requestHandler = ^(SHRequest *increaseRequest)
     {
         if (handler)
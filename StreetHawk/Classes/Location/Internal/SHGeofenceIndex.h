@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import <Foundation/Foundation.h>
+#import "SHGeofence.h"
+
+#ifdef SH_FEATURE_GEOFENCE
+
+/**
+ Identifier prefix of regions created by `SHGeofence.region`, used to tell geofence regions from others such as iBeacon regions.
+ */
+extern NSString * const SHGeofenceRegionPrefix;
+
+/**
+ Approximate distance in meters between two coordinates. It uses equirectangular projection, accurate enough for geofence size and much faster than `CLLocation distanceFromLocation:`.
+ */
+double shGeofenceDistance(double lat1, double lng1, double lat2, double lng2);
+
+/**
+ Spatial index of circular geofences. Geofences are put into buckets of a fixed latitude/longitude grid, each one into all cells its circle covers, so nearest and inside queries only visit cells around the location instead of the whole set. Geofences covering too many cells are kept in a separate list checked by every query. Grid wraps at longitude 180, a geofence across it is put into cells on both sides.
+ */
+@interface SHGeofenceIndex : NSObject
+
+/**
+ Build index.
+ @param arrayGeofences Array of `SHGeofence`. Geofence without identifier is ignored. Duplicated identifier is not checked, caller should avoid it.
+ */
+- (id)initWithGeofences:(NSArray *)arrayGeofences;
+
+/**
+ Number of geofences in index.
+ */
+@property (nonatomic, readonly) NSUInteger count;
+
+/**
+ Find geofence by identifier.
+ @return Matching `SHGeofence`, nil if not in index.
+ */
+- (SHGeofence *)geofenceForIdentifier:(NSString *)identifier;
+
+/**
+ Nearest geofences to the location, ordered by distance to circle boundary, geofences containing the location come first.
+ @param count Maximum number to return.
+ @param latitude Location's latitude.
+ @param longitude Location's longitude.
+ @param pFarthestDistance Output distance from the location to boundary of the last returned geofence, can be NULL.
+ @return Array of `SHGeofence`, at most `count`.
+ */
+- (NSArray *)nearestGeofences:(NSUInteger)count toLatitude:(double)latitude longitude:(double)longitude farthestDistance:(double *)pFarthestDistance;
+
+/**
+ Geofences whose circle contains the location.
+ @return Array of `SHGeofence`, empty if not inside any.
+ */
+- (NSArray *)geofencesContainingLatitude:(double)latitude longitude:(double)longitude;
+
+@end
+
+#endif
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import "SHGeofenceIndex.h"
+
+#ifdef SH_FEATURE_GEOFENCE
+
+#define GEOFENCE_CELL_DEGREE            0.02 //grid cell size, about 2.2km in latitude. Most geofences are hundreds of meters so they cover one to four cells.
+#define GEOFENCE_MAX_CELLS              64 //geofence covering more cells than this is kept in large list instead of buckets.
+#define GEOFENCE_METERS_PER_DEGREE      111195.0 //earth radius 6371km * pi / 180
+#define GEOFENCE_MIN_COS                0.01 //avoid divide by zero near poles
+#define GEOFENCE_LNG_CELLS              18000 //360 / GEOFENCE_CELL_DEGREE, cell x wraps by this so longitude -180 and 180 are neighbours.
+
+NSString * const SHGeofenceRegionPrefix = @"SHGeofence-";
+
+double shGeofenceDistance(double lat1, double lng1, double lat2, double lng2)
+{
+    double dLng = lng2 - lng1;
+    if (dLng > 180)
+    {
+        dLng -= 360;
+    }
+    else if (dLng < -180)
+    {
+        dLng += 360;
+    }
+    double x = dLng * cos((lat1 + lat2) / 2 * M_PI / 180);
+    double y = lat2 - lat1;
+    return sqrt(x * x + y * y) * GEOFENCE_METERS_PER_DEGREE;
+}
+
+//Key of grid cell (x, y) in `dictCells`. x is wrapped into [0, GEOFENCE_LNG_CELLS) so cells across longitude 180 map to the same key.
+static inline NSNumber *shGeofenceCellKey(int x, int y)
+{
+    x = ((x % GEOFENCE_LNG_CELLS) + GEOFENCE_LNG_CELLS) % GEOFENCE_LNG_CELLS;
+    return @(((long long)y << 32) | (uint32_t)x);
+}
+
+//Cell index of a latitude or longitude.
+static inline int shGeofenceCell(double degree)
+{
+    return (int)floor(degree / GEOFENCE_CELL_DEGREE);
+}
+
+@interface SHGeofenceIndex ()
+
+@property (nonatomic, strong) NSArray *arrayAll; //all SHGeofence
+@property (nonatomic, strong) NSMutableDictionary *dictIdentifier; //identifier -> SHGeofence
+@property (nonatomic, strong) NSMutableDictionary *dictCells; //`shGeofenceCellKey` -> array of SHGeofence covering the cell
+@property (nonatomic, strong) NSMutableArray *arrayLarge; //SHGeofence covering more than GEOFENCE_MAX_CELLS, checked by every query
+@property (nonatomic) int minCellY; //latitude extent of occupied cells, ring search stops when it covers all. Longitude wraps so it has no extent.
+@property (nonatomic) int maxCellY;
+
+//Insert `geofence` into sorted `arrayNearest` of @[distance, SHGeofence] if it's among nearest `count`, skip if already visited.
+- (void)addCandidate:(SHGeofence *)geofence toNearest:(NSMutableArray *)arrayNearest visited:(NSMutableSet *)setVisited count:(NSUInteger)count latitude:(double)latitude longitude:(double)longitude;
+
+@end
+
+@implementation SHGeofenceIndex
+
+- (id)initWithGeofences:(NSArray *)arrayGeofences
+{
+    if (self = [super init])
+    {
+        self.arrayAll = [arrayGeofences filteredArrayUsingPredicate:[NSPredicate predicateWithFormat:@"identifier.length > 0"]]; //identifier is needed for region
+        self.dictIdentifier = [NSMutableDictionary dictionaryWithCapacity:self.arrayAll.count];
+        self.dictCells = [NSMutableDictionary dictionary];
+        self.arrayLarge = [NSMutableArray array];
+        self.minCellY = INT_MAX;
+        self.maxCellY = INT_MIN;
+        for (SHGeofence *geofence in self.arrayAll)
+        {
+            self.dictIdentifier[geofence.identifier] = geofence;
+            double dLat = geofence.radius / GEOFENCE_METERS_PER_DEGREE;
+            double dLng = geofence.radius / (GEOFENCE_METERS_PER_DEGREE * MAX(GEOFENCE_MIN_COS, cos(geofence.latitude * M_PI / 180)));
+            int x1 = shGeofenceCell(geofence.longitude - dLng);
+            int x2 = shGeofenceCell(geofence.longitude + dLng);
+            int y1 = shGeofenceCell(geofence.latitude - dLat);
+            int y2 = shGeofenceCell(geofence.latitude + dLat);
+            if ((long long)(x2 - x1 + 1) * (y2 - y1 + 1) > GEOFENCE_MAX_CELLS)
+            {
+                [self.arrayLarge addObject:geofence];
+                continue;
+            }
+            for (int y = y1; y <= y2; y++)
+            {
+                for (int x = x1; x <= x2; x++)
+                {
+                    NSNumber *cellKey = shGeofenceCellKey(x, y);
+                    NSMutableArray *arrayCell = self.dictCells[cellKey];
+                    if (arrayCell == nil)
+                    {
+                        arrayCell = [NSMutableArray array];
+                        self.dictCells[cellKey] = arrayCell;
+                    }
+                    [arrayCell addObject:geofence];
+                }
+            }
+            self.minCellY = MIN(self.minCellY, y1);
+            self.maxCellY = MAX(self.maxCellY, y2);
+        }
+    }
+    return self;
+}
+
+- (NSUInteger)count
+{
+    return self.arrayAll.count;
+}
+
+- (SHGeofence *)geofenceForIdentifier:(NSString *)identifier
+{
+    return (identifier != nil) ? self.dictIdentifier[identifier] : nil;
+}
+
+- (NSArray *)nearestGeofences:(NSUInteger)count toLatitude:(double)latitude longitude:(double)longitude farthestDistance:(double *)pFarthestDistance
+{
+    NSMutableArray *arrayNearest = [NSMutableArray arrayWithCapacity:count + 1];
+    NSMutableSet *setVisited = [NSMutableSet set];
+    if (count > 0)
+    {
+        for (SHGeofence *geofence in self.arrayLarge)
+        {
+            [self addCandidate:geofence toNearest:arrayNearest visited:setVisited count:count latitude:latitude longitude:longitude];
+        }
+        int cx = shGeofenceCell(longitude);
+        int cy = shGeofenceCell(latitude);
+        __block NSUInteger visitedCells = 0;
+        void (^visitCell)(int, int) = ^(int x, int y)
+        {
+            visitedCells++;
+            for (SHGeofence *geofence in self.dictCells[shGeofenceCellKey(x, y)])
+            {
+                [self addCandidate:geofence toNearest:arrayNearest visited:setVisited count:count latitude:latitude longitude:longitude];
+            }
+        };
+        for (int r = 0; self.dictCells.count > 0; r++)
+        {
+            BOOL isFullScan = (2 * r + 1 >= GEOFENCE_LNG_CELLS && cy - r <= self.minCellY && cy + r >= self.maxCellY); //ring covers all occupied cells, every geofence is visited after this ring.
+            //visit cells of ring r, clipped to occupied latitude extent. x is not clipped, `shGeofenceCellKey` wraps it across longitude 180.
+            for (int y = MAX(cy - r, self.minCellY); y <= MIN(cy + r, self.maxCellY); y++)
+            {
+                if (y == cy - r || y == cy + r)
+                {
+                    for (int x = cx - r; x <= cx + r; x++)
+                    {
+                        visitCell(x, y);
+                    }
+                }
+                else
+                {
+                    visitCell(cx - r, y);
+                    visitCell(cx + r, y);
+                }
+            }
+            if (isFullScan)
+            {
+                break;
+            }
+            //geofence not visited yet covers no cell within ring r, its boundary is at least r cells away.
+            double ringDistance = r * GEOFENCE_CELL_DEGREE * GEOFENCE_METERS_PER_DEGREE * MAX(GEOFENCE_MIN_COS, cos(MIN(90, fabs(latitude) + (r + 1) * GEOFENCE_CELL_DEGREE) * M_PI / 180));
+            if (arrayNearest.count >= count && [arrayNearest.lastObject[0] doubleValue] <= ringDistance)
+            {
+                break;
+            }
+            if (visitedCells >= self.dictCells.count)
+            {
+                //location is far from geofences, rings are mostly empty. Scan all instead of walking more rings.
+                for (SHGeofence *geofence in self.arrayAll)
+                {
+                    [self addCandidate:geofence toNearest:arrayNearest visited:setVisited count:count latitude:latitude longitude:longitude];
+                }
+                break;
+            }
+        }
+    }
+    if (pFarthestDistance != NULL)
+    {
+        *pFarthestDistance = (arrayNearest.count > 0) ? [arrayNearest.lastObject[0] doubleValue] : 0;
+    }
+    NSMutableArray *arrayResult = [NSMutableArray arrayWithCapacity:arrayNearest.count];
+    for (NSArray *pair in arrayNearest)
+    {
+        [arrayResult addObject:pair[1]];
+    }
+    return arrayResult;
+}
+
+- (NSArray *)geofencesContainingLatitude:(double)latitude longitude:(double)longitude
+{
+    NSMutableArray *arrayInside = [NSMutableArray array];
+    NSArray *arrayCell = self.dictCells[shGeofenceCellKey(shGeofenceCell(longitude), shGeofenceCell(latitude))];
+    for (NSArray *arrayCheck in @[arrayCell != nil ? arrayCell : @[], self.arrayLarge])
+    {
+        for (SHGeofence *geofence in arrayCheck)
+        {
+            if (shGeofenceDistance(latitude, longitude, geofence.latitude, geofence.longitude) <= geofence.radius)
+            {
+                [arrayInside addObject:geofence];
+            }
+        }
+    }
+    return arrayInside;
+}
+
+#pragma mark - private functions
+
+- (void)addCandidate:(SHGeofence *)geofence toNearest:(NSMutableArray *)arrayNearest visited:(NSMutableSet *)setVisited count:(NSUInteger)count latitude:(double)latitude longitude:(double)longitude
+{
+    if ([setVisited containsObject:geofence])
+    {
+        return; //geofence covers several cells
+    }
+    [setVisited addObject:geofence];
+    double distance = shGeofenceDistance(latitude, longitude, geofence.latitude, geofence.longitude) - geofence.radius;
+    if (arrayNearest.count >= count && distance >= [arrayNearest.lastObject[0] doubleValue])
+    {
+        return;
+    }
+    NSArray *pair = @[@(distance), geofence];
+    NSUInteger index = [arrayNearest indexOfObject:pair inSortedRange:NSMakeRange(0, arrayNearest.count) options:NSBinarySearchingInsertionIndex usingComparator:^NSComparisonResult(NSArray *pair1, NSArray *pair2)
+    {
+        return [pair1[0] compare:pair2[0]];
+    }];
+    [arrayNearest insertObject:pair atIndex:index];
+    if (arrayNearest.count > count)
+    {
+        [arrayNearest removeLastObject];
+    }
+}
+
+@end
+
+#endif
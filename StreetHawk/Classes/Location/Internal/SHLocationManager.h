@@ -241,4 +241,26 @@ A core class to monitor location change. By default process of StreetHawk SDK, i
 
 #endif
 
+#ifdef SH_FEATURE_GEOFENCE
+
+/** @name Geofence */
+
+/**
+ System can only monitor 20 regions for one App, including iBeacon regions, while campaigns can have thousands of geofences. The full set is kept locally in a spatial index: when location updates and device moves far enough, nearest `maxMonitoredGeofences` geofences are selected to monitor by system so App is woken up near them; on every location update SDK checks which geofences contain the location by itself. Enter and exit are notified by `SHLMEnterGeofenceNotification` and `SHLMExitGeofenceNotification`.
+ @param arrayGeofences Array of `SHGeofence`, replaces previous set. Empty or nil to stop monitoring all geofences.
+ */
+- (void)setGeofences:(NSArray *)arrayGeofences;
+
+/**
+ Maximum number of nearest geofences monitored by system. Keep room for iBeacon regions, system limit is 20. Default is 15.
+ */
+@property (nonatomic) NSUInteger maxMonitoredGeofences;
+
+/**
+ Geofences containing current location, array of `SHGeofence`.
+ */
+@property (nonatomic, readonly) NSArray *insideGeofences;
+
+#endif
+
 @end
@@ -21,6 +21,8 @@
 #import "SHAppStatus.h" //for check streethawkEnabled
 #import "SHLogger.h" //for sending logline
 #import "SHUtils.h" //for streetHawkIsEnabled
+#import "SHRequestJournal.h" //for SHNetworkRecoverNotification
+#import "SHGeofenceIndex.h" //for geofence selection and inside check
 //header from System
 #import <CoreBluetooth/CoreBluetooth.h>
 #import <UIKit/UIKit.h> //for `[UIApplication sharedApplication]`
@@ -29,6 +31,8 @@
 
 #define LOCATION_DENIED_SENT        @"LOCATION_DENIED_SENT" //a flag indicates this App has sent location denied log to avoid send one more time.
 #define NETWORK_RECOVER_TIME        @"NETWORK_RECOVER_TIME" //Record time when network from not-connected to connected(either cellura or Wifi). If it's 0 means current network not connected; if it's number means last time from non-connected to connected.
+#define GEOFENCE_DEFAULT_MONITOR_COUNT  15 //default `maxMonitoredGeofences`, system allows 20 regions including iBeacon.
+#define GEOFENCE_MIN_REFRESH_DISTANCE   100 //meters, select monitored geofences again only after moving at least this.
 
 @interface SHLocationManager()
 
@@ -42,7 +46,7 @@
 - (void)sendGeoLocationUpdate;
 
 - (NSString *)formatBeaconRegion:(CLBeaconRegion *)region;  //format beacon region to a string in format UUID-major-minor-identifier.
-- (BOOL)isRegionSame:(CLRegion *)r1 with:(CLRegion *)r2;  //compare two iBeacon region is same.
+- (BOOL)isRegionSame:(CLRegion *)r1 with:(CLRegion *)r2;  //compare two iBeacon region or geofence region is same.
 
 @property (nonatomic, strong) CBCentralManager *bluetoothManager; //report bluetooth status to detech iBeacon, only initialized for iOS 7.0 above.
 - (void)createBluetoothManager;
@@ -52,6 +56,16 @@
 - (void)networkStatusChanged:(NSNotification *)notification; //handle for notification for network status change.
 - (BOOL)updateRecoverTime; //update NETWORK_RECOVER_TIME value. Return YES if connect and non-connect change.
 
+#ifdef SH_FEATURE_GEOFENCE
+@property (nonatomic, strong) SHGeofenceIndex *geofenceIndex; //index of full set from `setGeofences:`, nil if not set.
+@property (nonatomic) CLLocationCoordinate2D geofenceSelectLocation; //location when monitored geofences are selected, (0, 0) means select again at next update.
+@property (nonatomic) double geofenceRefreshDistance; //meters to move from `geofenceSelectLocation` before select again, half distance to the farthest monitored geofence.
+@property (nonatomic, strong) NSMutableDictionary *dictInsideGeofences; //identifier -> SHGeofence containing current location.
+- (void)updateGeofencesForLocation:(CLLocationCoordinate2D)location accuracy:(CLLocationAccuracy)accuracy; //check inside with fix accurate enough and select monitored geofences again if moved far enough.
+- (void)selectMonitoredGeofencesForLocation:(CLLocationCoordinate2D)location; //monitor nearest geofences and stop others.
+- (void)setGeofence:(SHGeofence *)geofence inside:(BOOL)isInside; //update `dictInsideGeofences` and send notification if state changes.
+#endif
+
 @end
 
 @implementation SHLocationManager
@@ -75,6 +89,12 @@
         [self createLocationManager];
         [self createBluetoothManager];
         [self createNetworkMonitor];
+#ifdef SH_FEATURE_GEOFENCE
+        self.maxMonitoredGeofences = GEOFENCE_DEFAULT_MONITOR_COUNT;
+        self.geofenceSelectLocation = CLLocationCoordinate2DMake(0, 0);
+        self.geofenceRefreshDistance = 0;
+        self.dictInsideGeofences = [NSMutableDictionary dictionary];
+#endif
     }
     return self;
 }
@@ -510,6 +530,42 @@
 
 #endif
 
+#ifdef SH_FEATURE_GEOFENCE
+
+- (void)setGeofences:(NSArray *)arrayGeofences
+{
+    //copy so caller changing `SHGeofence` later does not make index out of date.
+    NSMutableArray *arrayCopy = [NSMutableArray arrayWithCapacity:arrayGeofences.count];
+    for (SHGeofence *geofence in arrayGeofences)
+    {
+        [arrayCopy addObject:[SHGeofence geofenceWithIdentifier:[geofence.identifier copy] latitude:geofence.latitude longitude:geofence.longitude radius:geofence.radius]];
+    }
+    self.geofenceIndex = (arrayCopy.count > 0) ? [[SHGeofenceIndex alloc] initWithGeofences:arrayCopy] : nil;
+    for (SHGeofence *insideGeofence in [self.dictInsideGeofences allValues])
+    {
+        if ([self.geofenceIndex geofenceForIdentifier:insideGeofence.identifier] == nil) //removed while inside
+        {
+            [self setGeofence:insideGeofence inside:NO];
+        }
+    }
+    self.geofenceSelectLocation = CLLocationCoordinate2DMake(0, 0); //select again with new set
+    if (self.geofenceIndex == nil)
+    {
+        [self selectMonitoredGeofencesForLocation:self.currentGeoLocation]; //stop all monitored geofences
+    }
+    else if (self.currentGeoLocation.latitude != 0 && self.currentGeoLocation.longitude != 0)
+    {
+        [self updateGeofencesForLocation:self.currentGeoLocation accuracy:(self.locationManager.location != nil ? self.locationManager.location.horizontalAccuracy : -1)];
+    }
+}
+
+- (NSArray *)insideGeofences
+{
+    return [self.dictInsideGeofences allValues];
+}
+
+#endif
+
 #pragma mark - private functions
 
 - (double)distanceSquaredForLat1:(double)lat1 lng1:(double)lng1 lat2:(double)lat2 lng2:(double)lng2
@@ -550,6 +606,94 @@
     }
 }
 
+#ifdef SH_FEATURE_GEOFENCE
+
+- (void)updateGeofencesForLocation:(CLLocationCoordinate2D)location accuracy:(CLLocationAccuracy)accuracy
+{
+    if (self.geofenceIndex == nil)
+    {
+        return;
+    }
+    //point-in-fence check only visits grid cell of the location, not all geofences. A fix whose error is not smaller than the fence radius cannot tell inside from outside, it would flip the state `didEnterRegion:`/`didExitRegion:` just set and send duplicated enter/exit, so leave such fence to system region events.
+    BOOL isValidAccuracy = (accuracy >= 0);
+    NSArray *arrayInside = isValidAccuracy ? [self.geofenceIndex geofencesContainingLatitude:location.latitude longitude:location.longitude] : @[];
+    NSMutableSet *setInsideIds = [NSMutableSet setWithCapacity:arrayInside.count];
+    for (SHGeofence *geofence in arrayInside)
+    {
+        [setInsideIds addObject:geofence.identifier];
+        if (accuracy < geofence.radius)
+        {
+            [self setGeofence:geofence inside:YES];
+        }
+    }
+    for (SHGeofence *insideGeofence in [self.dictInsideGeofences allValues])
+    {
+        if (isValidAccuracy && accuracy < insideGeofence.radius && ![setInsideIds containsObject:insideGeofence.identifier])
+        {
+            [self setGeofence:insideGeofence inside:NO];
+        }
+    }
+    if ((self.geofenceSelectLocation.latitude == 0 && self.geofenceSelectLocation.longitude == 0)
+        || shGeofenceDistance(location.latitude, location.longitude, self.geofenceSelectLocation.latitude, self.geofenceSelectLocation.longitude) >= self.geofenceRefreshDistance)
+    {
+        [self selectMonitoredGeofencesForLocation:location];
+    }
+}
+
+- (void)selectMonitoredGeofencesForLocation:(CLLocationCoordinate2D)location
+{
+    double farthestDistance = 0;
+    NSArray *arrayNearest = [self.geofenceIndex nearestGeofences:self.maxMonitoredGeofences toLatitude:location.latitude longitude:location.longitude farthestDistance:&farthestDistance];
+    NSMutableDictionary *dictSelected = [NSMutableDictionary dictionaryWithCapacity:arrayNearest.count]; //region identifier -> SHGeofence
+    for (SHGeofence *geofence in arrayNearest)
+    {
+        dictSelected[[SHGeofenceRegionPrefix stringByAppendingString:geofence.identifier]] = geofence;
+    }
+    //only touch geofence regions, keep iBeacon and other regions. A monitored one still selected is not started again.
+    for (CLRegion *monitoredRegion in self.locationManager.monitoredRegions.allObjects)
+    {
+        if ([monitoredRegion.identifier hasPrefix:SHGeofenceRegionPrefix])
+        {
+            SHGeofence *selectedGeofence = dictSelected[monitoredRegion.identifier];
+            if (selectedGeofence != nil && [self isRegionSame:monitoredRegion with:selectedGeofence.region])
+            {
+                [dictSelected removeObjectForKey:monitoredRegion.identifier];
+            }
+            else
+            {
+                [self stopMonitorRegion:monitoredRegion]; //not nearest anymore, or geofence changed with same identifier.
+            }
+        }
+    }
+    for (SHGeofence *geofence in [dictSelected allValues])
+    {
+        [self startMonitorRegion:geofence.region];
+    }
+    self.geofenceSelectLocation = location;
+    self.geofenceRefreshDistance = MAX(GEOFENCE_MIN_REFRESH_DISTANCE, farthestDistance / 2); //after moving half way to the farthest one, a not monitored geofence may become nearer.
+}
+
+- (void)setGeofence:(SHGeofence *)geofence inside:(BOOL)isInside
+{
+    if (isInside == (self.dictInsideGeofences[geofence.identifier] != nil))
+    {
+        return;
+    }
+    if (isInside)
+    {
+        self.dictInsideGeofences[geofence.identifier] = geofence;
+    }
+    else
+    {
+        [self.dictInsideGeofences removeObjectForKey:geofence.identifier];
+    }
+    SHLog(@"LocationManager: %@ %@.", isInside ? @"Enter" : @"Exit", geofence);
+    NSDictionary *userInfo = @{SHLMNotification_kRegion: geofence.region};
+    [[NSNotificationCenter defaultCenter] postNotificationName:(isInside ? SHLMEnterGeofenceNotification : SHLMExitGeofenceNotification) object:self userInfo:userInfo];
+}
+
+#endif
+
 - (NSString *)formatBeaconRegion:(CLBeaconRegion *)region
 {
     //major and minor can be null or int value, int value is from 0~65535. Check nil as nil.intValue=0.
@@ -570,7 +714,7 @@
     {
         return YES;
     }
-    //Only consider Beacon region so far, other kind of CLRegion treat as not equal. CLBeaconRegion isEqual is not correct, it compares memory, for example, after I change UUID it still return equal. So compare beacon region manually.
+    //Consider Beacon region and geofence region, other kind of CLRegion treat as not equal. CLBeaconRegion isEqual is not correct, it compares memory, for example, after I change UUID it still return equal. So compare beacon region manually.
     if (r1 != nil && r2 != nil && [r1 isKindOfClass:[CLBeaconRegion class]] && [r2 isKindOfClass:[CLBeaconRegion class]])
     {
         CLBeaconRegion *br1 = (CLBeaconRegion *)r1;
@@ -590,6 +734,16 @@
             }
         }
     }
+#ifdef SH_FEATURE_GEOFENCE
+    //Geofence region is CLCircularRegion since iOS 7.0 or CLRegion before, compare by identifier, center and radius.
+    if (r1 != nil && r2 != nil && ![r1 isKindOfClass:[CLBeaconRegion class]] && ![r2 isKindOfClass:[CLBeaconRegion class]] && [r1.identifier hasPrefix:SHGeofenceRegionPrefix])
+    {
+        if ([r1.identifier compare:r2.identifier options:NSCaseInsensitiveSearch] == NSOrderedSame)
+        {
+            return [[r1 valueForKey:@"radius"] isEqual:[r2 valueForKey:@"radius"]] && [[r1 valueForKey:@"center"] isEqual:[r2 valueForKey:@"center"]];
+        }
+    }
+#endif
     return NO;
 }
 
@@ -598,6 +752,10 @@
     if ([self updateRecoverTime]) //avoid 3G to Wifi two switch
     {
         [self sendGeoLocationUpdate]; //when network recover check whether need to send location update.
+        if (self.reachability.currentReachabilityStatus != NotReachable)
+        {
+            [[NSNotificationCenter defaultCenter] postNotificationName:SHNetworkRecoverNotification object:nil]; //durable requests failed offline can be sent now.
+        }
     }
 }
 
@@ -652,6 +810,9 @@
         NSDictionary *userInfo = @{SHLMNotification_kNewLocation:locations[0], SHLMNotification_kOldLocation: oldLocation};
         NSNotification *notification = [NSNotification notificationWithName:SHLMUpdateLocationSuccessNotification object:self userInfo:userInfo];
         [[NSNotificationCenter defaultCenter] postNotification:notification];
+#ifdef SH_FEATURE_GEOFENCE
+        [self updateGeofencesForLocation:self.currentGeoLocationValue accuracy:((CLLocation *)locations[0]).horizontalAccuracy];
+#endif
     }
 }
 
@@ -698,6 +859,16 @@
     NSDictionary *userInfo = @{SHLMNotification_kRegion: region};
     NSNotification *notification = [NSNotification notificationWithName:SHLMEnterRegionNotification object:self userInfo:userInfo];
     [[NSNotificationCenter defaultCenter] postNotification:notification];
+#ifdef SH_FEATURE_GEOFENCE
+    if ([region.identifier hasPrefix:SHGeofenceRegionPrefix]) //system wakes App near a monitored geofence, location update may not come in background.
+    {
+        SHGeofence *geofence = [self.geofenceIndex geofenceForIdentifier:[region.identifier substringFromIndex:SHGeofenceRegionPrefix.length]];
+        if (geofence != nil)
+        {
+            [self setGeofence:geofence inside:YES];
+        }
+    }
+#endif
 }
 
 - (void)locationManager:(CLLocationManager *)manager didExitRegion:(CLRegion *)region
@@ -714,6 +885,16 @@
     NSDictionary *userInfo = @{SHLMNotification_kRegion: region};
     NSNotification *notification = [NSNotification notificationWithName:SHLMExitRegionNotification object:self userInfo:userInfo];
     [[NSNotificationCenter defaultCenter] postNotification:notification];
+#ifdef SH_FEATURE_GEOFENCE
+    if ([region.identifier hasPrefix:SHGeofenceRegionPrefix])
+    {
+        SHGeofence *geofence = [self.geofenceIndex geofenceForIdentifier:[region.identifier substringFromIndex:SHGeofenceRegionPrefix.length]];
+        if (geofence != nil)
+        {
+            [self setGeofence:geofence inside:NO];
+        }
+    }
+#endif
 }
 
 - (void)locationManager:(CLLocationManager *)manager didStartMonitoringForRegion:(CLRegion *)region
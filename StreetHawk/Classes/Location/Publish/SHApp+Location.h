@@ -16,6 +16,9 @@
  */
 
 #import "SHApp.h" //for extension SHApp
+#ifdef SH_FEATURE_GEOFENCE
+#import "SHGeofence.h" //for geofence API
+#endif
 
 /**
  Notification sent when start standard geolocation monitor, called by `startMonitorGeoLocationStandard:YES`. UserInfo is nil. Use `geolocationMonitorState` to know current geo location state.
@@ -111,6 +114,16 @@ extern NSString * const SHLMRangeiBeaconFailNotification;
  */
 extern NSString * const SHLMChangeAuthorizationStatusNotification;
 
+/**
+ Notification sent when device enters one geofence set by `StreetHawk setGeofences:`. It's decided by SDK checking location against the full geofence set, or by system region event of nearest monitored geofences, sent once for one enter. SDK only checks location whose horizontal accuracy is smaller than the geofence radius, coarse fix leaves the state to system region event. The user information contains `SHLMNotification_kRegion` representing CLRegion of the geofence.
+ */
+extern NSString * const SHLMEnterGeofenceNotification;
+
+/**
+ Notification sent when device exits one geofence set by `StreetHawk setGeofences:`, or the geofence is removed while inside. The user information contains `SHLMNotification_kRegion` representing CLRegion of the geofence.
+ */
+extern NSString * const SHLMExitGeofenceNotification;
+
 /**
  Keys for StreetHawkLocation notifications.
  */
@@ -153,5 +166,20 @@ extern NSString * const SHLMNotification_kAuthStatus;  //string @"AuthStatus", g
  */
 @property (nonatomic, readonly) BOOL systemPreferenceDisableLocation;
 
+#ifdef SH_FEATURE_GEOFENCE
+
+/**
+ Set the full geofence set to monitor, it can be far more than the 20 regions system allows. SDK monitors nearest ones by system and checks the rest against location by itself, enter and exit are notified by `SHLMEnterGeofenceNotification` and `SHLMExitGeofenceNotification`. Geofences are copied, changing `SHGeofence` after this call has no effect until set again.
+ @param arrayGeofences Array of `SHGeofence`, replaces previous set. Empty or nil to stop monitoring all geofences.
+ */
+- (void)setGeofences:(NSArray *)arrayGeofences;
+
+/**
+ Geofences containing current location, array of `SHGeofence`.
+ */
+@property (nonatomic, readonly) NSArray *insideGeofences;
+
+#endif
+
 @end
 
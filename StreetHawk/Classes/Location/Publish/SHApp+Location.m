@@ -41,6 +41,8 @@ NSString * const SHLMMonitorRegionFailNotification = @"SHLMMonitorRegionFailNoti
 NSString * const SHLMRangeiBeaconChangedNotification = @"SHLMRangeiBeaconChangedNotification";
 NSString * const SHLMRangeiBeaconFailNotification = @"SHLMRangeiBeaconFailNotification";
 NSString * const SHLMChangeAuthorizationStatusNotification = @"SHLMChangeAuthorizationStatusNotification";
+NSString * const SHLMEnterGeofenceNotification = @"SHLMEnterGeofenceNotification";
+NSString * const SHLMExitGeofenceNotification = @"SHLMExitGeofenceNotification";
 
 NSString * const SHLMNotification_kNewLocation = @"NewLocation";
 NSString * const SHLMNotification_kOldLocation = @"OldLocation";
@@ -60,6 +62,9 @@ NSString * const SHLMNotification_kAuthStatus = @"AuthStatus";
 @dynamic isLocationServiceEnabled;
 @dynamic locationManager;
 @dynamic systemPreferenceDisableLocation;
+#ifdef SH_FEATURE_GEOFENCE
+@dynamic insideGeofences;
+#endif
 
 - (BOOL)isDefaultLocationServiceEnabled
 {
@@ -128,4 +133,18 @@ NSString * const SHLMNotification_kAuthStatus = @"AuthStatus";
     return (globalDisable || appDisable);
 }
 
+#ifdef SH_FEATURE_GEOFENCE
+
+- (void)setGeofences:(NSArray *)arrayGeofences
+{
+    [self.locationManager setGeofences:arrayGeofences];
+}
+
+- (NSArray *)insideGeofences
+{
+    return self.locationManager.insideGeofences;
+}
+
+#endif
+
 @end
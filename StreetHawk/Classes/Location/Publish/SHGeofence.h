@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import <Foundation/Foundation.h>
+#import <CoreLocation/CoreLocation.h>
+
+#ifdef SH_FEATURE_GEOFENCE
+
+/**
+ One circular geofence for `[StreetHawk setGeofences:]`. The full set can be thousands, far more than system can monitor, SDK keeps them in a spatial index, monitors nearest ones and checks inside by itself.
+ */
+@interface SHGeofence : NSObject
+
+/**
+ Unique identifier of this geofence, must not be empty. Monitored region's identifier is it with prefix "SHGeofence-".
+ */
+@property (nonatomic, strong) NSString *identifier;
+
+/**
+ Center latitude.
+ */
+@property (nonatomic) double latitude;
+
+/**
+ Center longitude.
+ */
+@property (nonatomic) double longitude;
+
+/**
+ Radius in meters.
+ */
+@property (nonatomic) double radius;
+
+/**
+ Create geofence.
+ */
++ (SHGeofence *)geofenceWithIdentifier:(NSString *)identifier latitude:(double)latitude longitude:(double)longitude radius:(double)radius;
+
+/**
+ Create region to monitor by system, also the region in `SHLMEnterGeofenceNotification` and `SHLMExitGeofenceNotification`. Its identifier is "SHGeofence-" + `identifier`.
+ */
+- (CLRegion *)region;
+
+@end
+
+#endif
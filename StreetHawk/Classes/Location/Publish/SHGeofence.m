@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) StreetHawk, All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 3.0 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library.
+ */
+
+#import "SHGeofence.h"
+//header from StreetHawk
+#import "SHGeofenceIndex.h" //for SHGeofenceRegionPrefix
+
+#ifdef SH_FEATURE_GEOFENCE
+
+@implementation SHGeofence
+
++ (SHGeofence *)geofenceWithIdentifier:(NSString *)identifier latitude:(double)latitude longitude:(double)longitude radius:(double)radius
+{
+    SHGeofence *geofence = [[SHGeofence alloc] init];
+    geofence.identifier = identifier;
+    geofence.latitude = latitude;
+    geofence.longitude = longitude;
+    geofence.radius = radius;
+    return geofence;
+}
+
+- (CLRegion *)region
+{
+    NSString *regionId = [SHGeofenceRegionPrefix stringByAppendingString:self.identifier];
+    CLLocationCoordinate2D center = CLLocationCoordinate2DMake(self.latitude, self.longitude);
+    Class circularRegionClass = NSClassFromString(@"CLCircularRegion"); //since iOS 7.0
+    if (circularRegionClass != nil)
+    {
+        return [[circularRegionClass alloc] initWithCenter:center radius:self.radius identifier:regionId];
+    }
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+    return [[CLRegion alloc] initCircularRegionWithCenter:center radius:self.radius identifier:regionId];
+#pragma clang diagnostic pop
+}
+
+- (NSString *)description
+{
+    return [NSString stringWithFormat:@"Geofence %@: (%f, %f) ~ %.0fm", self.identifier, self.latitude, self.longitude, self.radius];
+}
+
+@end
+
+#endif
@@ -370,6 +370,8 @@
         return;
     }
     SHRequest *request = [SHRequest requestWithPath:@"installs/alert_settings/" withVersion:SHHostVersion_V1 withParams:nil withMethod:@"POST" withHeaders:nil withBodyOrStream:@[@"pause_minutes", @(pauseMinutes)]];
+    request.isDurable = YES; //only latest setting matters, it supersedes pending one.
+    request.journalKey = @"installs/alert_settings/";
     handler = [handler copy];
     request.requestHandler = ^(SHRequest *saveRequest)
     {